@@ -3,6 +3,7 @@
 
 #include "pb_encode.h"
 #include "pb_decode.h"
+#include "pb_common.h"
 
 
 /* This function reads manually the first tag from the stream and finds the
@@ -15,10 +16,27 @@ inline int decode_unionmessage_tag(pb_istream_t *stream,
     pb_wire_type_t wire_type;
     uint32_t tag;
     bool eof;
+#ifdef PB_ENABLE_FIELD_INDEX
+    const pb_field_index_t *index = pb_field_index_lookup(union_fields_type);
+#endif
 
     while (pb_decode_tag(stream, &wire_type, &tag, &eof)) {
         if (wire_type == PB_WT_STRING) {
             const pb_field_t *field;
+#ifdef PB_ENABLE_FIELD_INDEX
+            if (index != NULL) {
+                /* Use the registered lookup table instead of a linear scan. */
+                pb_size_t position;
+                if (pb_field_index_find(index, tag, &position)) {
+                    field = &union_fields_type[position];
+                    if (field->type & PB_LTYPE_SUBMESSAGE) {
+                        return field->tag;
+                    }
+                }
+                pb_skip_field(stream, wire_type);
+                continue;
+            }
+#endif
             for (field = union_fields_type; field->tag != 0; field++) {
                 if (field->tag == tag && (field->type & PB_LTYPE_SUBMESSAGE)) {
                     /* Found our field. */
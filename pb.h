@@ -13,6 +13,11 @@
 /* Enable support for dynamically allocated fields */
 /* #define PB_ENABLE_MALLOC 1 */
 
+/* Enable allocating pointer fields from an arena, see pb_arena_init() in
+ * pb_decode.h. Requires PB_ENABLE_MALLOC. This adds the arena member to
+ * pb_istream_t, which custom streams must then set or clear. */
+/* #define PB_ENABLE_ARENA 1 */
+
 /* Define this if your CPU architecture is big endian, i.e. it
  * stores the most-significant byte first. */
 /* #define __BIG_ENDIAN__ 1 */
@@ -27,12 +32,34 @@
 /* Add support for tag numbers > 65536 and fields larger than 65536 bytes. */
 /* #define PB_FIELD_32BIT 1 */
 
+/* Enable support for precomputed per-message field lookup tables.
+ * See pb_field_index_init() in pb_common.h. */
+/* #define PB_ENABLE_FIELD_INDEX 1 */
+
+/* Number of hash buckets for finding the registered lookup tables.
+ * Use about as many as there are message types with a lookup table. */
+/* #define PB_FIELD_INDEX_BUCKETS 32 */
+
+/* Enable caching of submessage sizes for the encoder.
+ * See pb_size_cache_init() in pb_encode.h. */
+/* #define PB_ENABLE_SIZE_CACHE 1 */
+
+/* Enable counters of decoder and encoder activity, see pb_stats_t. This
+ * adds the stats member to pb_istream_t and pb_ostream_t, which custom
+ * streams must then set or clear. */
+/* #define PB_ENABLE_STATS 1 */
+
 /* Disable support for error messages in order to save some code space. */
 /* #define PB_NO_ERRMSG 1 */
 
 /* Disable support for custom streams (support only memory buffers). */
 /* #define PB_BUFFER_ONLY 1 */
 
+/* Enable the skip callback in pb_istream_t, for seeking past unknown
+ * fields instead of reading them. Custom streams must then set or clear
+ * the skip member. Has no effect with PB_BUFFER_ONLY. */
+/* #define PB_ENABLE_STREAM_SKIP 1 */
+
 /* Switch back to the old-style callback function signature.
  * This was the default until nanopb-0.2.1. */
 /* #define PB_OLD_CALLBACK_STYLE */
@@ -50,7 +77,7 @@
 
 /* Include all the system headers needed by nanopb. You will need the
  * definitions of the following:
- * - strlen, memcpy, memset functions
+ * - strlen, memcpy, memmove, memset functions
  * - [u]int8_t, [u]int16_t, [u]int32_t, [u]int64_t
  * - size_t
  * - bool
@@ -130,6 +157,10 @@
 #error You should not lower PB_MAX_REQUIRED_FIELDS from the default value (64).
 #endif
 
+#if defined(PB_ENABLE_ARENA) && !defined(PB_ENABLE_MALLOC)
+#error PB_ENABLE_ARENA requires PB_ENABLE_MALLOC.
+#endif
+
 /* List of possible field types. These are used in the autogenerated code.
  * Least-significant 4 bits tell the scalar type
  * Most-significant 4 bits specify repeated/required/packed etc.
@@ -257,6 +288,46 @@ struct pb_bytes_array_s {
 };
 typedef struct pb_bytes_array_s pb_bytes_array_t;
 
+/* This structure is used with the pb_decode_bytes_view() and
+ * pb_encode_bytes_view() callbacks, to refer to bytes or string data stored
+ * outside the message structure without copying it. Note that strings are
+ * not null terminated.
+ */
+typedef struct pb_bytes_view_s pb_bytes_view_t;
+struct pb_bytes_view_s {
+    const uint8_t *bytes; /* Start of the data, or NULL if field is not present */
+    size_t size;          /* Length of the data in bytes */
+    
+    /* Optional storage for data that comes from a callback stream and
+     * therefore cannot be referenced in place. */
+    uint8_t *copy_buffer;
+    size_t copy_buffer_size;
+};
+
+/* Unknown fields skipped by pb_decode_keep_unknown(), for encoding them
+ * again with pb_encode_keep_unknown(). Each span holds the complete
+ * encoding of one or more fields, including the tags. Spans refer to the
+ * input data when decoding from a buffer, and otherwise to copies stored
+ * in copy_buffer. Only top-level fields are recorded, not the unknown
+ * fields of submessages.
+ */
+typedef struct pb_unknown_span_s pb_unknown_span_t;
+struct pb_unknown_span_s {
+    const uint8_t *data;
+    size_t size;
+};
+
+typedef struct pb_unknown_fields_s pb_unknown_fields_t;
+struct pb_unknown_fields_s {
+    pb_unknown_span_t *spans;
+    size_t max_spans;
+    size_t span_count;
+
+    uint8_t *copy_buffer;
+    size_t copy_buffer_size;
+    size_t copy_buffer_used;
+};
+
 /* This structure is used for giving the callback function.
  * It is stored in the message structure and filled in by the method that
  * calls pb_decode.
@@ -365,6 +436,51 @@ struct pb_extension_s {
 #   endif
 #endif
 
+/* Counters of decoder and encoder activity, for profiling. Each stream
+ * counts into the pb_stats_t its stats member points to. Streams created
+ * with pb_istream_from_buffer() and pb_ostream_from_buffer() use the global
+ * pb_stats, so point stats to your own counters to measure a single stream,
+ * or set it to NULL to leave the stream out. Substreams count into the
+ * same place as their parent. The counters are not atomic, so give each
+ * thread its own counters if several threads decode or encode at once.
+ *
+ * Custom streams that are filled in member by member must set stats too,
+ * or be zeroed first. An uninitialized stats pointer is written through on
+ * every read or write. */
+#ifdef PB_ENABLE_STATS
+typedef struct pb_stats_s pb_stats_t;
+struct pb_stats_s {
+    unsigned long bytes_read;       /* Bytes consumed from input streams */
+    unsigned long bytes_written;    /* Bytes written, not counting sizing streams */
+    unsigned long callbacks;        /* Calls to field callback functions */
+    unsigned long fields_decoded[PB_LTYPES_COUNT]; /* Decoded fields by PB_LTYPE */
+    unsigned long unknown_fields;   /* Unknown fields skipped or stored */
+    unsigned long substreams;       /* Length-delimited substreams opened */
+    unsigned long sizing_passes;    /* Encodes done only to compute a size */
+    unsigned long errors;           /* Errors returned with PB_RETURN_ERROR */
+    const char *last_error;         /* Message of the latest error */
+};
+
+extern pb_stats_t pb_stats;
+
+#define PB_STATS_ADD(stream, counter, count) \
+    do { \
+        if ((stream)->stats != NULL) \
+            (stream)->stats->counter += (count); \
+    } while(0)
+#define PB_STATS_ERROR(stream, msg) \
+    do { \
+        if ((stream)->stats != NULL) \
+        { \
+            (stream)->stats->errors++; \
+            (stream)->stats->last_error = (msg); \
+        } \
+    } while(0)
+#else
+#define PB_STATS_ADD(stream, counter, count) do {} while(0)
+#define PB_STATS_ERROR(stream, msg) do {} while(0)
+#endif
+
 /* This is used to inform about need to regenerate .pb.h/.pb.c files. */
 #define PB_PROTO_HEADER_VERSION 30
 
@@ -502,6 +618,7 @@ struct pb_extension_s {
 #define PB_RETURN_ERROR(stream,msg) \
     do {\
         PB_UNUSED(stream); \
+        PB_STATS_ERROR(stream, msg); \
         return false; \
     } while(0)
 #define PB_GET_ERROR(stream) "(errmsg disabled)"
@@ -510,6 +627,7 @@ struct pb_extension_s {
     do {\
         if ((stream)->errmsg == NULL) \
             (stream)->errmsg = (msg); \
+        PB_STATS_ERROR(stream, msg); \
         return false; \
     } while(0)
 #define PB_GET_ERROR(stream) ((stream)->errmsg ? (stream)->errmsg : "(none)")
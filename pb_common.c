@@ -5,18 +5,82 @@
 
 #include "pb_common.h"
 
-bool pb_field_iter_begin(pb_field_iter_t *iter, const pb_field_t *fields, void *dest_struct)
+#ifdef PB_ENABLE_STATS
+pb_stats_t pb_stats;
+#endif
+
+#ifdef PB_ENABLE_FIELD_INDEX
+#ifndef PB_FIELD_INDEX_BUCKETS
+#define PB_FIELD_INDEX_BUCKETS 32
+#endif
+
+/* Lookup tables registered with pb_field_index_init(), hashed by the
+ * address of the pb_field_t array and chained through their next field. */
+static pb_field_index_t *pb_field_index_buckets[PB_FIELD_INDEX_BUCKETS];
+
+static pb_field_index_t **pb_field_index_bucket(const pb_field_t fields[])
 {
-    iter->start = fields;
-    iter->pos = fields;
+    uintptr_t key = (uintptr_t)fields / sizeof(pb_field_t);
+    return &pb_field_index_buckets[key % PB_FIELD_INDEX_BUCKETS];
+}
+#endif
+
+size_t pb_field_struct_size(const pb_field_t *field)
+{
+    size_t size = field->data_size;
+
+    if (PB_ATYPE(field->type) == PB_ATYPE_STATIC &&
+        PB_HTYPE(field->type) == PB_HTYPE_REPEATED)
+    {
+        /* In static arrays, the data_size tells the size of a single entry and
+         * array_size is the number of entries */
+        size *= field->array_size;
+    }
+    else if (PB_ATYPE(field->type) == PB_ATYPE_POINTER)
+    {
+        /* Pointer fields always have a constant size in the main structure.
+         * The data_size only applies to the dynamically allocated area. */
+        size = sizeof(void*);
+    }
+
+    return size;
+}
+
+/* Move the iterator back to the first field. */
+static bool pb_field_iter_rewind(pb_field_iter_t *iter)
+{
+    iter->pos = iter->start;
     iter->required_field_index = 0;
-    iter->dest_struct = dest_struct;
-    iter->pData = (char*)dest_struct + iter->pos->data_offset;
+    iter->pData = (char*)iter->dest_struct + iter->pos->data_offset;
     iter->pSize = (char*)iter->pData + iter->pos->size_offset;
     
     return (iter->pos->tag != 0);
 }
 
+#ifdef PB_ENABLE_FIELD_INDEX
+/* Point the iterator at the field in the given position, using the
+ * absolute offsets stored in the lookup table. */
+static void pb_field_iter_load_entry(pb_field_iter_t *iter, pb_size_t position)
+{
+    const pb_field_index_entry_t *entry = &iter->index->entries[position];
+    iter->pos = iter->start + position;
+    iter->required_field_index = entry->required_field_index;
+    iter->pData = (char*)iter->dest_struct + entry->data_offset;
+    iter->pSize = (char*)iter->dest_struct + entry->size_offset;
+}
+#endif
+
+bool pb_field_iter_begin(pb_field_iter_t *iter, const pb_field_t *fields, void *dest_struct)
+{
+    iter->start = fields;
+    iter->dest_struct = dest_struct;
+#ifdef PB_ENABLE_FIELD_INDEX
+    iter->index = pb_field_index_lookup(fields);
+#endif
+    
+    return pb_field_iter_rewind(iter);
+}
+
 bool pb_field_iter_next(pb_field_iter_t *iter)
 {
     const pb_field_t *prev_field = iter->pos;
@@ -33,27 +97,21 @@ bool pb_field_iter_next(pb_field_iter_t *iter)
     if (iter->pos->tag == 0)
     {
         /* Wrapped back to beginning, reinitialize */
-        (void)pb_field_iter_begin(iter, iter->start, iter->dest_struct);
+        (void)pb_field_iter_rewind(iter);
         return false;
     }
+#ifdef PB_ENABLE_FIELD_INDEX
+    else if (iter->index != NULL)
+    {
+        /* Take the pointers directly from the lookup table */
+        pb_field_iter_load_entry(iter, (pb_size_t)(iter->pos - iter->start));
+        return true;
+    }
+#endif
     else
     {
         /* Increment the pointers based on previous field size */
-        size_t prev_size = prev_field->data_size;
-    
-        if (PB_ATYPE(prev_field->type) == PB_ATYPE_STATIC &&
-            PB_HTYPE(prev_field->type) == PB_HTYPE_REPEATED)
-        {
-            /* In static arrays, the data_size tells the size of a single entry and
-             * array_size is the number of entries */
-            prev_size *= prev_field->array_size;
-        }
-        else if (PB_ATYPE(prev_field->type) == PB_ATYPE_POINTER)
-        {
-            /* Pointer fields always have a constant size in the main structure.
-             * The data_size only applies to the dynamically allocated area. */
-            prev_size = sizeof(void*);
-        }
+        size_t prev_size = pb_field_struct_size(prev_field);
         
         if (PB_HTYPE(prev_field->type) == PB_HTYPE_REQUIRED)
         {
@@ -68,10 +126,58 @@ bool pb_field_iter_next(pb_field_iter_t *iter)
     }
 }
 
+bool pb_field_iter_prev(pb_field_iter_t *iter)
+{
+    const pb_field_t *next_field = iter->pos;
+    
+    if (iter->pos == iter->start)
+    {
+        /* Wrap around to the last field */
+        pb_field_iter_t last = *iter;
+        while (pb_field_iter_next(iter))
+            last = *iter;
+        *iter = last;
+        return false;
+    }
+    
+    iter->pos--;
+    
+#ifdef PB_ENABLE_FIELD_INDEX
+    if (iter->index != NULL)
+    {
+        /* Take the pointers directly from the lookup table */
+        pb_field_iter_load_entry(iter, (pb_size_t)(iter->pos - iter->start));
+        return true;
+    }
+#endif
+    
+    /* Reverse the pointer increment done by pb_field_iter_next() */
+    if (PB_HTYPE(iter->pos->type) == PB_HTYPE_REQUIRED)
+        iter->required_field_index--;
+    
+    iter->pData = (char*)iter->pData - next_field->data_offset - pb_field_struct_size(iter->pos);
+    iter->pSize = (char*)iter->pData + iter->pos->size_offset;
+    return true;
+}
+
 bool pb_field_iter_find(pb_field_iter_t *iter, uint32_t tag)
 {
     const pb_field_t *start = iter->pos;
     
+#ifdef PB_ENABLE_FIELD_INDEX
+    if (iter->index != NULL)
+    {
+        /* Jump directly to the field using the lookup table */
+        pb_size_t position;
+        
+        if (!pb_field_index_find(iter->index, tag, &position))
+            return false;
+        
+        pb_field_iter_load_entry(iter, position);
+        return true;
+    }
+#endif
+    
     do {
         if (iter->pos->tag == tag &&
             PB_LTYPE(iter->pos->type) != PB_LTYPE_EXTENSION)
@@ -87,4 +193,140 @@ bool pb_field_iter_find(pb_field_iter_t *iter, uint32_t tag)
     return false;
 }
 
+bool pb_field_iter_seek(pb_field_iter_t *iter, pb_size_t position)
+{
+#ifdef PB_ENABLE_FIELD_INDEX
+    if (iter->index != NULL)
+    {
+        if (position >= iter->index->field_count)
+        {
+            (void)pb_field_iter_rewind(iter);
+            return false;
+        }
+        
+        pb_field_iter_load_entry(iter, position);
+        return true;
+    }
+#endif
+    
+    /* No lookup table, walk from the start */
+    if (!pb_field_iter_rewind(iter))
+        return false;
+    
+    while (position--)
+    {
+        if (!pb_field_iter_next(iter))
+            return false;
+    }
+    
+    return true;
+}
+
+#ifdef PB_ENABLE_FIELD_INDEX
+bool pb_field_index_init(pb_field_index_t *index, const pb_field_t fields[],
+                         pb_field_index_entry_t entries[], pb_size_t max_entries)
+{
+    const pb_field_t *field;
+    size_t data_offset = 0;
+    unsigned required_field_index = 0;
+    pb_size_t count = 0;
+    pb_size_t tag_count = 0;
+    
+    /* Compute absolute offsets the same way as pb_field_iter_next() */
+    for (field = fields; field->tag != 0; field++)
+    {
+        pb_field_index_entry_t *entry;
+        
+        if (count == max_entries)
+            return false;
+        
+        entry = &entries[count];
+        
+        if (field != fields)
+            data_offset += pb_field_struct_size(field - 1);
+        data_offset += field->data_offset;
+        
+        entry->data_offset = data_offset;
+        /* size_offset is relative to the field data and may be negative */
+        entry->size_offset = (size_t)((long)data_offset + field->size_offset);
+        entry->required_field_index = required_field_index;
+        
+        if (PB_HTYPE(field->type) == PB_HTYPE_REQUIRED)
+            required_field_index++;
+        
+        /* Insertion sort of the non-extension fields by tag */
+        if (PB_LTYPE(field->type) != PB_LTYPE_EXTENSION)
+        {
+            pb_size_t i = tag_count;
+            while (i > 0 && fields[entries[i - 1].by_tag].tag > field->tag)
+            {
+                entries[i].by_tag = entries[i - 1].by_tag;
+                i--;
+            }
+            entries[i].by_tag = count;
+            tag_count++;
+        }
+        
+        count++;
+    }
+    
+    index->fields = fields;
+    index->entries = entries;
+    index->field_count = count;
+    index->tag_count = tag_count;
+    index->required_count = required_field_index;
+    
+    if (pb_field_index_lookup(fields) == NULL)
+    {
+        pb_field_index_t **bucket = pb_field_index_bucket(fields);
+        index->next = *bucket;
+        *bucket = index;
+    }
+    
+    return true;
+}
+
+const pb_field_index_t *pb_field_index_lookup(const pb_field_t fields[])
+{
+    const pb_field_index_t *index;
+    
+    for (index = *pb_field_index_bucket(fields); index != NULL; index = index->next)
+    {
+        if (index->fields == fields)
+            return index;
+    }
+    
+    return NULL;
+}
+
+bool pb_field_index_find(const pb_field_index_t *index, uint32_t tag, pb_size_t *position)
+{
+    pb_size_t low = 0;
+    pb_size_t high = index->tag_count;
+    
+    /* Binary search in the tag-sorted order */
+    while (low < high)
+    {
+        pb_size_t mid = (pb_size_t)(low + (high - low) / 2);
+        pb_size_t pos = index->entries[mid].by_tag;
+        uint32_t mid_tag = index->fields[pos].tag;
+        
+        if (mid_tag == tag)
+        {
+            *position = pos;
+            return true;
+        }
+        else if (mid_tag < tag)
+        {
+            low = (pb_size_t)(mid + 1);
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    
+    return false;
+}
+#endif
 
@@ -11,6 +11,31 @@
 extern "C" {
 #endif
 
+#ifdef PB_ENABLE_FIELD_INDEX
+/* Precomputed information about a single field, see pb_field_index_t. */
+typedef struct pb_field_index_entry_s pb_field_index_entry_t;
+struct pb_field_index_entry_s {
+    size_t data_offset;            /* Offset of field data from start of the structure */
+    size_t size_offset;            /* Offset of count/has field from start of the structure */
+    unsigned required_field_index; /* Same as in pb_field_iter_t */
+    pb_size_t by_tag;              /* Position of the field with the n:th smallest tag */
+};
+
+/* Lookup table for a single message type. The table is built once at
+ * runtime into storage provided by the caller, and registered so that
+ * every field iterator for the message type will find and use it.
+ */
+typedef struct pb_field_index_s pb_field_index_t;
+struct pb_field_index_s {
+    const pb_field_t *fields;        /* Message type described by the index */
+    pb_field_index_entry_t *entries; /* One entry per field, in pb_field_t order */
+    pb_size_t field_count;           /* Number of fields, not counting the terminator */
+    pb_size_t tag_count;             /* Number of by_tag entries (extensions are not included) */
+    unsigned required_count;         /* Number of required fields */
+    pb_field_index_t *next;          /* Next registered index in the same hash bucket */
+};
+#endif
+
 /* Iterator for pb_field_t list */
 struct pb_field_iter_s {
     const pb_field_t *start;       /* Start of the pb_field_t array */
@@ -19,9 +44,15 @@ struct pb_field_iter_s {
     void *dest_struct;             /* Pointer to start of the structure */
     void *pData;                   /* Pointer to current field value */
     void *pSize;                   /* Pointer to count/has field */
+#ifdef PB_ENABLE_FIELD_INDEX
+    const pb_field_index_t *index; /* Lookup table for the message type, or NULL */
+#endif
 };
 typedef struct pb_field_iter_s pb_field_iter_t;
 
+/* Size of the field storage in the message structure. */
+size_t pb_field_struct_size(const pb_field_t *field);
+
 /* Initialize the field iterator structure to beginning.
  * Returns false if the message type is empty. */
 bool pb_field_iter_begin(pb_field_iter_t *iter, const pb_field_t *fields, void *dest_struct);
@@ -30,10 +61,54 @@ bool pb_field_iter_begin(pb_field_iter_t *iter, const pb_field_t *fields, void *
  * Returns false when the iterator wraps back to the first field. */
 bool pb_field_iter_next(pb_field_iter_t *iter);
 
+/* Move the iterator back to the previous field.
+ * Returns false when the iterator wraps around to the last field. */
+bool pb_field_iter_prev(pb_field_iter_t *iter);
+
 /* Advance the iterator until it points at a field with the given tag.
  * Returns false if no such field exists. */
 bool pb_field_iter_find(pb_field_iter_t *iter, uint32_t tag);
 
+/* Move the iterator to the field at the given zero-based position in the
+ * pb_field_t array. This is a direct jump if a lookup table is registered
+ * for the message type, otherwise the fields are walked from the start.
+ * Returns false if there is no such field, leaving the iterator at the
+ * first field. */
+bool pb_field_iter_seek(pb_field_iter_t *iter, pb_size_t position);
+
+#ifdef PB_ENABLE_FIELD_INDEX
+/* Build a lookup table for the message type and register it, so that
+ * pb_field_iter_find() and the decoder can find fields by a binary search
+ * on the tag instead of walking through the pb_field_t array. Iterators
+ * also take the field pointers directly from the table's absolute offsets,
+ * which speeds up every walk over the fields (encoding, initialization to
+ * defaults, pb_release() and the message update helpers).
+ * The entries array must have room for all the fields of the message.
+ * Call this once for each message type before decoding, e.g. at startup.
+ * Iterators find the table with a hash lookup, see PB_FIELD_INDEX_BUCKETS
+ * in pb.h. Registration is not thread-safe: register all tables before
+ * any encoding or decoding that may run concurrently, such as with
+ * pb_parallel.h. Lookups only read the registry.
+ *
+ * Example usage:
+ *    static pb_field_index_entry_t entries[40];
+ *    static pb_field_index_t index;
+ *    pb_field_index_init(&index, MyMessage_fields, entries, 40);
+ *
+ * Returns false if the entries array is too small.
+ */
+bool pb_field_index_init(pb_field_index_t *index, const pb_field_t fields[],
+                         pb_field_index_entry_t entries[], pb_size_t max_entries);
+
+/* Find the registered lookup table for a message type.
+ * Returns NULL if pb_field_index_init() has not been called for it. */
+const pb_field_index_t *pb_field_index_lookup(const pb_field_t fields[]);
+
+/* Find the position of a non-extension field with the given tag.
+ * Returns false if no such field exists. */
+bool pb_field_index_find(const pb_field_index_t *index, uint32_t tag, pb_size_t *position);
+#endif
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
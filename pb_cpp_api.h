@@ -1,6 +1,7 @@
 #ifndef ___PB_CPP_API__H___
 #define ___PB_CPP_API__H___
 
+#include <string.h>
 #include <pb_decode.h>
 #include <pb_encode.h>
 
@@ -8,9 +9,9 @@
 namespace nanopb {
 
 template <typename Obj, typename Fields>
-inline UInt8Array serialize_to_array(Obj &obj, Fields &fields,
-                                     UInt8Array output) {
-  pb_ostream_t ostream = pb_ostream_from_buffer(output.data, output.length);
+inline UInt8Array serialize_to_stream(Obj &obj, Fields &fields,
+                                      pb_ostream_t &ostream,
+                                      UInt8Array output) {
   bool ok = pb_encode(&ostream, fields, &obj);
   if (ok) {
     output.length = ostream.bytes_written;
@@ -22,6 +23,28 @@ inline UInt8Array serialize_to_array(Obj &obj, Fields &fields,
 }
 
 
+template <typename Obj, typename Fields>
+inline UInt8Array serialize_to_array(Obj &obj, Fields &fields,
+                                     UInt8Array output) {
+  pb_ostream_t ostream = pb_ostream_from_buffer(output.data, output.length);
+  return serialize_to_stream(obj, fields, ostream, output);
+}
+
+
+#ifdef PB_ENABLE_SIZE_CACHE
+/* Same as above, but submessage sizes are taken from and stored into
+ * `size_cache` (see `pb_size_cache_init`). */
+template <typename Obj, typename Fields>
+inline UInt8Array serialize_to_array(Obj &obj, Fields &fields,
+                                     UInt8Array output,
+                                     pb_size_cache_t *size_cache) {
+  pb_ostream_t ostream = pb_ostream_from_buffer(output.data, output.length);
+  ostream.size_cache = size_cache;
+  return serialize_to_stream(obj, fields, ostream, output);
+}
+#endif
+
+
 template <typename Fields, typename Obj>
 inline bool decode_from_array(UInt8Array input, Fields const &fields, Obj &obj,
                               bool init_default=false) {
@@ -34,19 +57,109 @@ inline bool decode_from_array(UInt8Array input, Fields const &fields, Obj &obj,
 }
 
 
+/* Decode only the fields selected by `mask` (see `pb_decode_projected`).
+ * The other fields of `obj` are left untouched unless `init_default` is
+ * set. */
+template <typename Fields, typename Obj>
+inline bool decode_from_array(UInt8Array input, Fields const &fields, Obj &obj,
+                              const pb_field_mask_t &mask,
+                              bool init_default=false) {
+  pb_istream_t istream = pb_istream_from_buffer(input.data, input.length);
+  if (init_default) {
+    pb_message_set_to_defaults(fields, &obj);
+  }
+  return pb_decode_projected(&istream, fields, &obj, &mask);
+}
+
+
+/* Decode a bytes or string callback field as a view into the input array,
+ * instead of copying the data (see `pb_decode_bytes_view`).  The array
+ * passed to `decode_from_array` must outlive the view. */
+inline void set_bytes_view_decoder(pb_callback_t &callback,
+                                   pb_bytes_view_t &view) {
+  callback.funcs.decode = &pb_decode_bytes_view;
+  callback.arg = &view;
+}
+
+
+/* Encode a bytes or string callback field from a view (see
+ * `pb_encode_bytes_view`). */
+inline void set_bytes_view_encoder(pb_callback_t &callback,
+                                   pb_bytes_view_t &view) {
+  callback.funcs.encode = &pb_encode_bytes_view;
+  callback.arg = &view;
+}
+
+
+/* Submessage that is only decoded on first access.
+ *
+ * Bind it to a callback submessage field before each decode of the outer
+ * message.  While decoding from an array, only the location of the encoded
+ * submessage is recorded; `get()` decodes it when it is first needed.  The
+ * input array must outlive the first `get()` call.
+ *
+ * Example usage:
+ *
+ *     nanopb::LazyMessage<Header> header(Header_fields);
+ *     header.bind(packet.header);
+ *     nanopb::decode_from_array(input, Packet_fields, packet);
+ *     if (header.get() != NULL) { route(header._); } */
+template <typename Msg>
+class LazyMessage {
+public:
+  Msg _;
+  pb_lazy_submessage_t lazy_;
+
+  LazyMessage(const pb_field_t *fields) {
+    lazy_.fields = fields;
+    lazy_.dest = &_;
+    clear();
+  }
+
+  void clear() {
+    lazy_.encoded.bytes = NULL;
+    lazy_.encoded.size = 0;
+    lazy_.encoded.copy_buffer = NULL;
+    lazy_.encoded.copy_buffer_size = 0;
+    lazy_.present = false;
+    lazy_.decoded = false;
+  }
+
+  void bind(pb_callback_t &callback) {
+    clear();
+    callback.funcs.decode = &pb_decode_lazy_submessage;
+    callback.arg = &lazy_;
+  }
+
+  bool present() const { return lazy_.present; }
+
+  /* Encoded submessage, e.g., for forwarding it without decoding.  Only
+   * valid while the submessage has not been decoded. */
+  const pb_bytes_view_t &encoded() const { return lazy_.encoded; }
+
+  Msg *get() { return pb_lazy_submessage_get(&lazy_) ? &_ : NULL; }
+};
+
+
+/* Default values of a message type, initialized on first use.  Copying the
+ * image is much cheaper than walking the field descriptors on every reset.
+ * Callback fields are zeroed in the image. */
+template <typename Msg>
+inline const Msg &default_image(const pb_field_t *fields) {
+  static Msg image;
+  static bool initialized = false;
+  if (!initialized) {
+    memset(&image, 0, sizeof(image));
+    pb_message_set_to_defaults(fields, &image);
+    initialized = true;
+  }
+  return image;
+}
+
+
 template <typename Msg>
 inline Msg get_pb_default(const pb_field_t *fields) {
-  /* Use nanopb decode with `init_default` set to `true` as a workaround to
-   * avoid needing to initialize the object (i.e., `_`) using the
-   * `<message>_init_default` macro.
-   *
-   * This is necessary because the macro resolves to an initialization list,
-   * which cannot be referenced in a memory efficient, generalizable way. */
-  Msg obj;
-  UInt8Array null_array;
-  null_array.length = 0;
-  decode_from_array(null_array, fields, obj, true);
-  return obj;
+  return default_image<Msg>(fields);
 }
 
 
@@ -57,38 +170,79 @@ public:
   Validator validator_;
   UInt8Array buffer_;
   const pb_field_t *fields_;
+#ifdef PB_ENABLE_SIZE_CACHE
+  pb_size_cache_t *size_cache_;
+#endif
 
-  Message(const pb_field_t *fields) : fields_(fields) {}
+  Message(const pb_field_t *fields) : fields_(fields) { init(); }
 
   Message(const pb_field_t *fields, size_t buffer_size, uint8_t *buffer)
     : fields_(fields) {
     buffer_.length = buffer_size;
     buffer_.data = buffer;
+    init();
   }
 
   Message(const pb_field_t *fields, UInt8Array buffer)
-    : fields_(fields), buffer_(buffer) {}
+    : fields_(fields), buffer_(buffer) { init(); }
 
   void set_buffer(UInt8Array buffer) { buffer_ = buffer; }
 
-  void reset() { _ = get_pb_default<Msg>(fields_); }
+#ifdef PB_ENABLE_SIZE_CACHE
+  /* Remember submessage sizes across `serialize()` and `encoded_size()`
+   * calls.  After changing a field of `_`, pass its address to
+   * `invalidate()`.  `reset()`, `update()` and `validate()` clear the
+   * cache. */
+  void set_size_cache(pb_size_cache_t *size_cache) { size_cache_ = size_cache; }
+  void invalidate(const void *changed) {
+    if (size_cache_ != NULL) { pb_size_cache_invalidate(size_cache_, changed); }
+  }
+  bool encoded_size(size_t &size) {
+    return pb_get_encoded_size_cached(&size, fields_, &_, size_cache_);
+  }
+#endif
+
+  void reset() {
+    _ = default_image<Msg>(fields_);
+    clear_size_cache();
+  }
   uint8_t update(UInt8Array serialized) {
     Msg &obj = *((Msg *)buffer_.data);
     bool ok = decode_from_array(serialized, fields_, obj, true);
     if (ok) {
       validator_.update(fields_, obj, _);
+      clear_size_cache();
     }
     return ok;
   }
   UInt8Array serialize() {
+#ifdef PB_ENABLE_SIZE_CACHE
+    return serialize_to_array(_, fields_, buffer_, size_cache_);
+#else
     return serialize_to_array(_, fields_, buffer_);
+#endif
   }
   void validate() {
     Msg &obj = *((Msg *)buffer_.data);
-    obj = get_pb_default<Msg>(fields_);
+    obj = default_image<Msg>(fields_);
     /* Validate the active configuration structure (i.e., trigger the
      * validation callbacks). */
     validator_.update(fields_, _, obj);
+    clear_size_cache();
+  }
+
+private:
+  void init() {
+#ifdef PB_ENABLE_SIZE_CACHE
+    size_cache_ = NULL;
+#endif
+  }
+  /* Forget the cached sizes after `_` has been replaced, or changed by
+   * the validator. */
+  void clear_size_cache() {
+#ifdef PB_ENABLE_SIZE_CACHE
+    if (size_cache_ != NULL) { pb_size_cache_clear(size_cache_); }
+#endif
   }
 };
 
@@ -23,16 +23,46 @@
 
 typedef bool (*pb_decoder_t)(pb_istream_t *stream, const pb_field_t *field, void *dest) checkreturn;
 
+/* Storage that the decoder has allocated for a repeated pointer field
+ * during the current decode_fields() call. Arrays that were allocated
+ * elsewhere may be full, so their capacity is not known. */
+typedef struct {
+    const void *field;  /* Location of the array pointer, or NULL */
+    const void *array;  /* The allocation that the capacity applies to */
+    size_t capacity;    /* Number of entries allocated */
+} pointer_array_t;
+
+/* Number of repeated pointer fields tracked at once, so that interleaved
+ * fields each keep their capacity. */
+#ifdef PB_ENABLE_MALLOC
+#define PB_POINTER_ARRAYS 4
+#else
+#define PB_POINTER_ARRAYS 1
+#endif
+
+typedef struct {
+    pointer_array_t entries[PB_POINTER_ARRAYS];
+    pb_size_t next;     /* Entry to reuse for the next untracked field */
+} pointer_arrays_t;
+
+#ifndef PB_BUFFER_ONLY
 static bool checkreturn buf_read(pb_istream_t *stream, uint8_t *buf, size_t count);
+static bool checkreturn transient_buf_read(pb_istream_t *stream, uint8_t *buf, size_t count);
+static bool checkreturn input_buffer_read(pb_istream_t *stream, uint8_t *buf, size_t count);
+static bool checkreturn input_buffer_skip(pb_istream_t *stream, size_t count);
+#endif
+static pb_istream_t pb_istream_from_transient_buffer(uint8_t *buf, size_t bufsize);
+static pb_istream_t pb_istream_from_const_buffer(const uint8_t *buf, size_t bufsize);
 static bool checkreturn pb_decode_varint32(pb_istream_t *stream, uint32_t *dest);
 static bool checkreturn read_raw_value(pb_istream_t *stream, pb_wire_type_t wire_type, uint8_t *buf, size_t *size);
+static bool checkreturn decode_packed_fixed(pb_istream_t *stream, const pb_field_t *field, void *pArray, pb_size_t *size, size_t max_count);
+static bool checkreturn decode_packed_varint(pb_istream_t *stream, const pb_field_t *field, void *pArray, pb_size_t *size, size_t max_count);
 static bool checkreturn decode_static_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter);
 static bool checkreturn decode_callback_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter);
-static bool checkreturn decode_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter);
+static bool checkreturn decode_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter, pointer_arrays_t *arrays);
 static bool checkreturn default_extension_decoder(pb_istream_t *stream, pb_extension_t *extension, uint32_t tag, pb_wire_type_t wire_type);
 static bool checkreturn decode_extension(pb_istream_t *stream, uint32_t tag, pb_wire_type_t wire_type, pb_field_iter_t *iter);
 static bool checkreturn find_extension_field(pb_field_iter_t *iter);
-static void pb_message_set_to_defaults(const pb_field_t fields[], void *dest_struct);
 static bool checkreturn pb_dec_varint(pb_istream_t *stream, const pb_field_t *field, void *dest);
 static bool checkreturn pb_dec_uvarint(pb_istream_t *stream, const pb_field_t *field, void *dest);
 static bool checkreturn pb_dec_svarint(pb_istream_t *stream, const pb_field_t *field, void *dest);
@@ -41,6 +71,8 @@ static bool checkreturn pb_dec_fixed64(pb_istream_t *stream, const pb_field_t *f
 static bool checkreturn pb_dec_bytes(pb_istream_t *stream, const pb_field_t *field, void *dest);
 static bool checkreturn pb_dec_string(pb_istream_t *stream, const pb_field_t *field, void *dest);
 static bool checkreturn pb_dec_submessage(pb_istream_t *stream, const pb_field_t *field, void *dest);
+static bool checkreturn decode_fields(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct,
+                                      const pb_field_mask_t *mask, pb_unknown_fields_t *unknown);
 static bool checkreturn pb_skip_varint(pb_istream_t *stream);
 static bool checkreturn pb_skip_string(pb_istream_t *stream);
 
@@ -69,6 +101,7 @@ static const pb_decoder_t PB_DECODERS[PB_LTYPES_COUNT] = {
  * pb_istream_t implementation *
  *******************************/
 
+#ifndef PB_BUFFER_ONLY
 static bool checkreturn buf_read(pb_istream_t *stream, uint8_t *buf, size_t count)
 {
     uint8_t *source = (uint8_t*)stream->state;
@@ -83,10 +116,84 @@ static bool checkreturn buf_read(pb_istream_t *stream, uint8_t *buf, size_t coun
     return true;
 }
 
+/* Same as buf_read(), but marks streams over temporary copies of the data */
+static bool checkreturn transient_buf_read(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    return buf_read(stream, buf, count);
+}
+#endif
+
+/* Check if the stream reads from a memory buffer created by
+ * pb_istream_from_buffer() or pb_istream_from_transient_buffer(). In that
+ * case stream->state points directly to the next input byte, and the
+ * callback can be bypassed. */
+static bool pb_is_buffer_stream(const pb_istream_t *stream)
+{
+#ifdef PB_BUFFER_ONLY
+    PB_UNUSED(stream);
+    return true;
+#else
+    return stream->callback == &buf_read || stream->callback == &transient_buf_read;
+#endif
+}
+
+/* Check if the stream reads from a memory buffer that stays valid after
+ * decoding, so that callbacks may keep pointers into it. */
+static bool pb_is_stable_buffer_stream(const pb_istream_t *stream)
+{
+#ifdef PB_BUFFER_ONLY
+    return stream->callback == NULL;
+#else
+    return stream->callback == &buf_read;
+#endif
+}
+
 bool checkreturn pb_read(pb_istream_t *stream, uint8_t *buf, size_t count)
 {
+    if (pb_is_buffer_stream(stream))
+    {
+        /* Copy or skip directly from the memory buffer */
+        uint8_t *source = (uint8_t*)stream->state;
+
+        if (stream->bytes_left < count)
+            PB_RETURN_ERROR(stream, "end-of-stream");
+
+        if (buf != NULL)
+            memcpy(buf, source, count);
+
+        stream->state = source + count;
+        stream->bytes_left -= count;
+        PB_STATS_ADD(stream, bytes_read, count);
+        return true;
+    }
+
 #ifndef PB_BUFFER_ONLY
-	if (buf == NULL && stream->callback != buf_read)
+    if (buf == NULL)
+    {
+        bool (*skip)(pb_istream_t *stream, size_t count) = NULL;
+
+        if (stream->callback == &input_buffer_read)
+            skip = &input_buffer_skip;
+#if defined(PB_ENABLE_STREAM_SKIP) && !defined(PB_BUFFER_ONLY)
+        else
+            skip = stream->skip;
+#endif
+
+        if (skip != NULL)
+        {
+            if (stream->bytes_left < count)
+                PB_RETURN_ERROR(stream, "end-of-stream");
+
+            if (!skip(stream, count))
+                PB_RETURN_ERROR(stream, "io error");
+
+            stream->bytes_left -= count;
+            PB_STATS_ADD(stream, bytes_read, count);
+            return true;
+        }
+    }
+
+	if (buf == NULL)
 	{
 		/* Skip input bytes */
 		uint8_t tmp[16];
@@ -100,23 +207,111 @@ bool checkreturn pb_read(pb_istream_t *stream, uint8_t *buf, size_t count)
 
 		return pb_read(stream, tmp, count);
 	}
-#endif
 
     if (stream->bytes_left < count)
         PB_RETURN_ERROR(stream, "end-of-stream");
 
-#ifndef PB_BUFFER_ONLY
     if (!stream->callback(stream, buf, count))
         PB_RETURN_ERROR(stream, "io error");
-#else
-    if (!buf_read(stream, buf, count))
-        return false;
-#endif
 
     stream->bytes_left -= count;
+    PB_STATS_ADD(stream, bytes_read, count);
+#endif
+
+    return true;
+}
+
+#ifndef PB_BUFFER_ONLY
+static bool checkreturn input_buffer_read(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    pb_input_buffer_t *input = (pb_input_buffer_t*)stream->state;
+
+    while (count > 0)
+    {
+        size_t n = input->end - input->start;
+
+        if (n == 0)
+        {
+            if (count >= input->size && buf != NULL)
+            {
+                /* Large reads go directly to the destination */
+                n = input->read(input->state, buf, count);
+                if (n == 0 || n > count)
+                    return false;
+
+                buf += n;
+                count -= n;
+                continue;
+            }
+
+            input->start = 0;
+            input->end = input->read(input->state, input->buffer, input->size);
+            if (input->end == 0 || input->end > input->size)
+            {
+                input->end = 0;
+                return false;
+            }
+
+            n = input->end;
+        }
+
+        if (n > count)
+            n = count;
+
+        if (buf != NULL)
+        {
+            memcpy(buf, input->buffer + input->start, n);
+            buf += n;
+        }
+
+        input->start += n;
+        count -= n;
+    }
+
+    return true;
+}
+
+static bool checkreturn input_buffer_skip(pb_istream_t *stream, size_t count)
+{
+    pb_input_buffer_t *input = (pb_input_buffer_t*)stream->state;
+
+    /* Discard buffered data first, then refill the whole buffer at a time */
+    while (count > input->end - input->start)
+    {
+        count -= input->end - input->start;
+        input->start = 0;
+        input->end = input->read(input->state, input->buffer, input->size);
+        if (input->end == 0 || input->end > input->size)
+        {
+            input->end = 0;
+            return false;
+        }
+    }
+
+    input->start += count;
     return true;
 }
 
+void pb_input_buffer_init(pb_input_buffer_t *input, pb_read_func_t read, void *state,
+                          uint8_t *buffer, size_t size)
+{
+    input->read = read;
+    input->state = state;
+    input->buffer = buffer;
+    input->size = size;
+    input->start = 0;
+    input->end = 0;
+}
+
+pb_istream_t pb_istream_from_input_buffer(pb_input_buffer_t *input, size_t bytes_left)
+{
+    pb_istream_t stream = pb_istream_from_buffer(NULL, bytes_left);
+    stream.callback = &input_buffer_read;
+    stream.state = input;
+    return stream;
+}
+#endif
+
 /* Read a single byte from input stream. buf may not be NULL.
  * This is an optimization for the varint decoding. */
 static bool checkreturn pb_readbyte(pb_istream_t *stream, uint8_t *buf)
@@ -124,15 +319,27 @@ static bool checkreturn pb_readbyte(pb_istream_t *stream, uint8_t *buf)
     if (stream->bytes_left == 0)
         PB_RETURN_ERROR(stream, "end-of-stream");
 
+    if (pb_is_buffer_stream(stream))
+    {
+        *buf = *(uint8_t*)stream->state;
+        stream->state = (uint8_t*)stream->state + 1;
+    }
 #ifndef PB_BUFFER_ONLY
-    if (!stream->callback(stream, buf, 1))
+    else if (stream->callback == &input_buffer_read &&
+             ((pb_input_buffer_t*)stream->state)->start < ((pb_input_buffer_t*)stream->state)->end)
+    {
+        /* Take the byte from the read-ahead buffer without a callback */
+        pb_input_buffer_t *input = (pb_input_buffer_t*)stream->state;
+        *buf = input->buffer[input->start++];
+    }
+    else if (!stream->callback(stream, buf, 1))
+    {
         PB_RETURN_ERROR(stream, "io error");
-#else
-    *buf = *(uint8_t*)stream->state;
-    stream->state = (uint8_t*)stream->state + 1;
+    }
 #endif
 
     stream->bytes_left--;
+    PB_STATS_ADD(stream, bytes_read, 1);
 
     return true;
 }
@@ -149,19 +356,123 @@ pb_istream_t pb_istream_from_buffer(uint8_t *buf, size_t bufsize)
     stream.bytes_left = bufsize;
 #ifndef PB_NO_ERRMSG
     stream.errmsg = NULL;
+#endif
+#ifdef PB_ENABLE_ARENA
+    stream.arena = NULL;
+#endif
+#if defined(PB_ENABLE_STREAM_SKIP) && !defined(PB_BUFFER_ONLY)
+    stream.skip = NULL;
+#endif
+#ifdef PB_ENABLE_STATS
+    stream.stats = &pb_stats;
+#endif
+    return stream;
+}
+
+/* Create a buffer stream over data that is only valid until the stream has
+ * been read, such as a copy of the value on the stack. */
+static pb_istream_t pb_istream_from_transient_buffer(uint8_t *buf, size_t bufsize)
+{
+    pb_istream_t stream = pb_istream_from_buffer(buf, bufsize);
+#ifdef PB_BUFFER_ONLY
+    stream.callback = (int*)1; /* Just a marker value */
+#else
+    stream.callback = &transient_buf_read;
 #endif
     return stream;
 }
 
+/* Create a buffer stream over data that the caller holds as const. The
+ * decoder only reads through state, so the qualifier is dropped here. */
+static pb_istream_t pb_istream_from_const_buffer(const uint8_t *buf, size_t bufsize)
+{
+    union {
+        uint8_t *state;
+        const uint8_t *c_state;
+    } state;
+    state.c_state = buf;
+    return pb_istream_from_buffer(state.state, bufsize);
+}
+
 /********************
  * Helper functions *
  ********************/
 
+/* Decode a varint of at most max_bytes bytes directly from a memory buffer.
+ * The available length is checked once up front, so the loop only has to
+ * compare against the end pointer. On error the consumed bytes are dropped
+ * from the stream, just like the byte-by-byte decoder does. */
+static bool checkreturn buf_decode_varint(pb_istream_t *stream, uint64_t *dest, size_t max_bytes)
+{
+    uint8_t *start = (uint8_t*)stream->state;
+    uint8_t *p = start;
+    size_t avail = (stream->bytes_left < max_bytes) ? stream->bytes_left : max_bytes;
+    uint8_t *end = start + avail;
+    uint8_t bitpos = 0;
+    uint32_t low = 0;
+    uint64_t high = 0;
+    uint8_t byte;
+
+    do
+    {
+        if (p == end)
+        {
+            stream->state = end;
+            stream->bytes_left -= avail;
+            PB_STATS_ADD(stream, bytes_read, avail);
+
+            if (avail == max_bytes)
+                PB_RETURN_ERROR(stream, "varint overflow");
+            else
+                PB_RETURN_ERROR(stream, "end-of-stream");
+        }
+
+        byte = *p++;
+
+        /* Use 32-bit arithmetic for the first 28 bits, as most values are
+         * small and 64-bit shifts are expensive on 8-bit targets. */
+        if (bitpos < 28)
+            low |= (uint32_t)(byte & 0x7F) << bitpos;
+        else
+            high |= (uint64_t)(byte & 0x7F) << bitpos;
+
+        bitpos = (uint8_t)(bitpos + 7);
+    } while (byte & 0x80);
+
+    stream->state = p;
+    stream->bytes_left -= (size_t)(p - start);
+    PB_STATS_ADD(stream, bytes_read, (size_t)(p - start));
+    *dest = high | low;
+    return true;
+}
+
 static bool checkreturn pb_decode_varint32(pb_istream_t *stream, uint32_t *dest)
 {
     uint8_t byte;
     uint32_t result;
 
+    if (pb_is_buffer_stream(stream))
+    {
+        uint8_t *p = (uint8_t*)stream->state;
+        uint64_t value;
+
+        /* Quick case, 1 byte value */
+        if (stream->bytes_left > 0 && (*p & 0x80) == 0)
+        {
+            *dest = *p;
+            stream->state = p + 1;
+            stream->bytes_left--;
+            PB_STATS_ADD(stream, bytes_read, 1);
+            return true;
+        }
+
+        if (!buf_decode_varint(stream, &value, 5))
+            return false;
+
+        *dest = (uint32_t)value;
+        return true;
+    }
+
     if (!pb_readbyte(stream, &byte))
         return false;
 
@@ -199,6 +510,9 @@ bool checkreturn pb_decode_varint(pb_istream_t *stream, uint64_t *dest)
     uint8_t bitpos = 0;
     uint64_t result = 0;
 
+    if (pb_is_buffer_stream(stream))
+        return buf_decode_varint(stream, dest, 10);
+
     do
     {
         if (bitpos >= 64)
@@ -218,9 +532,35 @@ bool checkreturn pb_decode_varint(pb_istream_t *stream, uint64_t *dest)
 bool checkreturn pb_skip_varint(pb_istream_t *stream)
 {
     uint8_t byte;
+
+    if (pb_is_buffer_stream(stream))
+    {
+        /* Scan for the last byte of the varint directly in memory */
+        uint8_t *start = (uint8_t*)stream->state;
+        uint8_t *p = start;
+        uint8_t *end = start + stream->bytes_left;
+
+        while (p != end && (*p & 0x80))
+            p++;
+
+        if (p == end)
+        {
+            PB_STATS_ADD(stream, bytes_read, stream->bytes_left);
+            stream->state = end;
+            stream->bytes_left = 0;
+            PB_RETURN_ERROR(stream, "end-of-stream");
+        }
+
+        p++;
+        stream->state = p;
+        stream->bytes_left -= (size_t)(p - start);
+        PB_STATS_ADD(stream, bytes_read, (size_t)(p - start));
+        return true;
+    }
+
     do
     {
-        if (!pb_read(stream, &byte, 1))
+        if (!pb_readbyte(stream, &byte))
             return false;
     } while (byte & 0x80);
     return true;
@@ -303,100 +643,578 @@ static bool checkreturn read_raw_value(pb_istream_t *stream, pb_wire_type_t wire
     }
 }
 
-/* Decode string length from stream and return a substream with limited length.
- * Remember to close the substream using pb_close_string_substream().
- */
-bool checkreturn pb_make_string_substream(pb_istream_t *stream, pb_istream_t *substream)
+#ifdef PB_OLD_CALLBACK_STYLE
+bool checkreturn pb_decode_bytes_view(pb_istream_t *stream, const pb_field_t *field, void *arg)
 {
-    uint32_t size;
-    if (!pb_decode_varint32(stream, &size))
-        return false;
+    pb_bytes_view_t *view = (pb_bytes_view_t*)arg;
+#else
+bool checkreturn pb_decode_bytes_view(pb_istream_t *stream, const pb_field_t *field, void **arg)
+{
+    pb_bytes_view_t *view = (pb_bytes_view_t*)*arg;
+#endif
+    size_t size = stream->bytes_left;
 
-    *substream = *stream;
-    if (substream->bytes_left < size)
-        PB_RETURN_ERROR(stream, "parent stream too short");
+    if (PB_LTYPE(field->type) != PB_LTYPE_BYTES &&
+        PB_LTYPE(field->type) != PB_LTYPE_STRING)
+        PB_RETURN_ERROR(stream, "invalid field type");
 
-    substream->bytes_left = size;
-    stream->bytes_left -= size;
-    return true;
+    if (pb_is_stable_buffer_stream(stream))
+    {
+        /* Refer to the data in place */
+        view->bytes = (const uint8_t*)stream->state;
+        view->size = size;
+        return pb_read(stream, NULL, size);
+    }
+
+    if (view->copy_buffer == NULL || size > view->copy_buffer_size)
+        PB_RETURN_ERROR(stream, "bytes overflow");
+
+    view->bytes = view->copy_buffer;
+    view->size = size;
+    return pb_read(stream, view->copy_buffer, size);
 }
 
-void pb_close_string_substream(pb_istream_t *stream, pb_istream_t *substream)
+#ifdef PB_OLD_CALLBACK_STYLE
+bool checkreturn pb_decode_lazy_submessage(pb_istream_t *stream, const pb_field_t *field, void *arg)
 {
-    stream->state = substream->state;
-
-#ifndef PB_NO_ERRMSG
-    stream->errmsg = substream->errmsg;
+    pb_lazy_submessage_t *lazy = (pb_lazy_submessage_t*)arg;
+#else
+bool checkreturn pb_decode_lazy_submessage(pb_istream_t *stream, const pb_field_t *field, void **arg)
+{
+    pb_lazy_submessage_t *lazy = (pb_lazy_submessage_t*)*arg;
 #endif
-}
+    bool merge = lazy->present;
 
-/*************************
- * Decode a single field *
- *************************/
+    if (PB_LTYPE(field->type) != PB_LTYPE_SUBMESSAGE)
+        PB_RETURN_ERROR(stream, "invalid field type");
 
-static bool checkreturn decode_static_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter)
-{
-    pb_type_t type;
-    pb_decoder_t func;
+    /* A repeated occurrence is merged into the earlier one, which
+     * requires decoding both of them now. */
+    if (merge && !pb_lazy_submessage_get(lazy))
+        PB_RETURN_ERROR(stream, "submessage decode failed");
 
-    type = iter->pos->type;
-    func = PB_DECODERS[PB_LTYPE(type)];
+    lazy->present = true;
 
-    switch (PB_HTYPE(type))
+    if (pb_is_stable_buffer_stream(stream) && !merge)
     {
-        case PB_HTYPE_REQUIRED:
-            return func(stream, iter->pos, iter->pData);
-
-        case PB_HTYPE_OPTIONAL:
-            *(bool*)iter->pSize = true;
-            return func(stream, iter->pos, iter->pData);
+        /* Just remember where the submessage is */
+        lazy->encoded.bytes = (const uint8_t*)stream->state;
+        lazy->encoded.size = stream->bytes_left;
+        lazy->decoded = false;
+        return pb_read(stream, NULL, stream->bytes_left);
+    }
 
-        case PB_HTYPE_REPEATED:
-            if (wire_type == PB_WT_STRING
-                && PB_LTYPE(type) <= PB_LTYPE_LAST_PACKABLE)
-            {
-                /* Packed array */
-                bool status = true;
-                pb_size_t *size = (pb_size_t*)iter->pSize;
-                pb_istream_t substream;
-                if (!pb_make_string_substream(stream, &substream))
-                    return false;
+    lazy->decoded = true;
+    if (merge)
+        return pb_decode_noinit(stream, lazy->fields, lazy->dest);
+    else
+        return pb_decode(stream, lazy->fields, lazy->dest);
+}
 
-                while (substream.bytes_left > 0 && *size < iter->pos->array_size)
-                {
-                    void *pItem = (uint8_t*)iter->pData + iter->pos->data_size * (*size);
-                    if (!func(&substream, iter->pos, pItem))
-                    {
-                        status = false;
-                        break;
-                    }
-                    (*size)++;
-                }
-                pb_close_string_substream(stream, &substream);
+bool pb_lazy_submessage_get(pb_lazy_submessage_t *lazy)
+{
+    pb_istream_t stream;
 
-                if (substream.bytes_left != 0)
-                    PB_RETURN_ERROR(stream, "array overflow");
+    if (!lazy->present)
+        return false;
 
-                return status;
-            }
-            else
-            {
-                /* Repeated field */
-                pb_size_t *size = (pb_size_t*)iter->pSize;
-                void *pItem = (uint8_t*)iter->pData + iter->pos->data_size * (*size);
-                if (*size >= iter->pos->array_size)
-                    PB_RETURN_ERROR(stream, "array overflow");
+    if (lazy->decoded)
+        return true;
 
-                (*size)++;
-                return func(stream, iter->pos, pItem);
-            }
+    stream = pb_istream_from_const_buffer(lazy->encoded.bytes, lazy->encoded.size);
+    if (!pb_decode(&stream, lazy->fields, lazy->dest))
+        return false;
 
-        default:
-            PB_RETURN_ERROR(stream, "invalid field type");
-    }
+    lazy->decoded = true;
+    return true;
 }
 
-#ifdef PB_ENABLE_MALLOC
+/* Read the next field of a message and record its location, relative to
+ * the start position given as bytes_left of the stream at that point. */
+static bool checkreturn scan_field(pb_istream_t *stream, size_t start, pb_field_span_t *span, bool *eof)
+{
+    uint32_t length;
+
+    if (!pb_decode_tag(stream, &span->wire_type, &span->tag, eof))
+        return false;
+
+    switch (span->wire_type)
+    {
+        case PB_WT_VARINT:
+            span->offset = start - stream->bytes_left;
+            if (!pb_skip_varint(stream))
+                return false;
+            span->length = start - stream->bytes_left - span->offset;
+            return true;
+
+        case PB_WT_64BIT:
+        case PB_WT_32BIT:
+            span->offset = start - stream->bytes_left;
+            span->length = (span->wire_type == PB_WT_64BIT) ? 8 : 4;
+            return pb_read(stream, NULL, span->length);
+
+        case PB_WT_STRING:
+            if (!pb_decode_varint32(stream, &length))
+                return false;
+            span->offset = start - stream->bytes_left;
+            span->length = length;
+            return pb_read(stream, NULL, length);
+
+        default:
+            PB_RETURN_ERROR(stream, "invalid wire_type");
+    }
+}
+
+bool checkreturn pb_scan_fields(pb_istream_t *stream, pb_field_span_t *spans, size_t max_spans, size_t *count)
+{
+    size_t start = stream->bytes_left;
+    *count = 0;
+
+    while (stream->bytes_left)
+    {
+        pb_field_span_t span;
+        bool eof;
+
+        if (!scan_field(stream, start, &span, &eof))
+        {
+            if (eof)
+                break;
+            else
+                return false;
+        }
+
+        if (*count == max_spans)
+            PB_RETURN_ERROR(stream, "too many fields");
+
+        spans[(*count)++] = span;
+    }
+
+    return true;
+}
+
+const pb_field_span_t *pb_find_field_span(const pb_field_span_t *spans, size_t count, uint32_t tag)
+{
+    while (count > 0)
+    {
+        count--;
+        if (spans[count].tag == tag)
+            return &spans[count];
+    }
+
+    return NULL;
+}
+
+bool pb_find_field_path(const uint8_t *buf, size_t size, const uint32_t *path,
+                        size_t depth, pb_field_span_t *result)
+{
+    size_t base = 0;
+
+    if (depth == 0)
+        return false;
+
+    while (depth > 0)
+    {
+        pb_istream_t stream = pb_istream_from_const_buffer(buf + base, size);
+        bool found = false;
+
+        /* Scan the whole level, as the last occurrence wins */
+        while (stream.bytes_left)
+        {
+            pb_field_span_t span;
+            bool eof;
+
+            if (!scan_field(&stream, size, &span, &eof))
+            {
+                if (eof)
+                    break;
+                else
+                    return false;
+            }
+
+            if (span.tag == *path)
+            {
+                *result = span;
+                found = true;
+            }
+        }
+
+        if (!found)
+            return false;
+
+        path++;
+        depth--;
+
+        if (depth > 0)
+        {
+            /* Continue into the submessage */
+            if (result->wire_type != PB_WT_STRING)
+                return false;
+
+            base += result->offset;
+            size = result->length;
+        }
+        else
+        {
+            result->offset += base;
+        }
+    }
+
+    return true;
+}
+
+/* Decode string length from stream and return a substream with limited length.
+ * Remember to close the substream using pb_close_string_substream().
+ */
+bool checkreturn pb_make_string_substream(pb_istream_t *stream, pb_istream_t *substream)
+{
+    uint32_t size;
+    if (!pb_decode_varint32(stream, &size))
+        return false;
+
+    *substream = *stream;
+    if (substream->bytes_left < size)
+        PB_RETURN_ERROR(stream, "parent stream too short");
+
+    substream->bytes_left = size;
+    stream->bytes_left -= size;
+    PB_STATS_ADD(stream, substreams, 1);
+    return true;
+}
+
+void pb_close_string_substream(pb_istream_t *stream, pb_istream_t *substream)
+{
+    stream->state = substream->state;
+
+#ifndef PB_NO_ERRMSG
+    stream->errmsg = substream->errmsg;
+#endif
+}
+
+/*************************
+ * Decode a single field *
+ *************************/
+
+/* Decode a packed array of fixed32 or fixed64 values with a single read,
+ * instead of one decoder call per item. Items are appended after the *size
+ * existing entries, up to max_count entries in total. Stops with bytes left
+ * in the stream if the array is full, so that the caller can report it.
+ */
+static bool checkreturn decode_packed_fixed(pb_istream_t *stream, const pb_field_t *field,
+                                            void *pArray, pb_size_t *size, size_t max_count)
+{
+    size_t item_size = (PB_LTYPE(field->type) == PB_LTYPE_FIXED32) ? 4 : 8;
+    size_t count = stream->bytes_left / item_size;
+    uint8_t *dest = (uint8_t*)pArray + item_size * (*size);
+
+    if (count > max_count - *size)
+        count = max_count - *size;
+
+    if (!pb_read(stream, dest, item_size * count))
+        return false;
+
+#ifdef __BIG_ENDIAN__
+    {
+        /* Convert the items from little endian in place */
+        size_t i, j;
+        for (i = 0; i < count; i++)
+        {
+            for (j = 0; j < item_size / 2; j++)
+            {
+                uint8_t tmp = dest[j];
+                dest[j] = dest[item_size - 1 - j];
+                dest[item_size - 1 - j] = tmp;
+            }
+            dest += item_size;
+        }
+    }
+#endif
+
+    *size = (pb_size_t)(*size + count);
+
+    if (stream->bytes_left > 0 && *size < max_count)
+        PB_RETURN_ERROR(stream, "end-of-stream");
+
+    return true;
+}
+
+/* Decode a packed array of varint, uvarint or svarint values directly from
+ * a memory buffer, in one loop without a decoder call per item. Returns true
+ * without consuming anything if the field cannot be handled here, in which
+ * case the caller should decode the items one at a time.
+ */
+static bool checkreturn decode_packed_varint(pb_istream_t *stream, const pb_field_t *field,
+                                             void *pArray, pb_size_t *size, size_t max_count)
+{
+    pb_type_t ltype = PB_LTYPE(field->type);
+    size_t data_size = field->data_size;
+    uint8_t *dest = (uint8_t*)pArray + data_size * (*size);
+
+    if (!pb_is_buffer_stream(stream))
+        return true;
+
+    /* Only handle the data sizes supported by the single item decoders */
+    if (!(data_size == 4 || data_size == 8 ||
+          (ltype == PB_LTYPE_VARINT && (data_size == 1 || data_size == 2))))
+        return true;
+
+    while (stream->bytes_left > 0 && *size < max_count)
+    {
+        uint8_t *p = (uint8_t*)stream->state;
+        uint64_t value;
+
+        if ((*p & 0x80) == 0)
+        {
+            /* Quick case, 1 byte value */
+            value = *p;
+            stream->state = p + 1;
+            stream->bytes_left--;
+            PB_STATS_ADD(stream, bytes_read, 1);
+        }
+        else if (!buf_decode_varint(stream, &value, 10))
+        {
+            return false;
+        }
+
+        if (ltype == PB_LTYPE_SVARINT)
+        {
+            if (value & 1)
+                value = ~(value >> 1);
+            else
+                value = value >> 1;
+        }
+
+        switch (data_size)
+        {
+            case 1: *(int8_t*)dest = (int8_t)value; break;
+            case 2: *(int16_t*)dest = (int16_t)value; break;
+            case 4: *(uint32_t*)dest = (uint32_t)value; break;
+            default: *(uint64_t*)dest = value; break;
+        }
+
+        dest += data_size;
+        (*size)++;
+    }
+
+    return true;
+}
+
+static bool checkreturn decode_static_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter)
+{
+    pb_type_t type;
+    pb_decoder_t func;
+
+    type = iter->pos->type;
+    func = PB_DECODERS[PB_LTYPE(type)];
+
+    switch (PB_HTYPE(type))
+    {
+        case PB_HTYPE_REQUIRED:
+            return func(stream, iter->pos, iter->pData);
+
+        case PB_HTYPE_OPTIONAL:
+            *(bool*)iter->pSize = true;
+            return func(stream, iter->pos, iter->pData);
+
+        case PB_HTYPE_REPEATED:
+            if (wire_type == PB_WT_STRING
+                && PB_LTYPE(type) <= PB_LTYPE_LAST_PACKABLE)
+            {
+                /* Packed array */
+                bool status = true;
+                pb_size_t *size = (pb_size_t*)iter->pSize;
+                pb_istream_t substream;
+                if (!pb_make_string_substream(stream, &substream))
+                    return false;
+
+                if (PB_LTYPE(type) == PB_LTYPE_FIXED32 || PB_LTYPE(type) == PB_LTYPE_FIXED64)
+                {
+                    /* Fixed size items can be copied in one go */
+                    status = decode_packed_fixed(&substream, iter->pos, iter->pData, size, iter->pos->array_size);
+                }
+                else
+                {
+                    /* Decode as many varints as possible in one go */
+                    status = decode_packed_varint(&substream, iter->pos, iter->pData, size, iter->pos->array_size);
+                }
+
+                while (status && substream.bytes_left > 0 && *size < iter->pos->array_size)
+                {
+                    void *pItem = (uint8_t*)iter->pData + iter->pos->data_size * (*size);
+                    if (!func(&substream, iter->pos, pItem))
+                    {
+                        status = false;
+                        break;
+                    }
+                    (*size)++;
+                }
+                pb_close_string_substream(stream, &substream);
+
+                if (substream.bytes_left != 0)
+                    PB_RETURN_ERROR(stream, "array overflow");
+
+                return status;
+            }
+            else
+            {
+                /* Repeated field */
+                pb_size_t *size = (pb_size_t*)iter->pSize;
+                void *pItem = (uint8_t*)iter->pData + iter->pos->data_size * (*size);
+                if (*size >= iter->pos->array_size)
+                    PB_RETURN_ERROR(stream, "array overflow");
+
+                (*size)++;
+                return func(stream, iter->pos, pItem);
+            }
+
+        default:
+            PB_RETURN_ERROR(stream, "invalid field type");
+    }
+}
+
+#ifdef PB_ENABLE_MALLOC
+#ifdef PB_ENABLE_ARENA
+/* Arena allocations are aligned for any of these types. Each allocation
+ * is preceded by its size, so that it can be grown like with realloc(). */
+typedef union {
+    void *p;
+    double d;
+    uint64_t u;
+    size_t s;
+} pb_arena_align_t;
+
+#define PB_ARENA_ALIGN sizeof(pb_arena_align_t)
+
+/* Extra blocks start with the link to the previous block and their size */
+#define PB_ARENA_BLOCK_HEADER (2 * PB_ARENA_ALIGN)
+
+void pb_arena_init(pb_arena_t *arena, void *buffer, size_t buffer_size, size_t block_size)
+{
+    arena->buffer = (uint8_t*)buffer;
+    arena->buffer_size = (buffer != NULL) ? buffer_size : 0;
+    arena->block_size = block_size;
+    arena->blocks = NULL;
+    pb_arena_reset(arena);
+}
+
+void pb_arena_reset(pb_arena_t *arena)
+{
+    while (arena->blocks != NULL)
+    {
+        void *block = arena->blocks;
+        arena->blocks = *(void**)block;
+        pb_free(block);
+    }
+
+    arena->next = arena->buffer;
+    arena->end = arena->buffer + arena->buffer_size;
+    arena->last = NULL;
+}
+
+/* Allocate size bytes, which must be a multiple of PB_ARENA_ALIGN. */
+static void *pb_arena_alloc(pb_arena_t *arena, size_t size)
+{
+    size_t needed = size + PB_ARENA_ALIGN;
+    uint8_t *result;
+
+    if (needed < size)
+        return NULL;
+
+    if ((size_t)(arena->end - arena->next) < needed)
+    {
+        /* Chain a new block, with the link to the previous one at start */
+        uint8_t *block;
+        size_t block_size = arena->block_size;
+
+        if (block_size == 0)
+            return NULL;
+
+        if (block_size < needed + PB_ARENA_BLOCK_HEADER)
+        {
+            block_size = needed + PB_ARENA_BLOCK_HEADER;
+            if (block_size < needed)
+                return NULL;
+        }
+
+        block = (uint8_t*)pb_realloc(NULL, block_size);
+        if (block == NULL)
+            return NULL;
+
+        *(void**)block = arena->blocks;
+        *(size_t*)(block + PB_ARENA_ALIGN) = block_size;
+        arena->blocks = block;
+        arena->next = block + PB_ARENA_BLOCK_HEADER;
+        arena->end = block + block_size;
+    }
+
+    *(size_t*)arena->next = size;
+    result = arena->next + PB_ARENA_ALIGN;
+    arena->next = result + size;
+    arena->last = result;
+    return result;
+}
+
+/* Same as realloc(), except that the old allocation is not freed. */
+static void *pb_arena_realloc(pb_arena_t *arena, void *ptr, size_t size)
+{
+    uint8_t *result;
+    size_t old_size = 0;
+
+    if (size > (size_t)-1 - PB_ARENA_ALIGN)
+        return NULL;
+    size = (size + PB_ARENA_ALIGN - 1) / PB_ARENA_ALIGN * PB_ARENA_ALIGN;
+
+    if (ptr != NULL)
+    {
+        old_size = *(size_t*)((uint8_t*)ptr - PB_ARENA_ALIGN);
+
+        if (ptr == arena->last && (size_t)(arena->end - arena->last) >= size)
+        {
+            /* Latest allocation can be resized in place */
+            *(size_t*)(arena->last - PB_ARENA_ALIGN) = size;
+            arena->next = arena->last + size;
+            return ptr;
+        }
+
+        if (size <= old_size)
+            return ptr;
+    }
+
+    result = (uint8_t*)pb_arena_alloc(arena, size);
+    if (result != NULL && ptr != NULL)
+        memcpy(result, ptr, old_size);
+
+    return result;
+}
+
+/* Check that ptr points into the arena. Only allocations from the arena
+ * have the size header that pb_arena_realloc() reads. */
+static bool pb_arena_contains(const pb_arena_t *arena, const void *ptr)
+{
+    uintptr_t p = (uintptr_t)ptr;
+    const uint8_t *block;
+
+    if (p > (uintptr_t)arena->buffer &&
+        p < (uintptr_t)arena->buffer + arena->buffer_size)
+    {
+        return true;
+    }
+
+    for (block = (const uint8_t*)arena->blocks; block != NULL;
+         block = (const uint8_t*)*(void* const*)block)
+    {
+        size_t block_size = *(const size_t*)(block + PB_ARENA_ALIGN);
+        if (p > (uintptr_t)block && p < (uintptr_t)block + block_size)
+            return true;
+    }
+
+    return false;
+}
+
+#define pb_uses_arena(stream) ((stream)->arena != NULL)
+#else
+#define pb_uses_arena(stream) false
+#endif
+
 /* Allocate storage for the field and store the pointer at iter->pData.
  * array_size is the number of entries to reserve in an array.
  * Zero size is not allowed, use pb_free() for releasing.
@@ -428,7 +1246,19 @@ static bool checkreturn allocate_field(pb_istream_t *stream, void *pData, size_t
     /* Allocate new or expand previous allocation */
     /* Note: on failure the old pointer will remain in the structure,
      * the message must be freed by caller also on error return. */
-    ptr = pb_realloc(ptr, array_size * data_size);
+#ifdef PB_ENABLE_ARENA
+    if (stream->arena != NULL)
+    {
+        if (ptr != NULL && !pb_arena_contains(stream->arena, ptr))
+            PB_RETURN_ERROR(stream, "pointer not from arena");
+
+        ptr = pb_arena_realloc(stream->arena, ptr, array_size * data_size);
+    }
+    else
+#endif
+    {
+        ptr = pb_realloc(ptr, array_size * data_size);
+    }
     if (ptr == NULL)
         PB_RETURN_ERROR(stream, "realloc failed");
 
@@ -436,6 +1266,80 @@ static bool checkreturn allocate_field(pb_istream_t *stream, void *pData, size_t
     return true;
 }
 
+/* Repeated pointer fields are grown in powers of two, so that adding
+ * entries one at a time takes only a logarithmic number of reallocs. */
+static size_t pointer_array_capacity(size_t count)
+{
+    size_t capacity = 1;
+
+    if (count == 0)
+        return 0;
+
+    while (capacity < count)
+    {
+        capacity <<= 1;
+        if (capacity == 0)
+            return count;
+    }
+
+    return capacity;
+}
+
+/* Number of entries allocated for the array of a repeated pointer field.
+ * Unless the array was allocated in the current decode_fields() call, it
+ * is assumed to be full. */
+static size_t pointer_array_allocated(const pointer_arrays_t *arrays, const pb_field_iter_t *iter)
+{
+    pb_size_t i;
+
+    for (i = 0; arrays != NULL && i < PB_POINTER_ARRAYS; i++)
+    {
+        const pointer_array_t *array = &arrays->entries[i];
+        if (array->field == iter->pData && array->array == *(void**)iter->pData)
+            return array->capacity;
+    }
+    
+    return *(pb_size_t*)iter->pSize;
+}
+
+static void pointer_array_remember(pointer_arrays_t *arrays, const pb_field_iter_t *iter, size_t capacity)
+{
+    pointer_array_t *array;
+    pb_size_t i;
+
+    if (arrays == NULL)
+        return;
+
+    /* Update the entry of the field, or replace the oldest one */
+    for (i = 0; i < PB_POINTER_ARRAYS; i++)
+    {
+        if (arrays->entries[i].field == iter->pData)
+            break;
+    }
+
+    if (i == PB_POINTER_ARRAYS)
+    {
+        i = arrays->next;
+        arrays->next = (pb_size_t)((i + 1) % PB_POINTER_ARRAYS);
+    }
+
+    array = &arrays->entries[i];
+    array->field = iter->pData;
+    array->array = *(void**)iter->pData;
+    array->capacity = capacity;
+}
+
+/* Minimum encoded size of an entry in a packed array */
+static size_t packed_min_entry_size(pb_type_t type)
+{
+    if (PB_LTYPE(type) == PB_LTYPE_FIXED32)
+        return 4;
+    else if (PB_LTYPE(type) == PB_LTYPE_FIXED64)
+        return 8;
+    else
+        return 1;
+}
+
 /* Clear a newly allocated item in case it contains a pointer, or is a submessage. */
 static void initialize_pointer_field(void *pItem, pb_field_iter_t *iter)
 {
@@ -451,11 +1355,13 @@ static void initialize_pointer_field(void *pItem, pb_field_iter_t *iter)
 }
 #endif
 
-static bool checkreturn decode_pointer_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter)
+static bool checkreturn decode_pointer_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter,
+                                            pointer_arrays_t *arrays)
 {
 #ifndef PB_ENABLE_MALLOC
     PB_UNUSED(wire_type);
     PB_UNUSED(iter);
+    PB_UNUSED(arrays);
     PB_RETURN_ERROR(stream, "no malloc support");
 #else
     pb_type_t type;
@@ -471,8 +1377,21 @@ static bool checkreturn decode_pointer_field(pb_istream_t *stream, pb_wire_type_
             if (PB_LTYPE(type) == PB_LTYPE_SUBMESSAGE &&
                 *(void**)iter->pData != NULL)
             {
-                /* Duplicate field, have to release the old allocation first. */
-                pb_release_single_field(iter);
+                /* Duplicate field, have to release the old allocation first.
+                 * With an arena, the old one just remains unused. */
+#ifdef PB_ENABLE_ARENA
+                if (stream->arena != NULL)
+                {
+                    if (!pb_arena_contains(stream->arena, *(void**)iter->pData))
+                        PB_RETURN_ERROR(stream, "pointer not from arena");
+
+                    *(void**)iter->pData = NULL;
+                }
+                else
+#endif
+                {
+                    pb_release_single_field(iter);
+                }
             }
 
             if (PB_LTYPE(type) == PB_LTYPE_STRING ||
@@ -496,7 +1415,7 @@ static bool checkreturn decode_pointer_field(pb_istream_t *stream, pb_wire_type_
                 /* Packed array, multiple items come in at once. */
                 bool status = true;
                 pb_size_t *size = (pb_size_t*)iter->pSize;
-                size_t allocated_size = *size;
+                size_t allocated_size = pointer_array_allocated(arrays, iter);
                 void *pItem;
                 pb_istream_t substream;
 
@@ -507,10 +1426,16 @@ static bool checkreturn decode_pointer_field(pb_istream_t *stream, pb_wire_type_
                 {
                     if ((size_t)*size + 1 > allocated_size)
                     {
-                        /* Allocate more storage. This tries to guess the
-                         * number of remaining entries. Round the division
-                         * upwards. */
-                        allocated_size += (substream.bytes_left - 1) / iter->pos->data_size + 1;
+                        /* Grow by doubling, but not beyond the number of
+                         * entries that the remaining data can contain. For
+                         * fixed size entries that limit is exact. */
+                        size_t limit = (size_t)*size + substream.bytes_left / packed_min_entry_size(type);
+
+                        allocated_size = pointer_array_capacity((size_t)*size + 1);
+                        if (packed_min_entry_size(type) > 1 || allocated_size > limit)
+                            allocated_size = limit;
+                        if (allocated_size <= *size)
+                            allocated_size = (size_t)*size + 1;
 
                         if (!allocate_field(&substream, iter->pData, iter->pos->data_size, allocated_size))
                         {
@@ -541,6 +1466,9 @@ static bool checkreturn decode_pointer_field(pb_istream_t *stream, pb_wire_type_
                 }
                 pb_close_string_substream(stream, &substream);
 
+                if (status)
+                    pointer_array_remember(arrays, iter, allocated_size);
+
                 return status;
             }
             else
@@ -552,9 +1480,16 @@ static bool checkreturn decode_pointer_field(pb_istream_t *stream, pb_wire_type_
                 if (*size == PB_SIZE_MAX)
                     PB_RETURN_ERROR(stream, "too many array entries");
 
+                /* Double the storage when it becomes full */
+                if ((size_t)*size + 1 > pointer_array_allocated(arrays, iter))
+                {
+                    size_t capacity = pointer_array_capacity((size_t)*size + 1);
+                    if (!allocate_field(stream, iter->pData, iter->pos->data_size, capacity))
+                        return false;
+                    pointer_array_remember(arrays, iter, capacity);
+                }
+
                 (*size)++;
-                if (!allocate_field(stream, iter->pData, iter->pos->data_size, *size))
-                    return false;
 
                 pItem = *(uint8_t**)iter->pData + iter->pos->data_size * (*size - 1);
                 initialize_pointer_field(pItem, iter);
@@ -589,6 +1524,7 @@ static bool checkreturn decode_callback_field(pb_istream_t *stream, pb_wire_type
 
         do
         {
+            PB_STATS_ADD(stream, callbacks, 1);
             if (!pCallback->funcs.decode(&substream, iter->pos, arg))
                 PB_RETURN_ERROR(stream, "callback failed");
         } while (substream.bytes_left);
@@ -606,23 +1542,36 @@ static bool checkreturn decode_callback_field(pb_istream_t *stream, pb_wire_type
         uint8_t buffer[10];
         size_t size = sizeof(buffer);
 
+        /* Bytes, strings and submessages must be length-delimited. */
+        if (PB_LTYPE(iter->pos->type) == PB_LTYPE_BYTES ||
+            PB_LTYPE(iter->pos->type) == PB_LTYPE_STRING ||
+            PB_LTYPE(iter->pos->type) == PB_LTYPE_SUBMESSAGE)
+            PB_RETURN_ERROR(stream, "wrong wire type");
+
         if (!read_raw_value(stream, wire_type, buffer, &size))
             return false;
-        substream = pb_istream_from_buffer(buffer, size);
+        substream = pb_istream_from_transient_buffer(buffer, size);
+#ifdef PB_ENABLE_STATS
+        substream.stats = NULL; /* The bytes were counted by read_raw_value() */
+#endif
 
+        PB_STATS_ADD(stream, callbacks, 1);
         return pCallback->funcs.decode(&substream, iter->pos, arg);
     }
 }
 
-static bool checkreturn decode_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter)
+static bool checkreturn decode_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter,
+                                     pointer_arrays_t *arrays)
 {
+    PB_STATS_ADD(stream, fields_decoded[PB_LTYPE(iter->pos->type)], 1);
+
     switch (PB_ATYPE(iter->pos->type))
     {
         case PB_ATYPE_STATIC:
             return decode_static_field(stream, wire_type, iter);
 
         case PB_ATYPE_POINTER:
-            return decode_pointer_field(stream, wire_type, iter);
+            return decode_pointer_field(stream, wire_type, iter, arrays);
 
         case PB_ATYPE_CALLBACK:
             return decode_callback_field(stream, wire_type, iter);
@@ -650,7 +1599,7 @@ static bool checkreturn default_extension_decoder(pb_istream_t *stream,
     iter.pData = extension->dest;
     iter.pSize = &extension->found;
 
-    return decode_field(stream, wire_type, &iter);
+    return decode_field(stream, wire_type, &iter, NULL);
 }
 
 /* Try to decode an unknown field as an extension field. Tries each extension
@@ -695,7 +1644,7 @@ static bool checkreturn find_extension_field(pb_field_iter_t *iter)
 }
 
 /* Initialize message fields to default values, recursively */
-static void pb_message_set_to_defaults(const pb_field_t fields[], void *dest_struct)
+void pb_message_set_to_defaults(const pb_field_t fields[], void *dest_struct)
 {
     pb_field_iter_t iter;
 
@@ -743,38 +1692,247 @@ static void pb_message_set_to_defaults(const pb_field_t fields[], void *dest_str
             /* Initialize the pointer to NULL. */
             *(void**)iter.pData = NULL;
 
-            /* Initialize array count to 0. */
-            if (PB_HTYPE(type) == PB_HTYPE_REPEATED)
-            {
-                *(pb_size_t*)iter.pSize = 0;
-            }
+            /* Initialize array count to 0. */
+            if (PB_HTYPE(type) == PB_HTYPE_REPEATED)
+            {
+                *(pb_size_t*)iter.pSize = 0;
+            }
+        }
+        else if (PB_ATYPE(type) == PB_ATYPE_CALLBACK)
+        {
+            /* Don't overwrite callback */
+        }
+    } while (pb_field_iter_next(&iter));
+}
+
+/*********************
+ * Decode all fields *
+ *********************/
+
+/* Check the flags of required fields set while decoding a message. */
+static bool all_required_fields_seen(const uint8_t *fields_seen, const pb_field_iter_t *iter)
+{
+    unsigned req_field_count;
+    unsigned i;
+
+#ifdef PB_ENABLE_FIELD_INDEX
+    if (iter->index != NULL)
+    {
+        req_field_count = iter->index->required_count;
+    }
+    else
+#endif
+    {
+        /* Count the required fields from the current position onwards.
+         * This only looks at the field types, without computing the data
+         * pointers like pb_field_iter_next() does. Usually we are already
+         * close to end after decoding. */
+        const pb_field_t *field;
+        req_field_count = iter->required_field_index;
+        for (field = iter->pos; field->tag != 0; field++)
+        {
+            if (PB_HTYPE(field->type) == PB_HTYPE_REQUIRED)
+                req_field_count++;
+        }
+    }
+
+    /* Check the whole bytes */
+    for (i = 0; i < (req_field_count >> 3); i++)
+    {
+        if (fields_seen[i] != 0xFF)
+            return false;
+    }
+
+    /* Check the remaining bits */
+    return fields_seen[req_field_count >> 3] == (0xFF >> (8 - (req_field_count & 7)));
+}
+
+/* Write a varint of at most 32 bits, returning the number of bytes. */
+static size_t put_varint32(uint8_t *buf, uint32_t value)
+{
+    size_t i = 0;
+    while (value > 0x7F)
+    {
+        buf[i++] = (uint8_t)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    buf[i++] = (uint8_t)value;
+    return i;
+}
+
+/* Skip a field that is not in the message type, and store its encoding
+ * in unknown. For buffer streams, field_start is where its tag begins. */
+static bool checkreturn store_unknown_field(pb_istream_t *stream, pb_unknown_fields_t *unknown,
+                                            const uint8_t *field_start, uint32_t tag, pb_wire_type_t wire_type)
+{
+    const uint8_t *data;
+    size_t size;
+    pb_unknown_span_t *last = (unknown->span_count > 0) ? &unknown->spans[unknown->span_count - 1] : NULL;
+
+    if (pb_is_stable_buffer_stream(stream))
+    {
+        /* Refer to the data in place */
+        if (!pb_skip_field(stream, wire_type))
+            return false;
+
+        data = field_start;
+        size = (size_t)((const uint8_t*)stream->state - field_start);
+    }
+    else
+    {
+        /* Copy the tag and value */
+        uint8_t *dest;
+        size_t avail = unknown->copy_buffer_size - unknown->copy_buffer_used;
+        uint8_t header[15];
+        size_t header_size = put_varint32(header, (tag << 3) | wire_type);
+        size_t value_size = 0;
+
+        if (wire_type == PB_WT_STRING)
+        {
+            uint32_t length;
+            if (!pb_decode_varint32(stream, &length))
+                return false;
+
+            header_size += put_varint32(header + header_size, length);
+            value_size = length;
+        }
+        else
+        {
+            value_size = sizeof(header) - header_size;
+            if (!read_raw_value(stream, wire_type, header + header_size, &value_size))
+                return false;
+
+            header_size += value_size;
+            value_size = 0;
+        }
+
+        if (avail < header_size || avail - header_size < value_size)
+            PB_RETURN_ERROR(stream, "unknown fields overflow");
+
+        dest = unknown->copy_buffer + unknown->copy_buffer_used;
+        memcpy(dest, header, header_size);
+        if (!pb_read(stream, dest + header_size, value_size))
+            return false;
+
+        data = dest;
+        size = header_size + value_size;
+        unknown->copy_buffer_used += size;
+    }
+
+    if (last != NULL && last->data + last->size == data)
+    {
+        /* Continues the previous span */
+        last->size += size;
+        return true;
+    }
+
+    if (unknown->span_count == unknown->max_spans)
+        PB_RETURN_ERROR(stream, "unknown fields overflow");
+
+    unknown->spans[unknown->span_count].data = data;
+    unknown->spans[unknown->span_count].size = size;
+    unknown->span_count++;
+    return true;
+}
+
+/* Find the position of tag in the field mask, or return false if the
+ * field is not selected. */
+static bool field_mask_find(const pb_field_mask_t *mask, uint32_t tag, pb_size_t *index)
+{
+    pb_size_t i;
+    for (i = 0; i < mask->tag_count; i++)
+    {
+        if (mask->tags[i] == tag)
+        {
+            *index = i;
+            return true;
         }
-        else if (PB_ATYPE(type) == PB_ATYPE_CALLBACK)
+    }
+
+    return false;
+}
+
+/* Mark the required fields that are not selected by the mask as seen, so
+ * that only the selected ones are checked for presence. */
+static void field_mask_skip_required(const pb_field_mask_t *mask, pb_field_iter_t *iter, uint8_t *fields_seen)
+{
+    pb_size_t index;
+
+    do
+    {
+        if (PB_HTYPE(iter->pos->type) == PB_HTYPE_REQUIRED
+            && iter->required_field_index < PB_MAX_REQUIRED_FIELDS
+            && !field_mask_find(mask, iter->pos->tag, &index))
         {
-            /* Don't overwrite callback */
+            fields_seen[iter->required_field_index >> 3] |= (uint8_t)(1 << (iter->required_field_index & 7));
         }
-    } while (pb_field_iter_next(&iter));
+    } while (pb_field_iter_next(iter));
 }
 
-/*********************
- * Decode all fields *
- *********************/
+/* Decode a static submessage with a field mask. Corresponds to
+ * pb_dec_submessage() for the other fields. */
+static bool checkreturn decode_projected_submessage(pb_istream_t *stream, pb_field_iter_t *iter,
+                                                    const pb_field_mask_t *mask)
+{
+    const pb_field_t *submsg_fields = (const pb_field_t*)iter->pos->ptr;
+    void *dest = iter->pData;
+    pb_istream_t substream;
+    bool status;
 
-bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct)
+    if (submsg_fields == NULL)
+        PB_RETURN_ERROR(stream, "invalid field descriptor");
+
+    if (PB_HTYPE(iter->pos->type) == PB_HTYPE_OPTIONAL)
+    {
+        *(bool*)iter->pSize = true;
+    }
+    else if (PB_HTYPE(iter->pos->type) == PB_HTYPE_REPEATED)
+    {
+        /* New array entries need to be initialized */
+        pb_size_t *size = (pb_size_t*)iter->pSize;
+        if (*size >= iter->pos->array_size)
+            PB_RETURN_ERROR(stream, "array overflow");
+
+        dest = (uint8_t*)iter->pData + iter->pos->data_size * (*size);
+        (*size)++;
+        pb_message_set_to_defaults(submsg_fields, dest);
+    }
+
+    if (!pb_make_string_substream(stream, &substream))
+        return false;
+
+    status = decode_fields(&substream, submsg_fields, dest, mask, NULL);
+    pb_close_string_substream(stream, &substream);
+    return status;
+}
+
+/* Decode the fields selected by mask, or all fields if mask is NULL.
+ * Fields not in the message type are stored in unknown, if not NULL. */
+static bool checkreturn decode_fields(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct,
+                                      const pb_field_mask_t *mask, pb_unknown_fields_t *unknown)
 {
     uint8_t fields_seen[(PB_MAX_REQUIRED_FIELDS + 7) / 8] = {0, 0, 0, 0, 0, 0, 0, 0};
     uint32_t extension_range_start = 0;
     pb_field_iter_t iter;
+    pointer_arrays_t arrays = {{{NULL, NULL, 0}}, 0};
 
     /* Return value ignored, as empty message types will be correctly handled by
      * pb_field_iter_find() anyway. */
     (void)pb_field_iter_begin(&iter, fields, dest_struct);
 
+    if (mask != NULL)
+    {
+        field_mask_skip_required(mask, &iter, fields_seen);
+        (void)pb_field_iter_begin(&iter, fields, dest_struct);
+    }
+
     while (stream->bytes_left)
     {
         uint32_t tag;
         pb_wire_type_t wire_type;
         bool eof;
+        const pb_field_mask_t *submask = NULL;
+        const uint8_t *field_start = (const uint8_t*)stream->state;
 
         if (!pb_decode_tag(stream, &wire_type, &tag, &eof))
         {
@@ -784,6 +1942,22 @@ bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[
                 return false;
         }
 
+        if (mask != NULL)
+        {
+            pb_size_t index;
+
+            if (!field_mask_find(mask, tag, &index))
+            {
+                /* Not selected, skip without looking at the field */
+                if (!pb_skip_field(stream, wire_type))
+                    return false;
+                continue;
+            }
+
+            if (mask->submasks != NULL)
+                submask = mask->submasks[index];
+        }
+
         if (!pb_field_iter_find(&iter, tag))
         {
             /* No match found, check if it matches an extension. */
@@ -810,8 +1984,16 @@ bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[
             }
 
             /* No match found, skip data */
-            if (!pb_skip_field(stream, wire_type))
+            PB_STATS_ADD(stream, unknown_fields, 1);
+            if (unknown != NULL)
+            {
+                if (!store_unknown_field(stream, unknown, field_start, tag, wire_type))
+                    return false;
+            }
+            else if (!pb_skip_field(stream, wire_type))
+            {
                 return false;
+            }
             continue;
         }
 
@@ -821,43 +2003,37 @@ bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[
             fields_seen[iter.required_field_index >> 3] |= (uint8_t)(1 << (iter.required_field_index & 7));
         }
 
-        if (!decode_field(stream, wire_type, &iter))
+        if (submask != NULL && wire_type == PB_WT_STRING &&
+            PB_ATYPE(iter.pos->type) == PB_ATYPE_STATIC &&
+            PB_LTYPE(iter.pos->type) == PB_LTYPE_SUBMESSAGE)
+        {
+            if (!decode_projected_submessage(stream, &iter, submask))
+                return false;
+        }
+        else if (!decode_field(stream, wire_type, &iter, &arrays))
+        {
             return false;
+        }
     }
 
     /* Check that all required fields were present. */
-    {
-        /* First figure out the number of required fields by
-         * seeking to the end of the field array. Usually we
-         * are already close to end after decoding.
-         */
-        unsigned req_field_count;
-        pb_type_t last_type;
-        unsigned i;
-        do {
-            req_field_count = iter.required_field_index;
-            last_type = iter.pos->type;
-        } while (pb_field_iter_next(&iter));
-
-        /* Fixup if last field was also required. */
-        if (PB_HTYPE(last_type) == PB_HTYPE_REQUIRED && iter.pos->tag != 0)
-            req_field_count++;
-
-        /* Check the whole bytes */
-        for (i = 0; i < (req_field_count >> 3); i++)
-        {
-            if (fields_seen[i] != 0xFF)
-                PB_RETURN_ERROR(stream, "missing required field");
-        }
-
-        /* Check the remaining bits */
-        if (fields_seen[req_field_count >> 3] != (0xFF >> (8 - (req_field_count & 7))))
-            PB_RETURN_ERROR(stream, "missing required field");
-    }
+    if (!all_required_fields_seen(fields_seen, &iter))
+        PB_RETURN_ERROR(stream, "missing required field");
 
     return true;
 }
 
+bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct)
+{
+    return decode_fields(stream, fields, dest_struct, NULL, NULL);
+}
+
+bool checkreturn pb_decode_projected(pb_istream_t *stream, const pb_field_t fields[],
+                                     void *dest_struct, const pb_field_mask_t *mask)
+{
+    return decode_fields(stream, fields, dest_struct, mask, NULL);
+}
+
 bool checkreturn pb_decode(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct)
 {
     bool status;
@@ -865,7 +2041,24 @@ bool checkreturn pb_decode(pb_istream_t *stream, const pb_field_t fields[], void
     status = pb_decode_noinit(stream, fields, dest_struct);
 
 #ifdef PB_ENABLE_MALLOC
-    if (!status)
+    if (!status && !pb_uses_arena(stream))
+        pb_release(fields, dest_struct);
+#endif
+
+    return status;
+}
+
+bool checkreturn pb_decode_keep_unknown(pb_istream_t *stream, const pb_field_t fields[],
+                                        void *dest_struct, pb_unknown_fields_t *unknown)
+{
+    bool status;
+    unknown->span_count = 0;
+    unknown->copy_buffer_used = 0;
+    pb_message_set_to_defaults(fields, dest_struct);
+    status = decode_fields(stream, fields, dest_struct, NULL, unknown);
+
+#ifdef PB_ENABLE_MALLOC
+    if (!status && !pb_uses_arena(stream))
         pb_release(fields, dest_struct);
 #endif
 
@@ -885,6 +2078,389 @@ bool pb_decode_delimited(pb_istream_t *stream, const pb_field_t fields[], void *
     return status;
 }
 
+/*********************************
+ * Decoding from partial input   *
+ *********************************/
+
+/* What the push decoder is expecting next */
+#define PB_PUSH_STATE_TAG           0 /* Tag varint, value[] has the bytes so far */
+#define PB_PUSH_STATE_LENGTH        1 /* Length varint of a PB_WT_STRING field */
+#define PB_PUSH_STATE_VARINT        2 /* Varint value, collected in value[] */
+#define PB_PUSH_STATE_FIXED         3 /* value_left bytes of a fixed-size value */
+#define PB_PUSH_STATE_STRING        4 /* value_left bytes to the scratch buffer */
+#define PB_PUSH_STATE_SKIP          5 /* value_left bytes to discard */
+#define PB_PUSH_STATE_SKIP_VARINT   6 /* Varint to discard */
+
+static void push_begin_message(pb_push_decoder_t *decoder, const pb_field_t fields[],
+                               void *dest_struct, size_t end)
+{
+    pb_push_frame_t *frame = &decoder->stack[decoder->depth++];
+
+    /* Return value ignored, as empty message types will be correctly handled by
+     * pb_field_iter_find() anyway. */
+    (void)pb_field_iter_begin(&frame->iter, fields, dest_struct);
+    frame->end = end;
+    frame->extension_range_start = 0;
+    memset(frame->fields_seen, 0, sizeof(frame->fields_seen));
+}
+
+static bool checkreturn push_end_message(pb_push_decoder_t *decoder)
+{
+    pb_push_frame_t *frame = &decoder->stack[decoder->depth - 1];
+
+    if (!all_required_fields_seen(frame->fields_seen, &frame->iter))
+        PB_RETURN_ERROR(decoder, "missing required field");
+
+    decoder->depth--;
+    if (decoder->depth == 0)
+        decoder->status = PB_PUSH_DONE;
+
+    return true;
+}
+
+/* Decode a complete field value from memory */
+static bool checkreturn push_decode_value(pb_push_decoder_t *decoder, uint8_t *buf, size_t size)
+{
+    pb_push_frame_t *frame = &decoder->stack[decoder->depth - 1];
+    pb_istream_t stream = pb_istream_from_transient_buffer(buf, size);
+    bool status;
+
+#ifdef PB_ENABLE_STATS
+    stream.stats = decoder->stats;
+#endif
+
+    if (decoder->extension)
+        status = decode_extension(&stream, decoder->tag, decoder->wire_type, &frame->iter);
+    else
+        status = decode_field(&stream, decoder->wire_type, &frame->iter, NULL);
+
+    if (!status)
+        PB_RETURN_ERROR(decoder, PB_GET_ERROR(&stream));
+
+    decoder->state = PB_PUSH_STATE_TAG;
+    decoder->value_size = 0;
+    return true;
+}
+
+/* Decide what to do with a field after its tag has been received */
+static bool checkreturn push_begin_field(pb_push_decoder_t *decoder)
+{
+    pb_push_frame_t *frame = &decoder->stack[decoder->depth - 1];
+    pb_istream_t stream = pb_istream_from_buffer(decoder->value, decoder->value_size);
+    uint32_t tag;
+
+#ifdef PB_ENABLE_STATS
+    stream.stats = decoder->stats;
+#endif
+
+    if (!pb_decode_varint32(&stream, &tag))
+        PB_RETURN_ERROR(decoder, PB_GET_ERROR(&stream));
+
+    decoder->value_size = 0;
+
+    if (tag == 0)
+    {
+        /* Zero-terminated message, like in pb_decode_tag(). Submessages
+         * still have to be consumed up to their length. */
+        if (decoder->depth == 1)
+            return push_end_message(decoder);
+
+        decoder->state = PB_PUSH_STATE_SKIP;
+        decoder->value_left = frame->end - decoder->position;
+        return true;
+    }
+
+    decoder->tag = tag >> 3;
+    decoder->wire_type = (pb_wire_type_t)(tag & 7);
+    decoder->extension = false;
+    decoder->skip = false;
+
+    if (!pb_field_iter_find(&frame->iter, decoder->tag))
+    {
+        /* No match found, check if it matches an extension. */
+        if (decoder->tag >= frame->extension_range_start)
+        {
+            if (!find_extension_field(&frame->iter))
+                frame->extension_range_start = (uint32_t)-1;
+            else
+                frame->extension_range_start = frame->iter.pos->tag;
+
+            decoder->extension = (decoder->tag >= frame->extension_range_start);
+        }
+
+        decoder->skip = !decoder->extension;
+        if (decoder->skip)
+            PB_STATS_ADD(decoder, unknown_fields, 1);
+    }
+    else if (PB_HTYPE(frame->iter.pos->type) == PB_HTYPE_REQUIRED
+             && frame->iter.required_field_index < PB_MAX_REQUIRED_FIELDS)
+    {
+        frame->fields_seen[frame->iter.required_field_index >> 3] |=
+            (uint8_t)(1 << (frame->iter.required_field_index & 7));
+    }
+
+    switch (decoder->wire_type)
+    {
+        case PB_WT_VARINT:
+            decoder->state = decoder->skip ? PB_PUSH_STATE_SKIP_VARINT : PB_PUSH_STATE_VARINT;
+            return true;
+
+        case PB_WT_64BIT:
+            decoder->state = decoder->skip ? PB_PUSH_STATE_SKIP : PB_PUSH_STATE_FIXED;
+            decoder->value_left = 8;
+            return true;
+
+        case PB_WT_32BIT:
+            decoder->state = decoder->skip ? PB_PUSH_STATE_SKIP : PB_PUSH_STATE_FIXED;
+            decoder->value_left = 4;
+            return true;
+
+        case PB_WT_STRING:
+            decoder->state = PB_PUSH_STATE_LENGTH;
+            return true;
+
+        default:
+            PB_RETURN_ERROR(decoder, "invalid wire_type");
+    }
+}
+
+/* Handle a PB_WT_STRING field after its length has been received */
+static bool checkreturn push_begin_string(pb_push_decoder_t *decoder)
+{
+    pb_push_frame_t *frame = &decoder->stack[decoder->depth - 1];
+    pb_istream_t stream = pb_istream_from_buffer(decoder->value, decoder->value_size);
+    const pb_field_iter_t *iter = &frame->iter;
+    uint32_t size;
+
+#ifdef PB_ENABLE_STATS
+    /* Counted below, unless the length is decoded again from the scratch buffer */
+    stream.stats = NULL;
+#endif
+
+    if (!pb_decode_varint32(&stream, &size))
+        PB_RETURN_ERROR(decoder, PB_GET_ERROR(&stream));
+
+    if (frame->end - decoder->position < size)
+        PB_RETURN_ERROR(decoder, "parent stream too short");
+
+    if (decoder->skip)
+    {
+        PB_STATS_ADD(decoder, bytes_read, decoder->value_size);
+        decoder->state = PB_PUSH_STATE_SKIP;
+        decoder->value_left = size;
+        decoder->value_size = 0;
+        return true;
+    }
+
+    if (!decoder->extension &&
+        PB_ATYPE(iter->pos->type) == PB_ATYPE_STATIC &&
+        PB_LTYPE(iter->pos->type) == PB_LTYPE_SUBMESSAGE)
+    {
+        /* Decode the submessage as it arrives */
+        const pb_field_t *submsg_fields = (const pb_field_t*)iter->pos->ptr;
+        void *dest = iter->pData;
+
+        if (submsg_fields == NULL)
+            PB_RETURN_ERROR(decoder, "invalid field descriptor");
+
+        if (decoder->depth >= PB_PUSH_MAX_DEPTH)
+            PB_RETURN_ERROR(decoder, "max depth exceeded");
+
+        if (PB_HTYPE(iter->pos->type) == PB_HTYPE_OPTIONAL)
+        {
+            *(bool*)iter->pSize = true;
+        }
+        else if (PB_HTYPE(iter->pos->type) == PB_HTYPE_REPEATED)
+        {
+            /* New array entries need to be initialized */
+            pb_size_t *count = (pb_size_t*)iter->pSize;
+            if (*count >= iter->pos->array_size)
+                PB_RETURN_ERROR(decoder, "array overflow");
+
+            dest = (uint8_t*)iter->pData + iter->pos->data_size * (*count);
+            (*count)++;
+            pb_message_set_to_defaults(submsg_fields, dest);
+        }
+
+        PB_STATS_ADD(decoder, bytes_read, decoder->value_size);
+        PB_STATS_ADD(decoder, substreams, 1);
+        PB_STATS_ADD(decoder, fields_decoded[PB_LTYPE_SUBMESSAGE], 1);
+        push_begin_message(decoder, submsg_fields, dest, decoder->position + size);
+        decoder->state = PB_PUSH_STATE_TAG;
+        decoder->value_size = 0;
+        return true;
+    }
+
+    /* Collect the whole field, including the length prefix */
+    if (decoder->scratch_size < decoder->value_size ||
+        decoder->scratch_size - decoder->value_size < size)
+        PB_RETURN_ERROR(decoder, "scratch buffer too small");
+
+    memcpy(decoder->scratch, decoder->value, decoder->value_size);
+    decoder->scratch_used = decoder->value_size;
+    decoder->value_left = size;
+    decoder->state = PB_PUSH_STATE_STRING;
+
+    if (size == 0)
+        return push_decode_value(decoder, decoder->scratch, decoder->scratch_used);
+
+    return true;
+}
+
+/* Consume input for the current state, at most up to the end of the
+ * innermost message. */
+static bool checkreturn push_consume(pb_push_decoder_t *decoder, const uint8_t **buf, size_t *count)
+{
+    pb_push_frame_t *frame = &decoder->stack[decoder->depth - 1];
+    size_t avail = frame->end - decoder->position;
+    size_t n;
+    uint8_t byte;
+
+    if (avail == 0)
+        PB_RETURN_ERROR(decoder, "end-of-stream");
+
+    if (avail > *count)
+        avail = *count;
+
+    if (decoder->state == PB_PUSH_STATE_STRING || decoder->state == PB_PUSH_STATE_SKIP)
+    {
+        n = (avail < decoder->value_left) ? avail : decoder->value_left;
+
+        if (decoder->state == PB_PUSH_STATE_STRING)
+        {
+            memcpy(decoder->scratch + decoder->scratch_used, *buf, n);
+            decoder->scratch_used += n;
+        }
+
+        *buf += n;
+        *count -= n;
+        decoder->position += n;
+        decoder->value_left -= n;
+
+        /* Buffered values are counted when they are decoded */
+        if (decoder->state == PB_PUSH_STATE_SKIP)
+            PB_STATS_ADD(decoder, bytes_read, n);
+
+        if (decoder->value_left != 0)
+            return true;
+
+        if (decoder->state == PB_PUSH_STATE_STRING)
+            return push_decode_value(decoder, decoder->scratch, decoder->scratch_used);
+
+        decoder->state = PB_PUSH_STATE_TAG;
+        return true;
+    }
+
+    byte = **buf;
+    (*buf)++;
+    (*count)--;
+    decoder->position++;
+
+    if (decoder->state == PB_PUSH_STATE_SKIP_VARINT)
+    {
+        PB_STATS_ADD(decoder, bytes_read, 1);
+        if (!(byte & 0x80))
+            decoder->state = PB_PUSH_STATE_TAG;
+        return true;
+    }
+
+    if (decoder->value_size >= sizeof(decoder->value))
+        PB_RETURN_ERROR(decoder, "varint overflow");
+
+    decoder->value[decoder->value_size++] = byte;
+
+    if (decoder->state == PB_PUSH_STATE_FIXED)
+    {
+        if (--decoder->value_left == 0)
+            return push_decode_value(decoder, decoder->value, decoder->value_size);
+        return true;
+    }
+
+    if (byte & 0x80)
+        return true;
+
+    /* Varint complete */
+    if (decoder->state == PB_PUSH_STATE_TAG)
+        return push_begin_field(decoder);
+    else if (decoder->state == PB_PUSH_STATE_LENGTH)
+        return push_begin_string(decoder);
+    else
+        return push_decode_value(decoder, decoder->value, decoder->value_size);
+}
+
+void pb_push_decoder_init(pb_push_decoder_t *decoder, const pb_field_t fields[],
+                          void *dest_struct, size_t message_size,
+                          uint8_t *scratch, size_t scratch_size)
+{
+    decoder->depth = 0;
+    decoder->state = PB_PUSH_STATE_TAG;
+    decoder->status = PB_PUSH_NEED_MORE;
+    decoder->position = 0;
+    decoder->value_size = 0;
+    decoder->scratch = scratch;
+    decoder->scratch_size = (scratch != NULL) ? scratch_size : 0;
+    decoder->scratch_used = 0;
+#ifndef PB_NO_ERRMSG
+    decoder->errmsg = NULL;
+#endif
+#ifdef PB_ENABLE_STATS
+    decoder->stats = &pb_stats;
+#endif
+
+    pb_message_set_to_defaults(fields, dest_struct);
+    push_begin_message(decoder, fields, dest_struct, message_size);
+}
+
+pb_push_status_t pb_push_decode(pb_push_decoder_t *decoder, const uint8_t *buf, size_t count)
+{
+    while (decoder->status == PB_PUSH_NEED_MORE)
+    {
+        bool status;
+
+        if (decoder->state == PB_PUSH_STATE_TAG && decoder->value_size == 0 &&
+            decoder->position == decoder->stack[decoder->depth - 1].end)
+        {
+            /* Innermost message is complete */
+            status = push_end_message(decoder);
+        }
+        else if (count == 0)
+        {
+            break;
+        }
+        else
+        {
+            status = push_consume(decoder, &buf, &count);
+        }
+
+        if (!status)
+            decoder->status = PB_PUSH_ERROR;
+    }
+
+    return decoder->status;
+}
+
+pb_push_status_t pb_push_decode_finish(pb_push_decoder_t *decoder)
+{
+    if (decoder->status == PB_PUSH_NEED_MORE)
+    {
+        if (decoder->depth != 1 || decoder->state != PB_PUSH_STATE_TAG ||
+            decoder->value_size != 0)
+        {
+#ifndef PB_NO_ERRMSG
+            if (decoder->errmsg == NULL)
+                decoder->errmsg = "end-of-stream";
+#endif
+            decoder->status = PB_PUSH_ERROR;
+        }
+        else if (!push_end_message(decoder))
+        {
+            decoder->status = PB_PUSH_ERROR;
+        }
+    }
+
+    return decoder->status;
+}
+
 #ifdef PB_ENABLE_MALLOC
 static void pb_release_single_field(const pb_field_iter_t *iter)
 {
@@ -7,11 +7,31 @@
 #define PB_DECODE_H_INCLUDED
 
 #include "pb.h"
+#include "pb_common.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#ifdef PB_ENABLE_ARENA
+/* Arena for the allocations of pointer fields, as an alternative to
+ * pb_realloc() and pb_free(). Allocations are taken in order from the
+ * buffer, and released all at once with pb_arena_reset().
+ * See pb_arena_init().
+ */
+typedef struct pb_arena_s pb_arena_t;
+struct pb_arena_s
+{
+    uint8_t *buffer;    /* Memory block given by the user */
+    size_t buffer_size;
+    size_t block_size;  /* Size of extra blocks, or 0 to not allocate any */
+    void *blocks;       /* Chain of extra blocks from pb_realloc() */
+    uint8_t *next;      /* Next free byte in the current block */
+    uint8_t *end;       /* End of the current block */
+    uint8_t *last;      /* Latest allocation, which can be grown in place */
+};
+#endif
+
 /* Structure for defining custom input streams. You will need to provide
  * a callback function to read the bytes from your storage, which can be
  * for example a file or a network socket.
@@ -24,6 +44,11 @@ extern "C" {
  * 3) Your callback may be used with substreams, in which case bytes_left
  *    is different than from the main stream. Don't use bytes_left to compute
  *    any pointers.
+ *
+ * Compile options add members such as stats and arena, which the decoder
+ * reads. If you fill in the structure member by member, memset() it to
+ * zero first, or start from pb_istream_from_buffer(NULL, 0) and replace
+ * callback, state and bytes_left.
  */
 struct pb_istream_s
 {
@@ -43,6 +68,29 @@ struct pb_istream_s
 #ifndef PB_NO_ERRMSG
     const char *errmsg;
 #endif
+
+#ifdef PB_ENABLE_ARENA
+    /* Allocate pointer fields from this arena instead of using pb_realloc(),
+     * if not NULL. */
+    pb_arena_t *arena;
+#endif
+
+#if defined(PB_ENABLE_STREAM_SKIP) && !defined(PB_BUFFER_ONLY)
+    /* Optional callback for skipping count bytes of input, e.g. by seeking
+     * in a file. If NULL, skipped data is read through the callback in
+     * small pieces. Called only when count does not exceed bytes_left.
+     *
+     * Custom streams that are filled in member by member MUST set this,
+     * to NULL if not used. Otherwise it is an uninitialized function
+     * pointer that gets called for skipped fields. */
+    bool (*skip)(pb_istream_t *stream, size_t count);
+#endif
+
+#ifdef PB_ENABLE_STATS
+    /* Counters for this stream, or NULL. See pb_stats_t. Custom streams
+     * must set this, as the decoder writes through it. */
+    pb_stats_t *stats;
+#endif
 };
 
 /***************************
@@ -76,9 +124,72 @@ bool pb_decode(pb_istream_t *stream, const pb_field_t fields[], void *dest_struc
  *
  * Note: If this function returns with an error, it will not release any
  * dynamically allocated fields. You will need to call pb_release() yourself.
+ *
+ * Note: Repeated pointer fields are allocated with space for a power of two
+ * entries. When merging into arrays that were not decoded by nanopb, their
+ * allocation must be rounded up the same way.
  */
 bool pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct);
 
+/* Initialize the message structure to the default values, as pb_decode()
+ * does before decoding. Callback fields are left untouched.
+ *
+ * To reset messages frequently, it is faster to initialize a zeroed
+ * structure once with this function and then copy it over the message.
+ */
+void pb_message_set_to_defaults(const pb_field_t fields[], void *dest_struct);
+
+/* Selection of fields for pb_decode_projected(), by tag number. For each
+ * selected submessage field, submasks can give the fields to decode from the
+ * submessage. A NULL submasks array or entry selects the whole submessage.
+ * Submasks apply only to static submessage fields.
+ */
+typedef struct pb_field_mask_s pb_field_mask_t;
+struct pb_field_mask_s
+{
+    const uint32_t *tags;
+    pb_size_t tag_count;
+    const pb_field_mask_t * const *submasks;
+};
+
+/* Same as pb_decode_noinit, except that only the fields selected by mask
+ * are decoded. The other fields are skipped without storing anything in
+ * the destination structure, and only the selected required fields have
+ * to be present.
+ *
+ * Example usage:
+ *    static const uint32_t header_tags[] = {1, 2};
+ *    static const pb_field_mask_t header_mask = {header_tags, 2, NULL};
+ *    static const uint32_t tags[] = {1, 4};
+ *    static const pb_field_mask_t *const submasks[] = {NULL, &header_mask};
+ *    static const pb_field_mask_t mask = {tags, 2, submasks};
+ *
+ *    pb_decode_projected(&stream, MyMessage_fields, &msg, &mask);
+ */
+bool pb_decode_projected(pb_istream_t *stream, const pb_field_t fields[],
+                         void *dest_struct, const pb_field_mask_t *mask);
+
+/* Same as pb_decode, except that the fields that are not in the message
+ * type are stored in unknown instead of being discarded. The contents of
+ * unknown are replaced. If the input is a memory buffer, it must be kept
+ * around for as long as unknown is used.
+ *
+ * Only the fields of the top-level message are kept. Unknown fields inside
+ * submessages are still discarded, so they are lost when the message is
+ * encoded again. Decode a submessage as bytes and call this function on it
+ * separately if its unknown fields must be kept.
+ *
+ * Example usage:
+ *    pb_unknown_span_t spans[8];
+ *    pb_unknown_fields_t unknown = {spans, 8, 0, NULL, 0, 0};
+ *
+ *    pb_decode_keep_unknown(&istream, MyMessage_fields, &msg, &unknown);
+ *    msg.field1 = 42;
+ *    pb_encode_keep_unknown(&ostream, MyMessage_fields, &msg, &unknown);
+ */
+bool pb_decode_keep_unknown(pb_istream_t *stream, const pb_field_t fields[],
+                            void *dest_struct, pb_unknown_fields_t *unknown);
+
 /* Same as pb_decode, except expects the stream to start with the message size
  * encoded as varint. Corresponds to parseDelimitedFrom() in Google's
  * protobuf API.
@@ -93,12 +204,190 @@ bool pb_decode_delimited(pb_istream_t *stream, const pb_field_t fields[], void *
 void pb_release(const pb_field_t fields[], void *dest_struct);
 #endif
 
+#ifdef PB_ENABLE_ARENA
+/* Initialize an arena to allocate from the given buffer, which must be
+ * aligned for any type. When the buffer runs out, blocks of block_size
+ * bytes are allocated with pb_realloc() and chained, unless block_size
+ * is 0. Buffer can be NULL if block_size is not 0.
+ *
+ * To use the arena, set stream->arena before decoding. Messages decoded
+ * with an arena must not be passed to pb_release(). Instead, all of them
+ * are released at once by pb_arena_reset(). The arena is not released
+ * if pb_decode() fails.
+ *
+ * pb_decode_noinit() can merge into a message only if its pointer fields
+ * are NULL or were allocated from the same arena since its last reset.
+ * Other pointers, e.g. from pb_realloc(), fail the decoding with
+ * "pointer not from arena".
+ *
+ * Example usage:
+ *    static uint8_t arena_buffer[4096];
+ *    pb_arena_t arena;
+ *
+ *    pb_arena_init(&arena, arena_buffer, sizeof(arena_buffer), 1024);
+ *    stream = pb_istream_from_buffer(buffer, count);
+ *    stream.arena = &arena;
+ *    pb_decode(&stream, MyMessage_fields, &msg);
+ *    // ... use msg ...
+ *    pb_arena_reset(&arena);
+ */
+void pb_arena_init(pb_arena_t *arena, void *buffer, size_t buffer_size, size_t block_size);
+
+/* Release all allocations made from the arena, and free the extra blocks. */
+void pb_arena_reset(pb_arena_t *arena);
+#endif
+
+
+/***********************************
+ * Decoding from partial input     *
+ ***********************************/
+
+/* Maximum nesting depth of submessages for pb_push_decode(). */
+#ifndef PB_PUSH_MAX_DEPTH
+#define PB_PUSH_MAX_DEPTH 8
+#endif
+
+typedef enum {
+    PB_PUSH_NEED_MORE,  /* Feed more data */
+    PB_PUSH_DONE,       /* The message was decoded successfully */
+    PB_PUSH_ERROR       /* Decoding failed, see PB_GET_ERROR(decoder) */
+} pb_push_status_t;
+
+/* State of one message being decoded, i.e. the top-level message or
+ * a static submessage field. */
+typedef struct pb_push_frame_s pb_push_frame_t;
+struct pb_push_frame_s
+{
+    pb_field_iter_t iter;
+    size_t end;         /* Input position where the message ends */
+    uint32_t extension_range_start;
+    uint8_t fields_seen[(PB_MAX_REQUIRED_FIELDS + 7) / 8];
+};
+
+/* Decoder that takes the input in chunks as it arrives, instead of reading
+ * it from a stream. Initialize with pb_push_decoder_init(). */
+typedef struct pb_push_decoder_s pb_push_decoder_t;
+struct pb_push_decoder_s
+{
+    pb_push_frame_t stack[PB_PUSH_MAX_DEPTH];
+    uint8_t depth;
+    uint8_t state;
+    pb_push_status_t status;
+    size_t position;    /* Number of input bytes consumed so far */
+
+    /* Field currently being decoded */
+    uint32_t tag;
+    pb_wire_type_t wire_type;
+    bool extension;     /* Field is passed to the extension handlers */
+    bool skip;          /* Field is unknown and will be discarded */
+    uint8_t value[10];  /* Tag, length, varint or fixed-size value */
+    uint8_t value_size;
+    size_t value_left;
+
+    /* Buffer for collecting length-delimited values */
+    uint8_t *scratch;
+    size_t scratch_size;
+    size_t scratch_used;
+
+#ifndef PB_NO_ERRMSG
+    const char *errmsg;
+#endif
+
+#ifdef PB_ENABLE_STATS
+    pb_stats_t *stats;  /* Counters, &pb_stats by default. See pb_stats_t. */
+#endif
+};
+
+/* Prepare to decode a message into dest_struct, which is initialized to
+ * default values like in pb_decode(). Message_size is the length of the
+ * encoded message, or (size_t)-1 if it will be known only at the end of input.
+ *
+ * Static submessages are decoded as their data arrives. Other
+ * length-delimited fields (strings, bytes, packed arrays, callback and
+ * pointer fields) are collected in the scratch buffer first, so it must be
+ * large enough for the longest such field, including the length prefix.
+ * Callback functions see the data in the scratch buffer, which is reused
+ * for the next field. For this reason pb_decode_bytes_view() copies the
+ * data to its copy_buffer and pb_decode_lazy_submessage() decodes the
+ * submessage right away, as with callback streams.
+ */
+void pb_push_decoder_init(pb_push_decoder_t *decoder, const pb_field_t fields[],
+                          void *dest_struct, size_t message_size,
+                          uint8_t *scratch, size_t scratch_size);
+
+/* Decode the next count bytes of the message. Any amount of data can be
+ * given at a time. Returns PB_PUSH_DONE once message_size bytes have been
+ * decoded. Any bytes after the end of the message are not consumed, so
+ * decoder->position can be used to find where the next message starts.
+ *
+ * Example usage:
+ *    pb_push_decoder_t decoder;
+ *    pb_push_status_t status = PB_PUSH_NEED_MORE;
+ *
+ *    pb_push_decoder_init(&decoder, MyMessage_fields, &msg, frame_size,
+ *                         scratch, sizeof(scratch));
+ *    while (status == PB_PUSH_NEED_MORE)
+ *    {
+ *        count = uart_receive(buffer, sizeof(buffer));
+ *        status = pb_push_decode(&decoder, buffer, count);
+ *    }
+ */
+pb_push_status_t pb_push_decode(pb_push_decoder_t *decoder, const uint8_t *buf, size_t count);
+
+/* Signal the end of input, when message_size was given as (size_t)-1.
+ * Returns PB_PUSH_DONE if the input ended at a field boundary of the
+ * top-level message and all required fields were present. */
+pb_push_status_t pb_push_decode_finish(pb_push_decoder_t *decoder);
+
 
 /**************************************
  * Functions for manipulating streams *
  **************************************/
 
+#ifndef PB_BUFFER_ONLY
+/* Function for reading input in blocks, like read(). It should wait until
+ * some data is available, and then return up to count bytes in buf.
+ * Returns the number of bytes read, or 0 on end of input or error. */
+typedef size_t (*pb_read_func_t)(void *state, uint8_t *buf, size_t count);
+
+/* Read-ahead buffer for streams from a pb_read_func_t, initialized with
+ * pb_input_buffer_init(). The read function is called only when the buffer
+ * runs out, instead of once for every few bytes. */
+typedef struct pb_input_buffer_s pb_input_buffer_t;
+struct pb_input_buffer_s
+{
+    pb_read_func_t read;
+    void *state;        /* Passed to the read function */
+    uint8_t *buffer;
+    size_t size;
+    size_t start;       /* Next unread byte in buffer */
+    size_t end;         /* End of the data in buffer */
+};
+
+void pb_input_buffer_init(pb_input_buffer_t *input, pb_read_func_t read, void *state,
+                          uint8_t *buffer, size_t size);
+
+/* Create an input stream for reading through an input buffer. The data
+ * read ahead past the end of a message remains in the input buffer, so
+ * several messages can be read by creating new streams from it.
+ *
+ * Example usage:
+ *    static size_t read_socket(void *state, uint8_t *buf, size_t count)
+ *    {
+ *        ssize_t result = recv(*(int*)state, buf, count, 0);
+ *        return (result > 0) ? (size_t)result : 0;
+ *    }
+ *
+ *    pb_input_buffer_init(&input, &read_socket, &fd, buffer, sizeof(buffer));
+ *    stream = pb_istream_from_input_buffer(&input, SIZE_MAX);
+ *    pb_decode_delimited(&stream, MyMessage_fields, &msg);
+ */
+pb_istream_t pb_istream_from_input_buffer(pb_input_buffer_t *input, size_t bytes_left);
+#endif
+
 /* Create an input stream for reading from a memory buffer.
+ * Tags, varints and fixed-size values are read directly from the buffer,
+ * so this is fast even when PB_BUFFER_ONLY is not defined.
  *
  * Alternatively, you can use a custom stream that reads directly from e.g.
  * a file or a network socket.
@@ -138,6 +427,91 @@ bool pb_decode_fixed32(pb_istream_t *stream, void *dest);
  * a 8-byte wide C variable. */
 bool pb_decode_fixed64(pb_istream_t *stream, void *dest);
 
+/* Callback for decoding a bytes or string field as a pb_bytes_view_t.
+ * With a buffer stream, the view points directly into the input buffer,
+ * which must then be kept around as long as the view is used. With other
+ * streams the data is copied to view->copy_buffer, and decoding fails if
+ * it does not fit. For repeated fields, only the last entry is kept.
+ *
+ * Example usage:
+ *    pb_bytes_view_t view = {0};
+ *    msg.payload.funcs.decode = &pb_decode_bytes_view;
+ *    msg.payload.arg = &view;
+ *    pb_decode(&stream, MyMessage_fields, &msg);
+ */
+#ifdef PB_OLD_CALLBACK_STYLE
+bool pb_decode_bytes_view(pb_istream_t *stream, const pb_field_t *field, void *arg);
+#else
+bool pb_decode_bytes_view(pb_istream_t *stream, const pb_field_t *field, void **arg);
+#endif
+
+/* State for decoding a submessage lazily, see pb_decode_lazy_submessage(). */
+typedef struct pb_lazy_submessage_s pb_lazy_submessage_t;
+struct pb_lazy_submessage_s {
+    const pb_field_t *fields; /* Field descriptions of the submessage type */
+    void *dest;               /* Structure to decode the submessage into */
+    pb_bytes_view_t encoded;  /* Encoded submessage, while not yet decoded */
+    bool present;             /* Set when the field was found in the message */
+    bool decoded;             /* Set when dest contains the decoded submessage */
+};
+
+/* Callback for a submessage field, which records the location of the
+ * encoded submessage instead of decoding it. The submessage is decoded
+ * into lazy->dest only when pb_lazy_submessage_get() is called. With
+ * callback streams, the data cannot be referenced later, and the
+ * submessage is decoded immediately instead. The input buffer must be
+ * kept around until the submessage has been decoded. A value that is not
+ * length-delimited fails with "wrong wire type".
+ *
+ * The callback arg must point to a pb_lazy_submessage_t, which has
+ * fields and dest filled in and the rest zeroed before each decode.
+ */
+#ifdef PB_OLD_CALLBACK_STYLE
+bool pb_decode_lazy_submessage(pb_istream_t *stream, const pb_field_t *field, void *arg);
+#else
+bool pb_decode_lazy_submessage(pb_istream_t *stream, const pb_field_t *field, void **arg);
+#endif
+
+/* Decode a submessage recorded by pb_decode_lazy_submessage(), if not done
+ * already. Returns false if the field was not present or decoding failed. */
+bool pb_lazy_submessage_get(pb_lazy_submessage_t *lazy);
+
+/* Location of one field in an encoded message, see pb_scan_fields(). */
+typedef struct pb_field_span_s pb_field_span_t;
+struct pb_field_span_s
+{
+    uint32_t tag;
+    pb_wire_type_t wire_type;
+    size_t offset;  /* Start of the value, after the tag and length prefix */
+    size_t length;  /* Length of the value, e.g. the varint bytes */
+};
+
+/* Scan the fields of a message without decoding the values, storing the
+ * location of each field in spans. Offsets are counted from the position
+ * of the stream at the start. Sets count to the number of fields found.
+ * Returns false if the message is invalid or there are more than
+ * max_spans fields.
+ *
+ * A value can then be read by creating a stream for its location, e.g.
+ *    stream = pb_istream_from_buffer(buffer + span->offset, span->length);
+ *    pb_decode_varint(&stream, &value);
+ */
+bool pb_scan_fields(pb_istream_t *stream, pb_field_span_t *spans, size_t max_spans, size_t *count);
+
+/* Find the field with the given tag from the output of pb_scan_fields().
+ * If the field occurs several times, returns the last occurrence, like
+ * the decoder would use for a non-repeated field. Returns NULL if the field
+ * is not present. */
+const pb_field_span_t *pb_find_field_span(const pb_field_span_t *spans, size_t count, uint32_t tag);
+
+/* Find a field inside nested submessages of the message in buf, following
+ * the tags in path. For example, path {3, 1} finds field 1 of the
+ * submessage in field 3. The offset in result is counted from buf.
+ * Returns false if the field is not present or the data is invalid.
+ */
+bool pb_find_field_path(const uint8_t *buf, size_t size, const uint32_t *path,
+                        size_t depth, pb_field_span_t *result);
+
 /* Make a limited-length substream for reading a PB_WT_STRING field. */
 bool pb_make_string_substream(pb_istream_t *stream, pb_istream_t *substream);
 void pb_close_string_substream(pb_istream_t *stream, pb_istream_t *substream);
@@ -23,6 +23,13 @@
 typedef bool (*pb_encoder_t)(pb_ostream_t *stream, const pb_field_t *field, const void *src) checkreturn;
 
 static bool checkreturn buf_write(pb_ostream_t *stream, const uint8_t *buf, size_t count);
+#ifndef PB_BUFFER_ONLY
+static bool checkreturn gather_write(pb_ostream_t *stream, const uint8_t *buf, size_t count);
+static bool checkreturn gather_reference(pb_ostream_t *stream, const uint8_t *buf, size_t count);
+#endif
+static uint8_t *buf_put_varint(uint8_t *dest, uint64_t value);
+static size_t varint_size(uint64_t value);
+static bool load_varint_value(const pb_field_t *field, const void *src, uint64_t *value);
 static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *field, const void *pData, size_t count, pb_encoder_t func);
 static bool checkreturn encode_field(pb_ostream_t *stream, const pb_field_t *field, const void *pData);
 static bool checkreturn default_extension_encoder(pb_ostream_t *stream, const pb_extension_t *extension);
@@ -81,8 +88,149 @@ pb_ostream_t pb_ostream_from_buffer(uint8_t *buf, size_t bufsize)
 #ifndef PB_NO_ERRMSG
     stream.errmsg = NULL;
 #endif
+#ifdef PB_ENABLE_STATS
+    stream.stats = &pb_stats;
+#endif
+#ifdef PB_ENABLE_SIZE_CACHE
+    stream.size_cache = NULL;
+#endif
+    return stream;
+}
+
+#ifndef PB_BUFFER_ONLY
+void pb_gather_init(pb_gather_t *gather, pb_gather_segment_t *segments, size_t max_segments,
+                    uint8_t *scratch, size_t scratch_size, size_t reference_threshold)
+{
+    gather->segments = segments;
+    gather->max_segments = max_segments;
+    gather->segment_count = 0;
+    gather->scratch = scratch;
+    gather->scratch_size = scratch_size;
+    gather->scratch_used = 0;
+    gather->reference_threshold = reference_threshold;
+}
+
+/* Copy the data into the scratch buffer, extending the last segment if
+ * it already ends there. */
+static bool checkreturn gather_write(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+{
+    pb_gather_t *gather = (pb_gather_t*)stream->state;
+    uint8_t *dest = gather->scratch + gather->scratch_used;
+    pb_gather_segment_t *last = NULL;
+    
+    if (count == 0)
+        return true;
+    
+    if (count > gather->scratch_size - gather->scratch_used)
+        PB_RETURN_ERROR(stream, "gather full");
+    
+    if (gather->segment_count > 0)
+        last = &gather->segments[gather->segment_count - 1];
+    
+    if (last == NULL || (const uint8_t*)last->base + last->len != dest)
+    {
+        if (gather->segment_count == gather->max_segments)
+            PB_RETURN_ERROR(stream, "gather full");
+        
+        last = &gather->segments[gather->segment_count++];
+        last->base = dest;
+        last->len = 0;
+    }
+    
+    memcpy(dest, buf, count);
+    last->len += count;
+    gather->scratch_used += count;
+    return true;
+}
+
+/* Same as pb_write(), but add a segment that refers to the data instead of
+ * copying it. */
+static bool checkreturn gather_reference(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+{
+    pb_gather_t *gather = (pb_gather_t*)stream->state;
+    pb_gather_segment_t *segment;
+    
+    if (stream->bytes_written + count > stream->max_size)
+        PB_RETURN_ERROR(stream, "stream full");
+    
+    if (gather->segment_count == gather->max_segments)
+        PB_RETURN_ERROR(stream, "gather full");
+    
+    segment = &gather->segments[gather->segment_count++];
+    segment->base = buf;
+    segment->len = count;
+    
+    stream->bytes_written += count;
+    PB_STATS_ADD(stream, bytes_written, count);
+    return true;
+}
+
+pb_ostream_t pb_ostream_from_gather(pb_gather_t *gather)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(NULL, SIZE_MAX);
+    stream.callback = &gather_write;
+    stream.state = gather;
     return stream;
 }
+#endif
+
+/* Check if the stream writes to a memory buffer created by
+ * pb_ostream_from_buffer(). In that case stream->state points directly to
+ * the next output byte. */
+static bool pb_is_buffer_stream(const pb_ostream_t *stream)
+{
+#ifdef PB_BUFFER_ONLY
+    return stream->callback != NULL;
+#else
+    return stream->callback == &buf_write;
+#endif
+}
+
+/* Store a value in the varint format at dest, and return pointer to the
+ * byte following it. Values that fit in 32 bits are handled with 32-bit
+ * arithmetic, which is much cheaper on 8-bit targets. */
+static uint8_t *buf_put_varint(uint8_t *dest, uint64_t value)
+{
+    if (value <= 0xFFFFFFFFU)
+    {
+        uint32_t low = (uint32_t)value;
+        while (low >= 0x80)
+        {
+            *dest++ = (uint8_t)(low | 0x80);
+            low >>= 7;
+        }
+        *dest++ = (uint8_t)low;
+    }
+    else
+    {
+        while (value >= 0x80)
+        {
+            *dest++ = (uint8_t)(value | 0x80);
+            value >>= 7;
+        }
+        *dest++ = (uint8_t)value;
+    }
+
+    return dest;
+}
+
+/* Number of bytes in the varint encoding of value. GCC and clang can get
+ * it from the count of leading zero bits, without a loop. */
+static size_t varint_size(uint64_t value)
+{
+#if defined(__GNUC__) && (__GNUC__ >= 4)
+    size_t bits = 64 - (size_t)__builtin_clzll(value | 1);
+    return (bits + 6) / 7;
+#else
+    size_t size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+    return size;
+#endif
+}
 
 bool checkreturn pb_write(pb_ostream_t *stream, const uint8_t *buf, size_t count)
 {
@@ -98,6 +246,7 @@ bool checkreturn pb_write(pb_ostream_t *stream, const uint8_t *buf, size_t count
         if (!stream->callback(stream, buf, count))
             PB_RETURN_ERROR(stream, "io error");
 #endif
+        PB_STATS_ADD(stream, bytes_written, count);
     }
     
     stream->bytes_written += count;
@@ -115,6 +264,8 @@ static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *fie
     size_t i;
     const void *p;
     size_t size;
+    uint64_t value;
+    bool direct = false;
     
     if (count == 0)
         return true;
@@ -137,6 +288,19 @@ static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *fie
         {
             size = 8 * count;
         }
+        else if (load_varint_value(field, pData, &value))
+        {
+            /* Add up the varint lengths without encoding anything */
+            direct = true;
+            size = 0;
+            p = pData;
+            for (i = 0; i < count; i++)
+            {
+                (void)load_varint_value(field, p, &value);
+                size += varint_size(value);
+                p = (const char*)p + field->data_size;
+            }
+        }
         else
         { 
             pb_ostream_t sizestream = PB_OSTREAM_SIZING;
@@ -148,6 +312,7 @@ static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *fie
                 p = (const char*)p + field->data_size;
             }
             size = sizestream.bytes_written;
+            PB_STATS_ADD(stream, sizing_passes, 1);
         }
         
         if (!pb_encode_varint(stream, (uint64_t)size))
@@ -156,6 +321,62 @@ static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *fie
         if (stream->callback == NULL)
             return pb_write(stream, NULL, size); /* Just sizing.. */
         
+        if (direct && pb_is_buffer_stream(stream))
+        {
+            /* Write all the varints directly to the buffer. The total size
+             * is known, so the bounds only need to be checked once. */
+            uint8_t *dest = (uint8_t*)stream->state;
+            
+            if (stream->bytes_written + size > stream->max_size)
+                PB_RETURN_ERROR(stream, "stream full");
+            
+            p = pData;
+            for (i = 0; i < count; i++)
+            {
+                (void)load_varint_value(field, p, &value);
+                dest = buf_put_varint(dest, value);
+                p = (const char*)p + field->data_size;
+            }
+            
+            stream->state = dest;
+            stream->bytes_written += size;
+            PB_STATS_ADD(stream, bytes_written, size);
+            return true;
+        }
+        
+        if (direct)
+        {
+            /* Collect the varints into blocks for the stream callback */
+            uint8_t buffer[32];
+            uint8_t *dest = buffer;
+            
+            p = pData;
+            for (i = 0; i < count; i++)
+            {
+                if (dest > buffer + sizeof(buffer) - 10)
+                {
+                    if (!pb_write(stream, buffer, (size_t)(dest - buffer)))
+                        return false;
+                    dest = buffer;
+                }
+                
+                (void)load_varint_value(field, p, &value);
+                dest = buf_put_varint(dest, value);
+                p = (const char*)p + field->data_size;
+            }
+            
+            return pb_write(stream, buffer, (size_t)(dest - buffer));
+        }
+        
+#ifndef __BIG_ENDIAN__
+        if ((PB_LTYPE(field->type) == PB_LTYPE_FIXED32 && field->data_size == 4) ||
+            (PB_LTYPE(field->type) == PB_LTYPE_FIXED64 && field->data_size == 8))
+        {
+            /* Fixed-size values are stored in the wire format already */
+            return pb_write(stream, (const uint8_t*)pData, size);
+        }
+#endif
+        
         /* Write the data */
         p = pData;
         for (i = 0; i < count; i++)
@@ -272,6 +493,7 @@ static bool checkreturn encode_callback_field(pb_ostream_t *stream,
     
     if (callback->funcs.encode != NULL)
     {
+        PB_STATS_ADD(stream, callbacks, 1);
         if (!callback->funcs.encode(stream, field, arg))
             PB_RETURN_ERROR(stream, "callback error");
     }
@@ -370,6 +592,23 @@ bool checkreturn pb_encode(pb_ostream_t *stream, const pb_field_t fields[], cons
     return true;
 }
 
+bool pb_encode_keep_unknown(pb_ostream_t *stream, const pb_field_t fields[],
+                            const void *src_struct, const pb_unknown_fields_t *unknown)
+{
+    size_t i;
+
+    if (!pb_encode(stream, fields, src_struct))
+        return false;
+
+    for (i = 0; i < unknown->span_count; i++)
+    {
+        if (!pb_write(stream, unknown->spans[i].data, unknown->spans[i].size))
+            return false;
+    }
+
+    return true;
+}
+
 bool pb_encode_delimited(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct)
 {
     return pb_encode_submessage(stream, fields, src_struct);
@@ -379,6 +618,11 @@ bool pb_get_encoded_size(size_t *size, const pb_field_t fields[], const void *sr
 {
     pb_ostream_t stream = PB_OSTREAM_SIZING;
     
+#ifdef PB_ENABLE_STATS
+    stream.stats = &pb_stats;
+    PB_STATS_ADD(&stream, sizing_passes, 1);
+#endif
+    
     if (!pb_encode(&stream, fields, src_struct))
         return false;
     
@@ -386,26 +630,117 @@ bool pb_get_encoded_size(size_t *size, const pb_field_t fields[], const void *sr
     return true;
 }
 
+#ifdef PB_ENABLE_SIZE_CACHE
+void pb_size_cache_init(pb_size_cache_t *cache, pb_size_cache_entry_t *entries, pb_size_t capacity)
+{
+    cache->entries = entries;
+    cache->capacity = capacity;
+    cache->count = 0;
+}
+
+void pb_size_cache_invalidate(pb_size_cache_t *cache, const void *changed)
+{
+    const char *p = (const char*)changed;
+    pb_size_t i = 0;
+    
+    while (i < cache->count)
+    {
+        const pb_size_cache_entry_t *entry = &cache->entries[i];
+        
+        if (p >= (const char*)entry->src_struct && p < (const char*)entry->src_end)
+        {
+            /* Move the last entry into the freed slot */
+            cache->count--;
+            cache->entries[i] = cache->entries[cache->count];
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+void pb_size_cache_clear(pb_size_cache_t *cache)
+{
+    cache->count = 0;
+}
+
+static bool size_cache_find(const pb_size_cache_t *cache, const pb_field_t fields[],
+                            const void *src_struct, size_t *size)
+{
+    pb_size_t i;
+    
+    if (cache == NULL)
+        return false;
+    
+    for (i = 0; i < cache->count; i++)
+    {
+        if (cache->entries[i].src_struct == src_struct &&
+            cache->entries[i].fields == fields)
+        {
+            *size = cache->entries[i].size;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+static void size_cache_store(pb_size_cache_t *cache, const pb_field_t fields[],
+                             const void *src_struct, size_t size)
+{
+    pb_size_cache_entry_t *entry;
+    pb_field_iter_t iter;
+    
+    if (cache == NULL || cache->count >= cache->capacity)
+        return;
+    
+    entry = &cache->entries[cache->count++];
+    entry->fields = fields;
+    entry->src_struct = src_struct;
+    entry->src_end = src_struct;
+    entry->size = size;
+    
+    /* The fields are stored in order, so the structure ends with the last one */
+    if (pb_field_iter_begin(&iter, fields, remove_const(src_struct)))
+    {
+        (void)pb_field_iter_prev(&iter);
+        entry->src_end = (const char*)iter.pData + pb_field_struct_size(iter.pos);
+    }
+}
+
+bool pb_get_encoded_size_cached(size_t *size, const pb_field_t fields[], const void *src_struct,
+                                pb_size_cache_t *cache)
+{
+    pb_ostream_t stream = PB_OSTREAM_SIZING;
+    
+    if (size_cache_find(cache, fields, src_struct, size))
+        return true;
+    
+#ifdef PB_ENABLE_STATS
+    stream.stats = &pb_stats;
+    PB_STATS_ADD(&stream, sizing_passes, 1);
+#endif
+    stream.size_cache = cache;
+    
+    if (!pb_encode(&stream, fields, src_struct))
+        return false;
+    
+    *size = stream.bytes_written;
+    size_cache_store(cache, fields, src_struct, *size);
+    return true;
+}
+#endif
+
 /********************
  * Helper functions *
  ********************/
 bool checkreturn pb_encode_varint(pb_ostream_t *stream, uint64_t value)
 {
     uint8_t buffer[10];
-    size_t i = 0;
+    uint8_t *end = buf_put_varint(buffer, value);
     
-    if (value == 0)
-        return pb_write(stream, (uint8_t*)&value, 1);
-    
-    while (value)
-    {
-        buffer[i] = (uint8_t)((value & 0x7F) | 0x80);
-        value >>= 7;
-        i++;
-    }
-    buffer[i-1] &= 0x7F; /* Unset top bit on last byte */
-    
-    return pb_write(stream, buffer, i);
+    return pb_write(stream, buffer, (size_t)(end - buffer));
 }
 
 bool checkreturn pb_encode_svarint(pb_ostream_t *stream, int64_t value)
@@ -496,25 +831,146 @@ bool checkreturn pb_encode_string(pb_ostream_t *stream, const uint8_t *buffer, s
     if (!pb_encode_varint(stream, (uint64_t)size))
         return false;
     
+#ifndef PB_BUFFER_ONLY
+    if (stream->callback == &gather_write && size > 0 &&
+        size >= ((const pb_gather_t*)stream->state)->reference_threshold)
+    {
+        return gather_reference(stream, buffer, size);
+    }
+#endif
+    
     return pb_write(stream, buffer, size);
 }
 
+#ifdef PB_OLD_CALLBACK_STYLE
+bool checkreturn pb_encode_bytes_view(pb_ostream_t *stream, const pb_field_t *field, const void *arg)
+{
+    const pb_bytes_view_t *view = (const pb_bytes_view_t*)arg;
+#else
+bool checkreturn pb_encode_bytes_view(pb_ostream_t *stream, const pb_field_t *field, void * const *arg)
+{
+    const pb_bytes_view_t *view = (const pb_bytes_view_t*)*arg;
+#endif
+    
+    if (view->bytes == NULL)
+        return true; /* Field not present */
+    
+    if (!pb_encode_tag_for_field(stream, field))
+        return false;
+    
+    return pb_encode_string(stream, view->bytes, view->size);
+}
+
+/* Encode a submessage into a memory buffer in a single pass. The data is
+ * written after room for a length prefix of reserved bytes, and moved
+ * afterwards if the actual length prefix has a different size. The size of
+ * the data is stored in *size. */
+static bool checkreturn encode_submessage_in_place(pb_ostream_t *stream, const pb_field_t fields[],
+                                                   const void *src_struct, size_t reserved, size_t *size_out)
+{
+    uint8_t *start = (uint8_t*)stream->state;
+    pb_ostream_t substream = *stream;
+    size_t size;
+    size_t prefix;
+    bool status;
+    
+    if (stream->bytes_written + reserved > stream->max_size)
+        PB_RETURN_ERROR(stream, "stream full");
+    
+    substream.state = start + reserved;
+    substream.max_size = stream->max_size - stream->bytes_written - reserved;
+    substream.bytes_written = 0;
+#ifndef PB_NO_ERRMSG
+    substream.errmsg = NULL;
+#endif
+    PB_STATS_ADD(stream, substreams, 1);
+    
+    status = pb_encode(&substream, fields, src_struct);
+    
+#ifndef PB_NO_ERRMSG
+    stream->errmsg = substream.errmsg;
+#endif
+    
+    if (!status)
+        return false;
+    
+    /* Move the data up if the length prefix is longer than reserved */
+    size = substream.bytes_written;
+    prefix = varint_size((uint64_t)size);
+    if (prefix > reserved && stream->max_size - stream->bytes_written < prefix + size)
+        PB_RETURN_ERROR(stream, "stream full");
+    
+    if (prefix != reserved)
+        memmove(start + prefix, start + reserved, size);
+    buf_put_varint(start, (uint64_t)size);
+    
+    stream->state = start + prefix + size;
+    stream->bytes_written += prefix + size;
+    PB_STATS_ADD(stream, bytes_written, prefix);
+    *size_out = size;
+    return true;
+}
+
 bool checkreturn pb_encode_submessage(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct)
 {
-    /* First calculate the message size using a non-writing substream. */
     pb_ostream_t substream = PB_OSTREAM_SIZING;
     size_t size;
     bool status;
     
-    if (!pb_encode(&substream, fields, src_struct))
+    if (pb_is_buffer_stream(stream))
     {
-#ifndef PB_NO_ERRMSG
-        stream->errmsg = substream.errmsg;
+        /* Most submessages are shorter than 128 bytes, so reserve one byte
+         * for the length prefix. Longer ones are moved up after encoding. */
+        size_t reserved = 1;
+        
+#ifdef PB_ENABLE_SIZE_CACHE
+        /* With a known size, reserve the exact prefix so nothing is moved */
+        size_t known_size;
+        bool cached = size_cache_find(stream->size_cache, fields, src_struct, &known_size);
+        if (cached)
+            reserved = varint_size((uint64_t)known_size);
 #endif
-        return false;
+        
+        /* If the data does not fit after a one byte prefix, it does not
+         * fit at all, so there is no need to fall back to two passes. */
+        if (!encode_submessage_in_place(stream, fields, src_struct, reserved, &size))
+            return false;
+        
+#ifdef PB_ENABLE_SIZE_CACHE
+        if (cached && size != known_size)
+            PB_RETURN_ERROR(stream, "submsg size changed");
+        if (!cached)
+            size_cache_store(stream->size_cache, fields, src_struct, size);
+#endif
+        return true;
     }
     
-    size = substream.bytes_written;
+#ifdef PB_ENABLE_STATS
+    substream.stats = stream->stats;
+#endif
+    
+#ifdef PB_ENABLE_SIZE_CACHE
+    substream.size_cache = stream->size_cache;
+    if (!size_cache_find(stream->size_cache, fields, src_struct, &size))
+#endif
+    {
+        /* First calculate the message size using a non-writing substream. */
+        PB_STATS_ADD(stream, sizing_passes, 1);
+        
+        if (!pb_encode(&substream, fields, src_struct))
+        {
+#ifndef PB_NO_ERRMSG
+            stream->errmsg = substream.errmsg;
+#endif
+            return false;
+        }
+        
+        size = substream.bytes_written;
+        
+#ifdef PB_ENABLE_SIZE_CACHE
+        size_cache_store(stream->size_cache, fields, src_struct, size);
+#endif
+    }
     
     if (!pb_encode_varint(stream, (uint64_t)size))
         return false;
@@ -534,6 +990,7 @@ bool checkreturn pb_encode_submessage(pb_ostream_t *stream, const pb_field_t fie
 #ifndef PB_NO_ERRMSG
     substream.errmsg = NULL;
 #endif
+    PB_STATS_ADD(stream, substreams, 1);
     
     status = pb_encode(&substream, fields, src_struct);
     
@@ -549,6 +1006,53 @@ bool checkreturn pb_encode_submessage(pb_ostream_t *stream, const pb_field_t fie
     return status;
 }
 
+/* Load the value of a varint, uvarint or svarint field for encoding, with
+ * the same sign extension and zig-zag encoding as the field encoders below.
+ * Returns false if the data_size is not supported. */
+static bool load_varint_value(const pb_field_t *field, const void *src, uint64_t *value)
+{
+    int64_t svalue;
+    
+    if (PB_LTYPE(field->type) == PB_LTYPE_UVARINT)
+    {
+        switch (field->data_size)
+        {
+            case 4: *value = *(const uint32_t*)src; return true;
+            case 8: *value = *(const uint64_t*)src; return true;
+            default: return false;
+        }
+    }
+    
+    switch (field->data_size)
+    {
+        case 4: svalue = *(const int32_t*)src; break;
+        case 8: svalue = *(const int64_t*)src; break;
+        default:
+            if (PB_LTYPE(field->type) != PB_LTYPE_VARINT)
+                return false;
+            else if (field->data_size == 1)
+                svalue = *(const int8_t*)src;
+            else if (field->data_size == 2)
+                svalue = *(const int16_t*)src;
+            else
+                return false;
+    }
+    
+    if (PB_LTYPE(field->type) == PB_LTYPE_SVARINT)
+    {
+        if (svalue < 0)
+            *value = ~((uint64_t)svalue << 1);
+        else
+            *value = (uint64_t)svalue << 1;
+    }
+    else
+    {
+        *value = (uint64_t)svalue;
+    }
+    
+    return true;
+}
+
 /* Field encoders */
 
 static bool checkreturn pb_enc_varint(pb_ostream_t *stream, const pb_field_t *field, const void *src)
@@ -662,3 +1166,371 @@ static bool checkreturn pb_enc_submessage(pb_ostream_t *stream, const pb_field_t
     return pb_encode_submessage(stream, (const pb_field_t*)field->ptr, src);
 }
 
+
+/*************************************
+ * Encoding from the end of a buffer *
+ *************************************/
+
+/* The reverse encoder writes a message from the end of the space towards
+ * its start, so that the length of a submessage is known when its length
+ * prefix is written. In the stream used for this, state points to the
+ * first byte written so far. */
+
+static bool checkreturn rev_write(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+{
+    /* Empty bytes and strings may have a NULL buf */
+    if (count == 0)
+        return true;
+
+    if (stream->bytes_written + count > stream->max_size)
+        PB_RETURN_ERROR(stream, "stream full");
+    
+    stream->state = (uint8_t*)stream->state - count;
+    memcpy(stream->state, buf, count);
+    stream->bytes_written += count;
+    PB_STATS_ADD(stream, bytes_written, count);
+    return true;
+}
+
+static bool checkreturn rev_encode_varint(pb_ostream_t *stream, uint64_t value)
+{
+    uint8_t buffer[10];
+    uint8_t *end = buf_put_varint(buffer, value);
+    
+    return rev_write(stream, buffer, (size_t)(end - buffer));
+}
+
+static bool checkreturn rev_encode_tag_for_field(pb_ostream_t *stream, const pb_field_t *field)
+{
+    pb_wire_type_t wiretype;
+    switch (PB_LTYPE(field->type))
+    {
+        case PB_LTYPE_VARINT:
+        case PB_LTYPE_UVARINT:
+        case PB_LTYPE_SVARINT:
+            wiretype = PB_WT_VARINT;
+            break;
+        
+        case PB_LTYPE_FIXED32:
+            wiretype = PB_WT_32BIT;
+            break;
+        
+        case PB_LTYPE_FIXED64:
+            wiretype = PB_WT_64BIT;
+            break;
+        
+        case PB_LTYPE_BYTES:
+        case PB_LTYPE_STRING:
+        case PB_LTYPE_SUBMESSAGE:
+            wiretype = PB_WT_STRING;
+            break;
+        
+        default:
+            PB_RETURN_ERROR(stream, "invalid field type");
+    }
+    
+    return rev_encode_varint(stream, ((uint64_t)field->tag << 3) | wiretype);
+}
+
+/* Write something that can only be encoded forwards, such as callback
+ * fields and extensions. It is sized first, and then encoded into the
+ * space in front of the data written so far. */
+static bool checkreturn rev_encode_forward(pb_ostream_t *stream, pb_encoder_t func,
+    const pb_field_t *field, const void *pData)
+{
+    pb_ostream_t substream = PB_OSTREAM_SIZING;
+    size_t size;
+    bool status;
+    
+#ifdef PB_ENABLE_STATS
+    substream.stats = stream->stats;
+    PB_STATS_ADD(stream, sizing_passes, 1);
+#endif
+#ifdef PB_ENABLE_SIZE_CACHE
+    substream.size_cache = stream->size_cache;
+#endif
+    
+    status = func(&substream, field, pData);
+    size = substream.bytes_written;
+    
+    if (status && size > 0)
+    {
+        if (stream->bytes_written + size > stream->max_size)
+            PB_RETURN_ERROR(stream, "stream full");
+        
+        substream = pb_ostream_from_buffer((uint8_t*)stream->state - size, size);
+#ifdef PB_ENABLE_STATS
+        substream.stats = stream->stats;
+#endif
+#ifdef PB_ENABLE_SIZE_CACHE
+        substream.size_cache = stream->size_cache;
+#endif
+        status = func(&substream, field, pData);
+    }
+    
+#ifndef PB_NO_ERRMSG
+    stream->errmsg = substream.errmsg;
+#endif
+    
+    if (!status)
+        return false;
+    
+    if (substream.bytes_written != size)
+        PB_RETURN_ERROR(stream, "field size changed");
+    
+    stream->state = (uint8_t*)stream->state - size;
+    stream->bytes_written += size;
+    return true;
+}
+
+static bool checkreturn rev_encode_fields(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct);
+
+/* Write a single value of a static or pointer field. */
+static bool checkreturn rev_encode_value(pb_ostream_t *stream, const pb_field_t *field, const void *pData)
+{
+    uint8_t buffer[10];
+    pb_ostream_t tmp;
+    uint64_t value;
+    const pb_bytes_array_t *bytes;
+    size_t size = 0;
+    size_t end;
+    
+    switch (PB_LTYPE(field->type))
+    {
+        case PB_LTYPE_SUBMESSAGE:
+            if (field->ptr == NULL)
+                PB_RETURN_ERROR(stream, "invalid field descriptor");
+            
+            end = stream->bytes_written;
+            if (!rev_encode_fields(stream, (const pb_field_t*)field->ptr, pData))
+                return false;
+            return rev_encode_varint(stream, (uint64_t)(stream->bytes_written - end));
+        
+        case PB_LTYPE_BYTES:
+            if (pData == NULL)
+                return rev_encode_varint(stream, 0); /* Empty, as in pb_enc_bytes() */
+            
+            bytes = (const pb_bytes_array_t*)pData;
+            if (PB_ATYPE(field->type) == PB_ATYPE_STATIC &&
+                PB_BYTES_ARRAY_T_ALLOCSIZE(bytes->size) > field->data_size)
+            {
+                PB_RETURN_ERROR(stream, "bytes size exceeded");
+            }
+            
+            if (!rev_write(stream, bytes->bytes, bytes->size))
+                return false;
+            return rev_encode_varint(stream, (uint64_t)bytes->size);
+        
+        case PB_LTYPE_STRING:
+            if (pData != NULL)
+            {
+                /* Same length limit as in pb_enc_string() */
+                size_t max_size = field->data_size;
+                const char *p = (const char*)pData;
+                
+                if (PB_ATYPE(field->type) == PB_ATYPE_POINTER)
+                    max_size = (size_t)-1;
+                
+                while (size < max_size && p[size] != '\0')
+                    size++;
+            }
+            
+            if (!rev_write(stream, (const uint8_t*)pData, size))
+                return false;
+            return rev_encode_varint(stream, (uint64_t)size);
+        
+        default:
+            if (PB_LTYPE(field->type) <= PB_LTYPE_SVARINT && load_varint_value(field, pData, &value))
+                return rev_encode_varint(stream, value);
+            
+#ifndef __BIG_ENDIAN__
+            /* Fixed-size values are stored in the wire format already */
+            if (PB_LTYPE(field->type) == PB_LTYPE_FIXED32)
+                return rev_write(stream, (const uint8_t*)pData, 4);
+            if (PB_LTYPE(field->type) == PB_LTYPE_FIXED64)
+                return rev_write(stream, (const uint8_t*)pData, 8);
+#endif
+            
+            /* Fixed-size values on big-endian targets, and errors from the
+             * field encoders */
+            tmp = pb_ostream_from_buffer(buffer, sizeof(buffer));
+#ifdef PB_ENABLE_STATS
+            tmp.stats = NULL;
+#endif
+            if (!PB_ENCODERS[PB_LTYPE(field->type)](&tmp, field, pData))
+                PB_RETURN_ERROR(stream, PB_GET_ERROR(&tmp));
+            
+            return rev_write(stream, buffer, tmp.bytes_written);
+    }
+}
+
+/* Write a static array, like encode_array() but from the last entry. */
+static bool checkreturn rev_encode_array(pb_ostream_t *stream, const pb_field_t *field,
+                         const void *pData, size_t count)
+{
+    const char *p;
+    size_t end;
+    
+    if (count == 0)
+        return true;
+    
+    if (PB_ATYPE(field->type) != PB_ATYPE_POINTER && count > field->array_size)
+        PB_RETURN_ERROR(stream, "array max size exceeded");
+    
+    p = (const char*)pData + field->data_size * count;
+    
+    if (PB_LTYPE(field->type) <= PB_LTYPE_LAST_PACKABLE)
+    {
+        end = stream->bytes_written;
+        
+#ifndef __BIG_ENDIAN__
+        if ((PB_LTYPE(field->type) == PB_LTYPE_FIXED32 && field->data_size == 4) ||
+            (PB_LTYPE(field->type) == PB_LTYPE_FIXED64 && field->data_size == 8))
+        {
+            /* Fixed-size values are stored in the wire format already */
+            if (count > (stream->max_size - stream->bytes_written) / field->data_size)
+                PB_RETURN_ERROR(stream, "stream full");
+            if (!rev_write(stream, (const uint8_t*)pData, field->data_size * count))
+                return false;
+            count = 0;
+        }
+#endif
+        
+        while (count--)
+        {
+            p -= field->data_size;
+            if (!rev_encode_value(stream, field, p))
+                return false;
+        }
+        
+        if (!rev_encode_varint(stream, (uint64_t)(stream->bytes_written - end)))
+            return false;
+        
+        return rev_encode_varint(stream, ((uint64_t)field->tag << 3) | PB_WT_STRING);
+    }
+    
+    while (count--)
+    {
+        p -= field->data_size;
+        
+        /* Pointer-type string and bytes entries are pointers to the data,
+         * see encode_array(). */
+        if (PB_ATYPE(field->type) == PB_ATYPE_POINTER &&
+            (PB_LTYPE(field->type) == PB_LTYPE_STRING ||
+             PB_LTYPE(field->type) == PB_LTYPE_BYTES))
+        {
+            if (!rev_encode_value(stream, field, *(const void* const*)p))
+                return false;
+        }
+        else
+        {
+            if (!rev_encode_value(stream, field, p))
+                return false;
+        }
+        
+        if (!rev_encode_tag_for_field(stream, field))
+            return false;
+    }
+    
+    return true;
+}
+
+/* Write a static or pointer field, like encode_basic_field(). */
+static bool checkreturn rev_encode_basic_field(pb_ostream_t *stream,
+    const pb_field_t *field, const void *pData)
+{
+    const void *pSize;
+    bool implicit_has = true;
+    
+    if (field->size_offset)
+        pSize = (const char*)pData + field->size_offset;
+    else
+        pSize = &implicit_has;
+    
+    if (PB_ATYPE(field->type) == PB_ATYPE_POINTER)
+    {
+        pData = *(const void* const*)pData;
+        implicit_has = (pData != NULL);
+    }
+    
+    switch (PB_HTYPE(field->type))
+    {
+        case PB_HTYPE_REQUIRED:
+            if (!pData)
+                PB_RETURN_ERROR(stream, "missing required field");
+            if (!rev_encode_value(stream, field, pData))
+                return false;
+            return rev_encode_tag_for_field(stream, field);
+        
+        case PB_HTYPE_OPTIONAL:
+            if (!*(const bool*)pSize)
+                return true;
+            if (!rev_encode_value(stream, field, pData))
+                return false;
+            return rev_encode_tag_for_field(stream, field);
+        
+        case PB_HTYPE_REPEATED:
+            return rev_encode_array(stream, field, pData, *(const pb_size_t*)pSize);
+        
+        default:
+            PB_RETURN_ERROR(stream, "invalid field type");
+    }
+}
+
+/* Write all fields of a message, from the last one. */
+static bool checkreturn rev_encode_fields(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct)
+{
+    pb_field_iter_t iter;
+    if (!pb_field_iter_begin(&iter, fields, remove_const(src_struct)))
+        return true; /* Empty message type */
+    
+    (void)pb_field_iter_prev(&iter);
+    
+    do {
+        bool status;
+        
+        if (PB_LTYPE(iter.pos->type) == PB_LTYPE_EXTENSION)
+            status = rev_encode_forward(stream, &encode_extension_field, iter.pos, iter.pData);
+        else if (PB_ATYPE(iter.pos->type) == PB_ATYPE_CALLBACK)
+            status = rev_encode_forward(stream, &encode_callback_field, iter.pos, iter.pData);
+        else
+            status = rev_encode_basic_field(stream, iter.pos, iter.pData);
+        
+        if (!status)
+            return false;
+    } while (pb_field_iter_prev(&iter));
+    
+    return true;
+}
+
+bool checkreturn pb_encode_reverse(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct)
+{
+    uint8_t *start = (uint8_t*)stream->state;
+    pb_ostream_t revstream = *stream;
+    bool status;
+    
+    if (!pb_is_buffer_stream(stream))
+        return pb_encode(stream, fields, src_struct);
+    
+    revstream.max_size = stream->max_size - stream->bytes_written;
+    revstream.state = start + revstream.max_size;
+    revstream.bytes_written = 0;
+#ifndef PB_NO_ERRMSG
+    revstream.errmsg = NULL;
+#endif
+    
+    status = rev_encode_fields(&revstream, fields, src_struct);
+    
+#ifndef PB_NO_ERRMSG
+    stream->errmsg = revstream.errmsg;
+#endif
+    
+    if (!status)
+        return false;
+    
+    /* Move the message to the start of the space */
+    memmove(start, revstream.state, revstream.bytes_written);
+    stream->state = start + revstream.bytes_written;
+    stream->bytes_written += revstream.bytes_written;
+    return true;
+}
@@ -12,6 +12,27 @@
 extern "C" {
 #endif
 
+#ifdef PB_ENABLE_SIZE_CACHE
+/* Encoded size of one submessage instance, see pb_size_cache_t. */
+typedef struct pb_size_cache_entry_s pb_size_cache_entry_t;
+struct pb_size_cache_entry_s {
+    const pb_field_t *fields;
+    const void *src_struct;
+    const void *src_end;    /* End of the structure's field storage */
+    size_t size;
+};
+
+/* Sizes of submessages that have been encoded before, so that they can
+ * be encoded without a sizing pass. The entries are provided by the
+ * caller; when all are in use, further sizes are not cached. */
+typedef struct pb_size_cache_s pb_size_cache_t;
+struct pb_size_cache_s {
+    pb_size_cache_entry_t *entries;
+    pb_size_t capacity;
+    pb_size_t count;
+};
+#endif
+
 /* Structure for defining custom output streams. You will need to provide
  * a callback function to write the bytes to your storage, which can be
  * for example a file or a network socket.
@@ -23,6 +44,11 @@ extern "C" {
  * 3) pb_write will update bytes_written after your callback runs.
  * 4) Substreams will modify max_size and bytes_written. Don't use them
  *    to calculate any pointers.
+ *
+ * Compile options add members such as stats and size_cache, which the
+ * encoder reads. If you fill in the structure member by member, memset()
+ * it to zero first, or start from PB_OSTREAM_SIZING and replace callback,
+ * state and max_size.
  */
 struct pb_ostream_s
 {
@@ -44,6 +70,16 @@ struct pb_ostream_s
 #ifndef PB_NO_ERRMSG
     const char *errmsg;
 #endif
+
+#ifdef PB_ENABLE_STATS
+    /* Counters for this stream, or NULL. See pb_stats_t. Custom streams
+     * must set this, as the encoder writes through it. */
+    pb_stats_t *stats;
+#endif
+
+#ifdef PB_ENABLE_SIZE_CACHE
+    pb_size_cache_t *size_cache; /* Known submessage sizes, or NULL. */
+#endif
 };
 
 /***************************
@@ -66,6 +102,23 @@ struct pb_ostream_s
  */
 bool pb_encode(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct);
 
+/* Same as pb_encode, but for streams from pb_ostream_from_buffer() the
+ * message is written from the end of the buffer towards the start and then
+ * moved to the start. This way the length of each submessage and packed
+ * array is known when its length prefix is written, so nothing has to be
+ * encoded twice to find out its size, except callback fields and
+ * extensions. The output is identical to pb_encode().
+ * The whole max_size of the stream must be valid buffer space.
+ * Other streams are encoded with pb_encode().
+ */
+bool pb_encode_reverse(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct);
+
+/* Same as pb_encode, but also writes the unknown fields stored by
+ * pb_decode_keep_unknown() after the known fields. These are top-level
+ * fields only; submessages are encoded from their structs as usual. */
+bool pb_encode_keep_unknown(pb_ostream_t *stream, const pb_field_t fields[],
+                            const void *src_struct, const pb_unknown_fields_t *unknown);
+
 /* Same as pb_encode, but prepends the length of the message as a varint.
  * Corresponds to writeDelimitedTo() in Google's protobuf API.
  */
@@ -88,6 +141,56 @@ bool pb_get_encoded_size(size_t *size, const pb_field_t fields[], const void *sr
  */
 pb_ostream_t pb_ostream_from_buffer(uint8_t *buf, size_t bufsize);
 
+#ifndef PB_BUFFER_ONLY
+/* One piece of gathered output. The layout matches struct iovec. */
+typedef struct pb_gather_segment_s pb_gather_segment_t;
+struct pb_gather_segment_s {
+    const void *base;
+    size_t len;
+};
+
+/* Output collected as a list of segments, see pb_ostream_from_gather(). */
+typedef struct pb_gather_s pb_gather_t;
+struct pb_gather_s {
+    pb_gather_segment_t *segments;
+    size_t max_segments;
+    size_t segment_count;
+    
+    uint8_t *scratch;           /* Storage for the copied bytes */
+    size_t scratch_size;
+    size_t scratch_used;
+    
+    size_t reference_threshold; /* Minimum size of referenced strings */
+};
+
+/* Set up a gather list with the given segment array and scratch buffer.
+ * Strings and bytes fields of at least reference_threshold bytes are
+ * referenced in place; use SIZE_MAX to copy everything. */
+void pb_gather_init(pb_gather_t *gather, pb_gather_segment_t *segments, size_t max_segments,
+                    uint8_t *scratch, size_t scratch_size, size_t reference_threshold);
+
+/* Create an output stream that collects the message as a list of segments,
+ * e.g. for writev(). Tags, lengths and other small values are copied into
+ * the scratch buffer, while large strings and bytes fields written with
+ * pb_encode_string() are referenced where they are, without copying. The
+ * referenced data, such as the message structure, must stay valid until the
+ * segments have been sent. Encoding fails with "gather full" if either the
+ * segments or the scratch buffer run out.
+ *
+ * Example usage:
+ *    struct iovec iov[16];
+ *    uint8_t scratch[128];
+ *    pb_gather_t gather;
+ *    pb_ostream_t stream;
+ *
+ *    pb_gather_init(&gather, (pb_gather_segment_t*)iov, 16, scratch, sizeof(scratch), 256);
+ *    stream = pb_ostream_from_gather(&gather);
+ *    if (pb_encode(&stream, MyMessage_fields, &msg))
+ *        writev(fd, iov, (int)gather.segment_count);
+ */
+pb_ostream_t pb_ostream_from_gather(pb_gather_t *gather);
+#endif
+
 /* Pseudo-stream for measuring the size of a message without actually storing
  * the encoded data.
  * 
@@ -98,9 +201,58 @@ pb_ostream_t pb_ostream_from_buffer(uint8_t *buf, size_t bufsize);
  *    printf("Message size is %d\n", stream.bytes_written);
  */
 #ifndef PB_NO_ERRMSG
-#define PB_OSTREAM_SIZING {0,0,0,0,0}
+#define PB_OSTREAM_ERRMSG_INIT ,0
 #else
-#define PB_OSTREAM_SIZING {0,0,0,0}
+#define PB_OSTREAM_ERRMSG_INIT
+#endif
+#ifdef PB_ENABLE_STATS
+#define PB_OSTREAM_STATS_INIT ,0
+#else
+#define PB_OSTREAM_STATS_INIT
+#endif
+#ifdef PB_ENABLE_SIZE_CACHE
+#define PB_OSTREAM_SIZE_CACHE_INIT ,0
+#else
+#define PB_OSTREAM_SIZE_CACHE_INIT
+#endif
+#define PB_OSTREAM_SIZING {0,0,0,0 PB_OSTREAM_ERRMSG_INIT PB_OSTREAM_STATS_INIT PB_OSTREAM_SIZE_CACHE_INIT}
+
+#ifdef PB_ENABLE_SIZE_CACHE
+/* Set up a size cache with room for capacity submessages. Attach it to
+ * streams in their size_cache field. Submessages whose size is found in
+ * the cache are written without a sizing pass, and for sizing streams
+ * (including the ones inside pb_get_encoded_size_cached()) without being
+ * encoded at all. Streams from pb_ostream_from_buffer() need no sizing
+ * passes, but with a known size the submessage is written right after its
+ * length prefix instead of being moved there afterwards.
+ *
+ * Example usage:
+ *    static pb_size_cache_entry_t entries[8];
+ *    static pb_size_cache_t cache;
+ *    pb_size_cache_init(&cache, entries, 8);
+ *    stream.size_cache = &cache;
+ *    pb_encode(&stream, MyMessage_fields, &msg);
+ *    msg.status.temperature = 25;
+ *    pb_size_cache_invalidate(&cache, &msg.status.temperature);
+ */
+void pb_size_cache_init(pb_size_cache_t *cache, pb_size_cache_entry_t *entries, pb_size_t capacity);
+
+/* Forget the sizes of all submessages that contain the given address, i.e.
+ * the changed submessage and the static submessages it is nested in. Call
+ * this after changing a field, passing the address of the field. Data
+ * behind pointer or callback fields is not inside the enclosing structure,
+ * so also invalidate the address of the pointer or callback field itself.
+ * If the size of a changed submessage is not invalidated, encoding fails
+ * with "submsg size changed" on streams that write the data, while sizing
+ * streams get a wrong size. */
+void pb_size_cache_invalidate(pb_size_cache_t *cache, const void *changed);
+
+/* Forget all cached sizes. */
+void pb_size_cache_clear(pb_size_cache_t *cache);
+
+/* Same as pb_get_encoded_size, but using and filling the size cache. */
+bool pb_get_encoded_size_cached(size_t *size, const pb_field_t fields[], const void *src_struct,
+                                pb_size_cache_t *cache);
 #endif
 
 /* Function to write into a pb_ostream_t stream. You can use this if you need
@@ -140,10 +292,22 @@ bool pb_encode_fixed32(pb_ostream_t *stream, const void *value);
  * You need to pass a pointer to a 8-byte wide C variable. */
 bool pb_encode_fixed64(pb_ostream_t *stream, const void *value);
 
+/* Callback for encoding a bytes or string field from a pb_bytes_view_t,
+ * which is given in the callback arg. The field is omitted if view->bytes
+ * is NULL. */
+#ifdef PB_OLD_CALLBACK_STYLE
+bool pb_encode_bytes_view(pb_ostream_t *stream, const pb_field_t *field, const void *arg);
+#else
+bool pb_encode_bytes_view(pb_ostream_t *stream, const pb_field_t *field, void * const *arg);
+#endif
+
 /* Encode a submessage field.
  * You need to pass the pb_field_t array and pointer to struct, just like
- * with pb_encode(). This internally encodes the submessage twice, first to
- * calculate message size and then to actually write it out.
+ * with pb_encode(). On streams from pb_ostream_from_buffer(), the submessage
+ * is encoded once after room for the longest possible length prefix, and
+ * then moved down to follow the actual length prefix. On other streams it
+ * is encoded twice, first to calculate message size and then to actually
+ * write it out.
  */
 bool pb_encode_submessage(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct);
 
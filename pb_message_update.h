@@ -59,6 +59,23 @@ private:
     return count;
   }
 
+  bool next_field(IterPair &iter) {
+    /* Advance the source iterator, and point the target iterator at the same
+     * field.  Both structures share the same layout, so the target pointers
+     * only differ by the base address and need not be recomputed field by
+     * field. */
+    if (!pb_field_iter_next(&iter.source)) {
+      return false;
+    }
+    iter.target.pos = iter.source.pos;
+    iter.target.required_field_index = iter.source.required_field_index;
+    iter.target.pData = (uint8_t *)iter.target.dest_struct +
+      ((uint8_t *)iter.source.pData - (uint8_t *)iter.source.dest_struct);
+    iter.target.pSize = (uint8_t *)iter.target.dest_struct +
+      ((uint8_t *)iter.source.pSize - (uint8_t *)iter.source.dest_struct);
+    return true;
+  }
+
   template <typename Fields>
   void __update__(Fields fields, void *source, void *target) {
     /* Iterate through each field in the Protocol Buffer message defined by
@@ -150,7 +167,7 @@ private:
       } else {
         LOG("Unrecognized PB_ATYPE=%d\n", PB_ATYPE(type));
       }
-    } while (pb_field_iter_next(&iter.source) && pb_field_iter_next(&iter.target));
+    } while (next_field(iter));
   }
 };
 
@@ -0,0 +1,244 @@
+#ifndef ___PB_PARALLEL__H___
+#define ___PB_PARALLEL__H___
+
+/* Multi-threaded decoding helpers for host builds.  Requires C++11 and
+ * `std::thread`, so this header is not included by `nanopb.h`.
+ *
+ * Decoding happens on worker threads, so any callback fields in the output
+ * structures must be safe to call concurrently.  The work done on worker
+ * threads is not counted in `pb_stats`. */
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <pb_cpp_api.h>
+
+
+namespace nanopb {
+
+/* Location of one message in a stream of length-delimited messages. */
+struct DelimitedFrame {
+  size_t offset;  // Start of the message, after the length prefix
+  size_t length;
+};
+
+
+/* Find the messages in a stream written with `pb_encode_delimited`, by
+ * reading only the length prefixes.  Returns false if a prefix is invalid
+ * or the last message is truncated. */
+inline bool scan_delimited_frames(UInt8Array input,
+                                  std::vector<DelimitedFrame> &frames) {
+  pb_istream_t stream = pb_istream_from_buffer(input.data, input.length);
+  frames.clear();
+  while (stream.bytes_left > 0) {
+    uint64_t length;
+    DelimitedFrame frame;
+    if (!pb_decode_varint(&stream, &length) || length > stream.bytes_left) {
+      return false;
+    }
+    frame.offset = input.length - stream.bytes_left;
+    frame.length = (size_t)length;
+    frames.push_back(frame);
+    if (!pb_read(&stream, NULL, frame.length)) { return false; }
+  }
+  return true;
+}
+
+
+/* Stream for decoding on a worker thread.  Unlike the streams of
+ * `pb_istream_from_buffer`, it does not count into the shared `pb_stats`,
+ * whose counters are not atomic. */
+inline pb_istream_t worker_istream(uint8_t *data, size_t length) {
+  pb_istream_t stream = pb_istream_from_buffer(data, length);
+#ifdef PB_ENABLE_STATS
+  stream.stats = NULL;
+#endif
+  return stream;
+}
+
+
+/* Call `task(i)` for every `i` in `[0, count)` on `thread_count` threads
+ * (default: one per core).  Indices are handed out in chunks of `grain`
+ * from a shared counter, so faster threads take over more of the work.
+ * Returns false if any call returned false; indices after the first
+ * failure may then be skipped. */
+template <typename Task>
+inline bool parallel_for(size_t count, Task task, unsigned thread_count=0,
+                         size_t grain=64) {
+  std::atomic<size_t> next(0);
+  std::atomic<bool> ok(true);
+
+  if (thread_count == 0) {
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (grain == 0) { grain = 1; }
+  thread_count = (unsigned)std::min<size_t>(thread_count,
+                                            (count + grain - 1) / grain);
+
+  auto worker = [&]() {
+    while (ok.load(std::memory_order_relaxed)) {
+      size_t start = next.fetch_add(grain);
+      if (start >= count) { break; }
+      size_t end = std::min(count, start + grain);
+      for (size_t i = start; i < end; i++) {
+        if (!task(i)) {
+          ok = false;
+          break;
+        }
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < thread_count; i++) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+  for (size_t i = 0; i < threads.size(); i++) { threads[i].join(); }
+  return ok;
+}
+
+
+/* Decode a stream of length-delimited messages into `output[0..count)`,
+ * preserving their order, using `thread_count` threads (default: one per
+ * core).  On entry `count` is the capacity of `output`.  On success it is
+ * set to the number of messages.  On failure it is set to the index of
+ * the first message that could not be scanned or decoded, and all earlier
+ * messages are valid.
+ *
+ * Example usage:
+ *
+ *     std::vector<Sample> samples(max_samples);
+ *     size_t count = samples.size();
+ *     nanopb::decode_delimited_batch(log_data, Sample_fields, &samples[0],
+ *                                    count);
+ *     samples.resize(count); */
+template <typename Msg>
+inline bool decode_delimited_batch(UInt8Array input, const pb_field_t *fields,
+                                   Msg *output, size_t &count,
+                                   unsigned thread_count=0) {
+  std::vector<DelimitedFrame> frames;
+  bool scanned = scan_delimited_frames(input, frames);
+  size_t frame_count = std::min(frames.size(), count);
+  std::vector<char> failed(frame_count, 0);
+
+  parallel_for(frame_count, [&](size_t i) {
+    pb_istream_t stream =
+      worker_istream(input.data + frames[i].offset, frames[i].length);
+    if (!pb_decode(&stream, fields, &output[i])) {
+      failed[i] = 1;
+      return false;
+    }
+    return true;
+  }, thread_count);
+
+  for (size_t i = 0; i < frame_count; i++) {
+    /* Chunks are taken in order and finished, so every message before a
+     * failed one has been decoded. */
+    if (failed[i]) {
+      count = i;
+      return false;
+    }
+  }
+  count = frame_count;
+  return scanned && frames.size() <= frame_count;
+}
+
+/* Decode a message like `decode_from_array(input, fields, obj, true)`,
+ * except that the entries of the repeated static submessage field `tag`
+ * are decoded in parallel on `thread_count` threads (default: one per
+ * core).  The entries are first located by scanning the tags of the
+ * message, and the other fields are then decoded with a field mask that
+ * leaves out `tag`.
+ *
+ * Messages with fewer than `serial_threshold` entries, and field types or
+ * messages (e.g., with extensions) that this does not apply to, are
+ * decoded serially. */
+template <typename Msg>
+inline bool decode_parallel_repeated(UInt8Array input,
+                                     const pb_field_t *fields, Msg &obj,
+                                     uint32_t tag, unsigned thread_count=0,
+                                     size_t serial_threshold=256) {
+  pb_field_iter_t iter;
+  std::vector<uint32_t> other_tags;
+  std::vector<DelimitedFrame> entries;
+  bool serial = false;
+
+  if (!pb_field_iter_begin(&iter, fields, &obj)) {
+    return decode_from_array(input, fields, obj, true);
+  }
+  do {
+    if (PB_LTYPE(iter.pos->type) == PB_LTYPE_EXTENSION) {
+      serial = true;
+    } else if (iter.pos->tag != tag) {
+      other_tags.push_back(iter.pos->tag);
+    }
+  } while (pb_field_iter_next(&iter));
+
+  if (serial || !pb_field_iter_find(&iter, tag) ||
+      PB_ATYPE(iter.pos->type) != PB_ATYPE_STATIC ||
+      PB_HTYPE(iter.pos->type) != PB_HTYPE_REPEATED ||
+      PB_LTYPE(iter.pos->type) != PB_LTYPE_SUBMESSAGE ||
+      iter.pos->ptr == NULL) {
+    return decode_from_array(input, fields, obj, true);
+  }
+
+  /* Find the entries of the field */
+  {
+    pb_istream_t stream = pb_istream_from_buffer(input.data, input.length);
+    while (stream.bytes_left > 0) {
+      pb_wire_type_t wire_type;
+      uint32_t field_tag;
+      bool eof;
+      if (!pb_decode_tag(&stream, &wire_type, &field_tag, &eof)) {
+        if (eof) { break; }
+        return false;
+      }
+      if (field_tag == tag && wire_type == PB_WT_STRING) {
+        uint32_t length;
+        DelimitedFrame entry;
+        pb_istream_t substream;
+        if (!pb_make_string_substream(&stream, &substream)) { return false; }
+        length = (uint32_t)substream.bytes_left;
+        entry.offset = input.length - stream.bytes_left - length;
+        entry.length = length;
+        entries.push_back(entry);
+        if (!pb_read(&substream, NULL, length)) { return false; }
+        pb_close_string_substream(&stream, &substream);
+      } else if (field_tag == tag) {
+        /* Leave unexpected encodings to the normal decoder */
+        return decode_from_array(input, fields, obj, true);
+      } else if (!pb_skip_field(&stream, wire_type)) {
+        return false;
+      }
+    }
+  }
+
+  if (entries.size() < serial_threshold) {
+    return decode_from_array(input, fields, obj, true);
+  }
+  if (entries.size() > iter.pos->array_size) { return false; }
+
+  /* Decode everything else, then the entries */
+  pb_field_mask_t mask;
+  mask.tags = other_tags.empty() ? NULL : &other_tags[0];
+  mask.tag_count = (pb_size_t)other_tags.size();
+  mask.submasks = NULL;
+  if (!decode_from_array(input, fields, obj, mask, true)) { return false; }
+
+  const pb_field_t *submsg_fields = (const pb_field_t *)iter.pos->ptr;
+  uint8_t *items = (uint8_t *)iter.pData;
+  size_t item_size = iter.pos->data_size;
+  *(pb_size_t *)iter.pSize = (pb_size_t)entries.size();
+
+  return parallel_for(entries.size(), [&](size_t i) {
+    pb_istream_t stream = worker_istream(input.data + entries[i].offset,
+                                         entries[i].length);
+    return pb_decode(&stream, submsg_fields, items + i * item_size);
+  }, thread_count);
+}
+
+} // namespace nanopb
+
+#endif  // #ifndef ___PB_PARALLEL__H___
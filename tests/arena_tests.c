@@ -0,0 +1,208 @@
+/* Tests for allocating pointer fields from an arena.
+ *
+ * Build and run from the repository root:
+ *    cc -DPB_ENABLE_MALLOC -DPB_ENABLE_ARENA -fsanitize=address,undefined \
+ *       -I. -Itests tests/arena_tests.c pb_common.c pb_encode.c pb_decode.c
+ *    ./a.out
+ */
+
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "unittests.h"
+
+typedef struct {
+    int32_t *value;
+    char *name;
+} Item;
+
+typedef struct {
+    char *title;
+    pb_size_t numbers_count;
+    int32_t *numbers;
+    pb_size_t items_count;
+    Item *items;
+    Item *main_item;
+} Catalog;
+
+static const pb_field_t Item_fields[3] = {
+    PB_FIELD(1, INT32, OPTIONAL, POINTER, FIRST, Item, value, value, 0),
+    PB_FIELD(2, STRING, OPTIONAL, POINTER, OTHER, Item, name, value, 0),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t Catalog_fields[5] = {
+    PB_FIELD(1, STRING, OPTIONAL, POINTER, FIRST, Catalog, title, title, 0),
+    PB_FIELD(2, INT32, REPEATED, POINTER, OTHER, Catalog, numbers, title, 0),
+    PB_FIELD(3, MESSAGE, REPEATED, POINTER, OTHER, Catalog, items, numbers, &Item_fields),
+    PB_FIELD(4, MESSAGE, OPTIONAL, POINTER, OTHER, Catalog, main_item, items, &Item_fields),
+    PB_LAST_FIELD
+};
+
+static int32_t numbers[20];
+static int32_t values[3] = {1, -2, 300};
+static char item_names[3][8] = {"first", "second", "third"};
+static Item items[3];
+static char title[] = "arena catalog";
+
+static size_t encode_catalog(uint8_t *buffer, size_t size)
+{
+    Catalog catalog;
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, size);
+    pb_size_t i;
+
+    for (i = 0; i < 20; i++)
+        numbers[i] = (int32_t)(i * i * 1000);
+
+    for (i = 0; i < 3; i++)
+    {
+        items[i].value = &values[i];
+        items[i].name = item_names[i];
+    }
+
+    catalog.title = title;
+    catalog.numbers_count = 20;
+    catalog.numbers = numbers;
+    catalog.items_count = 3;
+    catalog.items = items;
+    catalog.main_item = &items[1];
+
+    if (!pb_encode(&stream, Catalog_fields, &catalog))
+        return 0;
+
+    return stream.bytes_written;
+}
+
+/* Check the contents, decoded copies times over */
+static bool check_catalog(const Catalog *catalog, pb_size_t copies)
+{
+    pb_size_t i;
+
+    if (catalog->title == NULL || strcmp(catalog->title, title) != 0)
+        return false;
+
+    if (catalog->numbers_count != 20 * copies || catalog->items_count != 3 * copies)
+        return false;
+
+    for (i = 0; i < catalog->numbers_count; i++)
+    {
+        if (catalog->numbers[i] != numbers[i % 20])
+            return false;
+    }
+
+    for (i = 0; i < catalog->items_count; i++)
+    {
+        const Item *item = &catalog->items[i];
+        if (item->value == NULL || *item->value != values[i % 3] ||
+            item->name == NULL || strcmp(item->name, item_names[i % 3]) != 0)
+        {
+            return false;
+        }
+    }
+
+    return catalog->main_item != NULL && *catalog->main_item->value == -2 &&
+           strcmp(catalog->main_item->name, "second") == 0;
+}
+
+/* Checks that ptr is within the given memory area */
+static bool inside(const void *ptr, const void *area, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)ptr;
+    return p >= (const uint8_t*)area && p < (const uint8_t*)area + size;
+}
+
+typedef union {
+    double align;
+    uint8_t bytes[1024];
+} ArenaBuffer;
+
+int main(void)
+{
+    int status = 0;
+    uint8_t encoded[256];
+    size_t size = encode_catalog(encoded, sizeof(encoded));
+    static ArenaBuffer arena_buffer;
+    pb_arena_t arena;
+
+    COMMENT("Encoding the test message")
+    TEST(size > 0)
+
+    {
+        Catalog catalog;
+        pb_istream_t stream = pb_istream_from_buffer(encoded, size);
+        pb_arena_init(&arena, arena_buffer.bytes, sizeof(arena_buffer), 0);
+        stream.arena = &arena;
+
+        COMMENT("Decoding into the arena buffer")
+        TEST(pb_decode(&stream, Catalog_fields, &catalog))
+        TEST(check_catalog(&catalog, 1))
+        TEST(inside(catalog.title, &arena_buffer, sizeof(arena_buffer)))
+        TEST(inside(catalog.numbers, &arena_buffer, sizeof(arena_buffer)))
+        TEST(inside(catalog.items[2].name, &arena_buffer, sizeof(arena_buffer)))
+        TEST(arena.blocks == NULL)
+
+        COMMENT("Merging into a message decoded from the same arena")
+        stream = pb_istream_from_buffer(encoded, size);
+        stream.arena = &arena;
+        TEST(pb_decode_noinit(&stream, Catalog_fields, &catalog))
+        TEST(check_catalog(&catalog, 2))
+
+        pb_arena_reset(&arena);
+    }
+
+    {
+        Catalog catalog;
+        pb_istream_t stream = pb_istream_from_buffer(encoded, size);
+        pb_arena_init(&arena, arena_buffer.bytes, 64, 128);
+        stream.arena = &arena;
+
+        COMMENT("Decoding into extra blocks")
+        TEST(pb_decode(&stream, Catalog_fields, &catalog))
+        TEST(check_catalog(&catalog, 1))
+        TEST(arena.blocks != NULL)
+        TEST(!inside(catalog.items, &arena_buffer, sizeof(arena_buffer)))
+
+        stream = pb_istream_from_buffer(encoded, size);
+        stream.arena = &arena;
+        TEST(pb_decode_noinit(&stream, Catalog_fields, &catalog))
+        TEST(check_catalog(&catalog, 2))
+
+        pb_arena_reset(&arena);
+        TEST(arena.blocks == NULL)
+    }
+
+    {
+        Catalog catalog;
+        pb_istream_t stream = pb_istream_from_buffer(encoded, size);
+        pb_arena_init(&arena, arena_buffer.bytes, 64, 0);
+        stream.arena = &arena;
+
+        COMMENT("Running out of arena space")
+        TEST(!pb_decode(&stream, Catalog_fields, &catalog))
+        pb_arena_reset(&arena);
+    }
+
+    {
+        Catalog catalog;
+        pb_istream_t stream = pb_istream_from_buffer(encoded, size);
+
+        COMMENT("Merging into pointers from pb_realloc()")
+        TEST(pb_decode(&stream, Catalog_fields, &catalog))
+
+        pb_arena_init(&arena, arena_buffer.bytes, sizeof(arena_buffer), 0);
+        stream = pb_istream_from_buffer(encoded, size);
+        stream.arena = &arena;
+        TEST(!pb_decode_noinit(&stream, Catalog_fields, &catalog))
+        TEST(strcmp(PB_GET_ERROR(&stream), "pointer not from arena") == 0)
+
+        /* The message still owns its allocations */
+        TEST(strcmp(catalog.title, title) == 0)
+        pb_release(Catalog_fields, &catalog);
+        pb_arena_reset(&arena);
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
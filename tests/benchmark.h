@@ -0,0 +1,51 @@
+/* Timing helpers for the *_benchmark.c programs. Include this before any
+ * other header, as it needs the POSIX monotonic clock. */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pb.h>
+
+/* Minimum time to spend on a single measurement */
+#ifndef BENCHMARK_SECONDS
+#define BENCHMARK_SECONDS 0.3
+#endif
+
+typedef bool (*benchmark_fn_t)(void *context);
+
+static double benchmark_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* Call run(context) repeatedly for at least BENCHMARK_SECONDS, and return
+ * the average time of a single call in seconds. Exits if a call fails. */
+static double benchmark_run(const char *name, benchmark_fn_t run, void *context)
+{
+    unsigned long calls = 0;
+    double start = benchmark_now();
+    double elapsed;
+
+    do
+    {
+        unsigned i;
+        for (i = 0; i < 8; i++)
+        {
+            if (!run(context))
+            {
+                fprintf(stderr, "%s: failed\n", name);
+                exit(1);
+            }
+        }
+        calls += 8;
+        elapsed = benchmark_now() - start;
+    } while (elapsed < BENCHMARK_SECONDS);
+
+    return elapsed / (double)calls;
+}
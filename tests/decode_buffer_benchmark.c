@@ -0,0 +1,186 @@
+/* Per-field decoding time from a memory buffer, compared with a callback
+ * stream that reads the same memory. pb_istream_from_buffer() streams use
+ * the direct fast path, the callback stream goes through pb_read() for
+ * every byte.
+ *
+ * Build and run from the repository root:
+ *    cc -O2 -I. -Itests tests/decode_buffer_benchmark.c \
+ *       pb_common.c pb_encode.c pb_decode.c
+ *    ./a.out
+ */
+
+#include "benchmark.h"
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+
+#define FIELD_COUNT 64
+
+typedef struct {
+    pb_size_t values_count;
+    uint32_t values[FIELD_COUNT];
+} Uint32Array;
+
+typedef struct {
+    pb_size_t values_count;
+    uint64_t values[FIELD_COUNT];
+} Uint64Array;
+
+typedef struct {
+    pb_size_t values_count;
+    char values[FIELD_COUNT][16];
+} StringArray;
+
+/* Has no field 1, so that all input fields are skipped */
+typedef struct {
+    bool has_other;
+    int32_t other;
+} OtherField;
+
+static const pb_field_t Varint_fields[2] = {
+    PB_FIELD(1, UINT32, REPEATED, STATIC, FIRST, Uint32Array, values, values, 0),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t Fixed32_fields[2] = {
+    PB_FIELD(1, FIXED32, REPEATED, STATIC, FIRST, Uint32Array, values, values, 0),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t Fixed64_fields[2] = {
+    PB_FIELD(1, FIXED64, REPEATED, STATIC, FIRST, Uint64Array, values, values, 0),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t String_fields[2] = {
+    PB_FIELD(1, STRING, REPEATED, STATIC, FIRST, StringArray, values, values, 0),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t Other_fields[2] = {
+    PB_FIELD(2, INT32, OPTIONAL, STATIC, FIRST, OtherField, other, other, 0),
+    PB_LAST_FIELD
+};
+
+typedef struct {
+    const char *name;
+    pb_wire_type_t wire_type;
+    const pb_field_t *fields;
+    uint8_t input[2048];
+    size_t size;
+} DecodeCase;
+
+static union {
+    Uint32Array u32;
+    Uint64Array u64;
+    StringArray str;
+    OtherField other;
+} dest;
+
+/* Write FIELD_COUNT unpacked fields with tag 1, so that every value is a
+ * separate field with its own tag. */
+static bool write_input(DecodeCase *c)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(c->input, sizeof(c->input));
+    uint32_t i;
+
+    for (i = 0; i < FIELD_COUNT; i++)
+    {
+        uint32_t value32 = (i * 2654435761u) >> (i % 32);
+        uint64_t value64 = ((uint64_t)value32 << 32) | i;
+        char text[16];
+
+        if (!pb_encode_tag(&stream, c->wire_type, 1))
+            return false;
+
+        switch (c->wire_type)
+        {
+            case PB_WT_VARINT:
+                if (!pb_encode_varint(&stream, value32))
+                    return false;
+                break;
+
+            case PB_WT_32BIT:
+                if (!pb_encode_fixed32(&stream, &value32))
+                    return false;
+                break;
+
+            case PB_WT_64BIT:
+                if (!pb_encode_fixed64(&stream, &value64))
+                    return false;
+                break;
+
+            default:
+                sprintf(text, "field %u text", (unsigned)(i % 100));
+                if (!pb_encode_string(&stream, (const uint8_t*)text, strlen(text)))
+                    return false;
+                break;
+        }
+    }
+
+    c->size = stream.bytes_written;
+    return true;
+}
+
+/* Same as the buffer stream, but not recognized by the decoder */
+static bool memory_read(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    uint8_t *source = (uint8_t*)stream->state;
+    stream->state = source + count;
+
+    if (buf != NULL)
+        memcpy(buf, source, count);
+
+    return true;
+}
+
+static bool decode_buffer(void *context)
+{
+    DecodeCase *c = (DecodeCase*)context;
+    pb_istream_t stream = pb_istream_from_buffer(c->input, c->size);
+    return pb_decode(&stream, c->fields, &dest);
+}
+
+static bool decode_callback(void *context)
+{
+    DecodeCase *c = (DecodeCase*)context;
+    pb_istream_t stream;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.callback = &memory_read;
+    stream.state = c->input;
+    stream.bytes_left = c->size;
+    return pb_decode(&stream, c->fields, &dest);
+}
+
+int main(void)
+{
+    static DecodeCase cases[] = {
+        {"varint", PB_WT_VARINT, Varint_fields, {0}, 0},
+        {"fixed32", PB_WT_32BIT, Fixed32_fields, {0}, 0},
+        {"fixed64", PB_WT_64BIT, Fixed64_fields, {0}, 0},
+        {"string", PB_WT_STRING, String_fields, {0}, 0},
+        {"skip varint", PB_WT_VARINT, Other_fields, {0}, 0},
+        {"skip string", PB_WT_STRING, Other_fields, {0}, 0},
+    };
+    size_t i;
+
+    printf("%-12s %14s %14s %8s\n", "field", "buffer ns", "callback ns", "speedup");
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        DecodeCase *c = &cases[i];
+        double buffer_time, callback_time;
+
+        if (!write_input(c))
+            return 1;
+
+        buffer_time = benchmark_run(c->name, decode_buffer, c) / FIELD_COUNT;
+        callback_time = benchmark_run(c->name, decode_callback, c) / FIELD_COUNT;
+
+        printf("%-12s %14.1f %14.1f %7.2fx\n", c->name,
+               buffer_time * 1e9, callback_time * 1e9, callback_time / buffer_time);
+    }
+
+    return 0;
+}
@@ -0,0 +1,220 @@
+/* Tests for the field lookup tables enabled with PB_ENABLE_FIELD_INDEX.
+ *
+ * Build and run from the repository root, preferably with and without
+ * -DPB_FIELD_16BIT:
+ *    cc -DPB_ENABLE_FIELD_INDEX -fsanitize=address,undefined -I. -Itests \
+ *       tests/field_index_tests.c pb_common.c pb_encode.c pb_decode.c
+ *    ./a.out
+ */
+
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "unittests.h"
+
+/* Larger than 127 bytes, so that the has_ and count fields near the end
+ * are outside the range of an 8-bit pb_ssize_t. */
+typedef struct {
+    int32_t id;
+    pb_size_t values_count;
+    int32_t values[40];
+    bool has_flag;
+    bool flag;
+    bool has_name;
+    char name[32];
+    pb_size_t scores_count;
+    uint32_t scores[8];
+    bool has_count;
+    int64_t count;
+} BigMessage;
+
+#define BIG_MESSAGE_FIELDS \
+    PB_FIELD(1, INT32, REQUIRED, STATIC, FIRST, BigMessage, id, id, 0), \
+    PB_FIELD(2, INT32, REPEATED, STATIC, OTHER, BigMessage, values, id, 0), \
+    PB_FIELD(3, BOOL, OPTIONAL, STATIC, OTHER, BigMessage, flag, values, 0), \
+    PB_FIELD(4, STRING, OPTIONAL, STATIC, OTHER, BigMessage, name, flag, 0), \
+    PB_FIELD(5, UINT32, REPEATED, STATIC, OTHER, BigMessage, scores, name, 0), \
+    PB_FIELD(6, INT64, OPTIONAL, STATIC, OTHER, BigMessage, count, scores, 0), \
+    PB_LAST_FIELD
+
+/* Two copies of the same descriptor, only the first one gets an index */
+static const pb_field_t BigMessage_fields[7] = { BIG_MESSAGE_FIELDS };
+static const pb_field_t BigMessage_plain_fields[7] = { BIG_MESSAGE_FIELDS };
+
+/* Guard bytes around the decoded structure catch writes outside of it */
+typedef struct {
+    uint8_t before[16];
+    BigMessage msg;
+    uint8_t after[16];
+} GuardedMessage;
+
+static bool guards_intact(const GuardedMessage *guarded)
+{
+    size_t i;
+    for (i = 0; i < sizeof(guarded->before); i++)
+    {
+        if (guarded->before[i] != 0xAA || guarded->after[i] != 0xAA)
+            return false;
+    }
+    return true;
+}
+
+static void fill_message(BigMessage *msg)
+{
+    pb_size_t i;
+    memset(msg, 0, sizeof(*msg));
+    msg->id = 42;
+    msg->values_count = 40;
+    for (i = 0; i < 40; i++)
+        msg->values[i] = (int32_t)(i * 1000 - 7);
+    msg->has_flag = true;
+    msg->flag = true;
+    msg->has_name = true;
+    strcpy(msg->name, "field index");
+    msg->scores_count = 3;
+    msg->scores[0] = 1;
+    msg->scores[1] = 300;
+    msg->scores[2] = 70000;
+    msg->has_count = true;
+    msg->count = -(int64_t)1234567890 * 1000;
+}
+
+static bool same_message(const BigMessage *a, const BigMessage *b)
+{
+    return a->id == b->id &&
+           a->values_count == b->values_count &&
+           memcmp(a->values, b->values, a->values_count * sizeof(a->values[0])) == 0 &&
+           a->has_flag == b->has_flag && a->flag == b->flag &&
+           a->has_name == b->has_name && strcmp(a->name, b->name) == 0 &&
+           a->scores_count == b->scores_count &&
+           memcmp(a->scores, b->scores, a->scores_count * sizeof(a->scores[0])) == 0 &&
+           a->has_count == b->has_count && a->count == b->count;
+}
+
+static bool same_position(const pb_field_iter_t *a, const pb_field_iter_t *b)
+{
+    return (a->pos - a->start) == (b->pos - b->start) &&
+           a->pData == b->pData &&
+           a->pSize == b->pSize &&
+           a->required_field_index == b->required_field_index;
+}
+
+/* Walk the indexed and the plain descriptor over the same structure and
+ * check that every way of moving the iterator gives the same pointers. */
+static bool same_iteration(BigMessage *msg)
+{
+    pb_field_iter_t indexed, plain;
+    pb_size_t position = 0;
+    bool more;
+
+    if (!pb_field_iter_begin(&indexed, BigMessage_fields, msg) ||
+        !pb_field_iter_begin(&plain, BigMessage_plain_fields, msg) ||
+        indexed.index == NULL || plain.index != NULL)
+    {
+        return false;
+    }
+
+    do
+    {
+        pb_field_iter_t found, seeked;
+
+        if (!same_position(&indexed, &plain))
+            return false;
+
+        if (!pb_field_iter_begin(&found, BigMessage_fields, msg) ||
+            !pb_field_iter_begin(&seeked, BigMessage_fields, msg) ||
+            !pb_field_iter_find(&found, indexed.pos->tag) ||
+            !pb_field_iter_seek(&seeked, position) ||
+            !same_position(&found, &plain) ||
+            !same_position(&seeked, &plain))
+        {
+            return false;
+        }
+
+        position++;
+        more = pb_field_iter_next(&indexed);
+        if (more != pb_field_iter_next(&plain))
+            return false;
+    } while (more);
+
+    /* Both wrapped back to the first field */
+    if (!same_position(&indexed, &plain))
+        return false;
+
+    /* And backwards from the end */
+    if (pb_field_iter_prev(&indexed) != pb_field_iter_prev(&plain))
+        return false;
+    do
+    {
+        if (!same_position(&indexed, &plain))
+            return false;
+        more = pb_field_iter_prev(&indexed);
+        if (more != pb_field_iter_prev(&plain))
+            return false;
+    } while (more);
+
+    return position == 6;
+}
+
+int main(void)
+{
+    int status = 0;
+    static pb_field_index_entry_t entries[6];
+    static pb_field_index_t index;
+    BigMessage source;
+    uint8_t buffer[512];
+    size_t size;
+
+    COMMENT("Registering a lookup table")
+    TEST(sizeof(BigMessage) > 127)
+    TEST(pb_field_index_init(&index, BigMessage_fields, entries, 6))
+    TEST(pb_field_index_lookup(BigMessage_fields) == &index)
+    TEST(pb_field_index_lookup(BigMessage_plain_fields) == NULL)
+    TEST(entries[3].data_offset == offsetof(BigMessage, name))
+    TEST(entries[3].size_offset == offsetof(BigMessage, has_name))
+    TEST(entries[5].size_offset == offsetof(BigMessage, has_count))
+
+    fill_message(&source);
+
+    COMMENT("Iterating with and without the lookup table")
+    TEST(same_iteration(&source))
+
+    {
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        COMMENT("Encoding with the lookup table")
+        TEST(pb_encode(&stream, BigMessage_fields, &source))
+        size = stream.bytes_written;
+    }
+
+    {
+        uint8_t plain[512];
+        pb_ostream_t stream = pb_ostream_from_buffer(plain, sizeof(plain));
+        TEST(pb_encode(&stream, BigMessage_plain_fields, &source))
+        TEST(stream.bytes_written == size && memcmp(plain, buffer, size) == 0)
+    }
+
+    {
+        GuardedMessage dest;
+        pb_istream_t stream = pb_istream_from_buffer(buffer, size);
+        memset(&dest, 0xAA, sizeof(dest));
+        COMMENT("Decoding with the lookup table")
+        TEST(pb_decode(&stream, BigMessage_fields, &dest.msg))
+        TEST(guards_intact(&dest))
+        TEST(same_message(&source, &dest.msg))
+    }
+
+    {
+        GuardedMessage dest;
+        pb_istream_t stream = pb_istream_from_buffer(buffer, 0);
+        memset(&dest, 0xAA, sizeof(dest));
+        COMMENT("Setting defaults for a missing optional field")
+        TEST(!pb_decode(&stream, BigMessage_fields, &dest.msg)) /* id is required */
+        TEST(guards_intact(&dest))
+        TEST(!dest.msg.has_name && !dest.msg.has_count && dest.msg.scores_count == 0)
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
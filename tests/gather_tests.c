@@ -0,0 +1,231 @@
+/* Tests for encoding into a list of segments with pb_ostream_from_gather().
+ *
+ * Build and run from the repository root:
+ *    cc -fsanitize=address,undefined -I. -Itests tests/gather_tests.c \
+ *       pb_common.c pb_encode.c
+ *    ./a.out
+ */
+
+#include <string.h>
+#include <pb_encode.h>
+#include "unittests.h"
+
+typedef struct {
+    pb_callback_t data;
+} Attachment;
+
+typedef struct {
+    uint32_t id;
+    bool has_title;
+    char title[16];
+    pb_callback_t payload;
+    bool has_attachment;
+    Attachment attachment;
+} Document;
+
+static const pb_field_t Attachment_fields[2] = {
+    PB_FIELD(1, BYTES, OPTIONAL, CALLBACK, FIRST, Attachment, data, data, 0),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t Document_fields[5] = {
+    PB_FIELD(1, UINT32, REQUIRED, STATIC, FIRST, Document, id, id, 0),
+    PB_FIELD(2, STRING, OPTIONAL, STATIC, OTHER, Document, title, id, 0),
+    PB_FIELD(3, BYTES, OPTIONAL, CALLBACK, OTHER, Document, payload, title, 0),
+    PB_FIELD(4, MESSAGE, OPTIONAL, STATIC, OTHER, Document, attachment, payload, &Attachment_fields),
+    PB_LAST_FIELD
+};
+
+static uint8_t payload_data[1000];
+static uint8_t attachment_data[300];
+static pb_bytes_view_t payload_view;
+static pb_bytes_view_t attachment_view;
+
+static void fill_document(Document *doc)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(payload_data); i++)
+        payload_data[i] = (uint8_t)(i * 7);
+    for (i = 0; i < sizeof(attachment_data); i++)
+        attachment_data[i] = (uint8_t)(255 - i);
+
+    memset(&payload_view, 0, sizeof(payload_view));
+    payload_view.bytes = payload_data;
+    payload_view.size = sizeof(payload_data);
+    memset(&attachment_view, 0, sizeof(attachment_view));
+    attachment_view.bytes = attachment_data;
+    attachment_view.size = sizeof(attachment_data);
+
+    memset(doc, 0, sizeof(*doc));
+    doc->id = 123;
+    doc->has_title = true;
+    strcpy(doc->title, "gathered");
+    doc->payload.funcs.encode = &pb_encode_bytes_view;
+    doc->payload.arg = &payload_view;
+    doc->has_attachment = true;
+    doc->attachment.data.funcs.encode = &pb_encode_bytes_view;
+    doc->attachment.data.arg = &attachment_view;
+}
+
+/* Concatenate the segments, and check that none of them is empty */
+static size_t join_segments(const pb_gather_t *gather, uint8_t *output)
+{
+    size_t total = 0;
+    size_t i;
+
+    for (i = 0; i < gather->segment_count; i++)
+    {
+        if (gather->segments[i].len == 0)
+            return 0;
+
+        memcpy(output + total, gather->segments[i].base, gather->segments[i].len);
+        total += gather->segments[i].len;
+    }
+
+    return total;
+}
+
+static bool is_referenced(const pb_gather_t *gather, const void *data, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < gather->segment_count; i++)
+    {
+        if (gather->segments[i].base == data && gather->segments[i].len == size)
+            return true;
+    }
+
+    return false;
+}
+
+int main(void)
+{
+    int status = 0;
+    Document doc;
+    uint8_t expected[2048];
+    uint8_t joined[2048];
+    size_t expected_size;
+
+    fill_document(&doc);
+
+    {
+        pb_ostream_t stream = pb_ostream_from_buffer(expected, sizeof(expected));
+        COMMENT("Reference encoding into a buffer")
+        TEST(pb_encode(&stream, Document_fields, &doc))
+        expected_size = stream.bytes_written;
+    }
+
+    {
+        pb_gather_segment_t segments[8];
+        uint8_t scratch[64];
+        pb_gather_t gather;
+        pb_ostream_t stream;
+
+        pb_gather_init(&gather, segments, 8, scratch, sizeof(scratch), 256);
+        stream = pb_ostream_from_gather(&gather);
+
+        COMMENT("Large bytes fields are referenced, also in submessages")
+        TEST(pb_encode(&stream, Document_fields, &doc))
+        TEST(stream.bytes_written == expected_size)
+        TEST(join_segments(&gather, joined) == expected_size &&
+             memcmp(joined, expected, expected_size) == 0)
+        TEST(is_referenced(&gather, payload_data, sizeof(payload_data)))
+        TEST(is_referenced(&gather, attachment_data, sizeof(attachment_data)))
+
+        /* Copied bytes next to each other share a segment */
+        TEST(gather.segment_count == 4)
+        TEST(gather.scratch_used == expected_size - sizeof(payload_data) - sizeof(attachment_data))
+    }
+
+    {
+        pb_gather_segment_t segments[8];
+        uint8_t scratch[512];
+        pb_gather_t gather;
+        pb_ostream_t stream;
+
+        pb_gather_init(&gather, segments, 8, scratch, sizeof(scratch), 500);
+        stream = pb_ostream_from_gather(&gather);
+
+        COMMENT("Fields below the threshold are copied")
+        TEST(pb_encode(&stream, Document_fields, &doc))
+        TEST(join_segments(&gather, joined) == expected_size &&
+             memcmp(joined, expected, expected_size) == 0)
+        TEST(is_referenced(&gather, payload_data, sizeof(payload_data)))
+        TEST(!is_referenced(&gather, attachment_data, sizeof(attachment_data)))
+        TEST(gather.segment_count == 3)
+    }
+
+    {
+        pb_gather_segment_t segments[8];
+        uint8_t scratch[64];
+        pb_gather_t gather;
+        pb_ostream_t stream;
+
+        pb_gather_init(&gather, segments, 8, scratch, sizeof(scratch), 500);
+        stream = pb_ostream_from_gather(&gather);
+
+        COMMENT("Running out of scratch space")
+        TEST(!pb_encode(&stream, Document_fields, &doc))
+        TEST(strcmp(PB_GET_ERROR(&stream), "gather full") == 0)
+    }
+
+    {
+        pb_gather_segment_t segments[2];
+        uint8_t scratch[2048];
+        pb_gather_t gather;
+        pb_ostream_t stream;
+
+        pb_gather_init(&gather, segments, 2, scratch, sizeof(scratch), SIZE_MAX);
+        stream = pb_ostream_from_gather(&gather);
+
+        COMMENT("With SIZE_MAX everything is copied into one segment")
+        TEST(pb_encode(&stream, Document_fields, &doc))
+        TEST(gather.segment_count == 1 && gather.scratch_used == expected_size)
+        TEST(join_segments(&gather, joined) == expected_size &&
+             memcmp(joined, expected, expected_size) == 0)
+    }
+
+    {
+        pb_gather_segment_t segments[3];
+        uint8_t scratch[64];
+        pb_gather_t gather;
+        pb_ostream_t stream;
+
+        pb_gather_init(&gather, segments, 3, scratch, sizeof(scratch), 256);
+        stream = pb_ostream_from_gather(&gather);
+
+        COMMENT("Running out of segments")
+        TEST(!pb_encode(&stream, Document_fields, &doc))
+        TEST(strcmp(PB_GET_ERROR(&stream), "gather full") == 0)
+    }
+
+    {
+        Document empty;
+        pb_gather_segment_t segments[8];
+        uint8_t scratch[64];
+        pb_gather_t gather;
+        pb_ostream_t stream;
+        static const uint8_t nothing[1] = {0};
+        pb_bytes_view_t empty_view;
+
+        memset(&empty_view, 0, sizeof(empty_view));
+        empty_view.bytes = nothing;
+        memset(&empty, 0, sizeof(empty));
+        empty.payload.funcs.encode = &pb_encode_bytes_view;
+        empty.payload.arg = &empty_view;
+
+        pb_gather_init(&gather, segments, 8, scratch, sizeof(scratch), 0);
+        stream = pb_ostream_from_gather(&gather);
+
+        COMMENT("Empty bytes fields add no segments")
+        TEST(pb_encode(&stream, Document_fields, &empty))
+        TEST(gather.segment_count == 1)
+        TEST(join_segments(&gather, joined) == stream.bytes_written)
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -0,0 +1,220 @@
+/* Decoding delimited messages from a file with read(), through a stream
+ * callback that reads exactly the requested bytes, and through
+ * pb_istream_from_input_buffer() with different buffer sizes. Also decodes
+ * the same messages into a type without matching fields, so that all the
+ * data is skipped.
+ *
+ * Build and run from the repository root:
+ *    cc -O2 -I. -Itests tests/input_buffer_benchmark.c \
+ *       pb_common.c pb_encode.c pb_decode.c
+ *    ./a.out
+ */
+
+#include "benchmark.h"
+#include <string.h>
+#include <unistd.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+
+#define MESSAGE_COUNT 2000
+
+typedef struct {
+    uint32_t id;
+    int64_t timestamp;
+    char name[32];
+    pb_size_t readings_count;
+    int32_t readings[32];
+    bool has_status;
+    uint32_t status;
+} Record;
+
+/* Has no fields in common with Record, so everything is skipped */
+typedef struct {
+    bool has_other;
+    int32_t other;
+} OtherFields;
+
+static const pb_field_t Record_fields[6] = {
+    PB_FIELD(1, UINT32, REQUIRED, STATIC, FIRST, Record, id, id, 0),
+    PB_FIELD(2, INT64, REQUIRED, STATIC, OTHER, Record, timestamp, id, 0),
+    PB_FIELD(3, STRING, REQUIRED, STATIC, OTHER, Record, name, timestamp, 0),
+    PB_FIELD(4, SINT32, REPEATED, STATIC, OTHER, Record, readings, name, 0),
+    PB_FIELD(5, FIXED32, OPTIONAL, STATIC, OTHER, Record, status, readings, 0),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t Other_fields[2] = {
+    PB_FIELD(15, INT32, OPTIONAL, STATIC, FIRST, OtherFields, other, other, 0),
+    PB_LAST_FIELD
+};
+
+typedef struct {
+    int fd;
+    const pb_field_t *fields;
+    size_t buffer_size;
+    unsigned long reads;
+} FileCase;
+
+static uint8_t input_storage[65536];
+
+static bool write_records(FILE *file)
+{
+    uint8_t buffer[256];
+    Record record;
+    size_t i, j;
+
+    memset(&record, 0, sizeof(record));
+
+    for (i = 0; i < MESSAGE_COUNT; i++)
+    {
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+        record.id = (uint32_t)i;
+        record.timestamp = ((int64_t)1500000000 + (int64_t)i) * 1000;
+        sprintf(record.name, "sensor %u", (unsigned)(i % 50));
+        record.readings_count = (pb_size_t)(i % 32);
+        for (j = 0; j < record.readings_count; j++)
+            record.readings[j] = (int32_t)((i * 31 + j * 7) % 2000) - 1000;
+        record.has_status = (i % 3 == 0);
+        record.status = (uint32_t)i * 2654435761u;
+
+        if (!pb_encode_delimited(&stream, Record_fields, &record) ||
+            fwrite(buffer, 1, stream.bytes_written, file) != stream.bytes_written)
+        {
+            return false;
+        }
+    }
+
+    return fflush(file) == 0;
+}
+
+/* Reads exactly the requested bytes, as stream callbacks must */
+static bool fd_callback(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    FileCase *c = (FileCase*)stream->state;
+    uint8_t skipped[64];
+
+    while (count > 0)
+    {
+        size_t part = count;
+        ssize_t result;
+
+        if (buf == NULL && part > sizeof(skipped))
+            part = sizeof(skipped);
+
+        result = read(c->fd, buf ? buf : skipped, part);
+        c->reads++;
+        if (result <= 0)
+            return false;
+
+        count -= (size_t)result;
+        if (buf != NULL)
+            buf += result;
+    }
+
+    return true;
+}
+
+static size_t fd_read(void *state, uint8_t *buf, size_t count)
+{
+    FileCase *c = (FileCase*)state;
+    ssize_t result = read(c->fd, buf, count);
+    c->reads++;
+    return (result > 0) ? (size_t)result : 0;
+}
+
+static bool decode_callback(void *context)
+{
+    FileCase *c = (FileCase*)context;
+    union {
+        Record record;
+        OtherFields other;
+    } dest;
+    pb_istream_t stream;
+    size_t i;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.callback = &fd_callback;
+    stream.state = c;
+    stream.bytes_left = SIZE_MAX;
+
+    lseek(c->fd, 0, SEEK_SET);
+    c->reads = 0;
+
+    for (i = 0; i < MESSAGE_COUNT; i++)
+    {
+        if (!pb_decode_delimited(&stream, c->fields, &dest))
+            return false;
+    }
+
+    return true;
+}
+
+static bool decode_input_buffer(void *context)
+{
+    FileCase *c = (FileCase*)context;
+    union {
+        Record record;
+        OtherFields other;
+    } dest;
+    pb_input_buffer_t input;
+    pb_istream_t stream;
+    size_t i;
+
+    lseek(c->fd, 0, SEEK_SET);
+    c->reads = 0;
+    pb_input_buffer_init(&input, &fd_read, c, input_storage, c->buffer_size);
+    stream = pb_istream_from_input_buffer(&input, SIZE_MAX);
+
+    for (i = 0; i < MESSAGE_COUNT; i++)
+    {
+        if (!pb_decode_delimited(&stream, c->fields, &dest))
+            return false;
+    }
+
+    return true;
+}
+
+int main(void)
+{
+    static const size_t buffer_sizes[] = {64, 512, 4096, 65536};
+    FILE *file = tmpfile();
+    FileCase c;
+    size_t i, j;
+
+    if (file == NULL || !write_records(file))
+    {
+        fprintf(stderr, "could not write the input file\n");
+        return 1;
+    }
+
+    c.fd = fileno(file);
+    printf("%u messages, %ld bytes\n\n", (unsigned)MESSAGE_COUNT, (long)ftell(file));
+    printf("%-7s %-14s %10s %10s %9s\n", "decode", "stream", "ms", "reads", "speedup");
+
+    for (i = 0; i < 2; i++)
+    {
+        const char *name = (i == 0) ? "fields" : "skip";
+        double callback_time;
+
+        c.fields = (i == 0) ? Record_fields : Other_fields;
+        callback_time = benchmark_run(name, decode_callback, &c);
+        printf("%-7s %-14s %10.2f %10lu %8.1fx\n", name, "callback",
+               callback_time * 1e3, c.reads, 1.0);
+
+        for (j = 0; j < sizeof(buffer_sizes) / sizeof(buffer_sizes[0]); j++)
+        {
+            char label[32];
+            double buffered_time;
+
+            c.buffer_size = buffer_sizes[j];
+            buffered_time = benchmark_run(name, decode_input_buffer, &c);
+            sprintf(label, "buffer %u", (unsigned)buffer_sizes[j]);
+            printf("%-7s %-14s %10.2f %10lu %8.1fx\n", name, label,
+                   buffered_time * 1e3, c.reads, callback_time / buffered_time);
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
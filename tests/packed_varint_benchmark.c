@@ -0,0 +1,139 @@
+/* Encoding and decoding throughput of packed repeated int32, uint32 and
+ * sint32 fields with 1, 16, 256 and 4096 elements.
+ *
+ * Build and run from the repository root:
+ *    cc -O2 -DPB_FIELD_16BIT -I. -Itests tests/packed_varint_benchmark.c \
+ *       pb_common.c pb_encode.c pb_decode.c
+ *    ./a.out
+ */
+
+#include "benchmark.h"
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+
+#define MAX_ELEMENTS 4096
+
+typedef struct {
+    pb_size_t values_count;
+    int32_t values[MAX_ELEMENTS];
+} Int32Array;
+
+typedef struct {
+    pb_size_t values_count;
+    uint32_t values[MAX_ELEMENTS];
+} Uint32Array;
+
+static const pb_field_t Int32_fields[2] = {
+    PB_FIELD(1, INT32, REPEATED, STATIC, FIRST, Int32Array, values, values, 0),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t Uint32_fields[2] = {
+    PB_FIELD(1, UINT32, REPEATED, STATIC, FIRST, Uint32Array, values, values, 0),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t Sint32_fields[2] = {
+    PB_FIELD(1, SINT32, REPEATED, STATIC, FIRST, Int32Array, values, values, 0),
+    PB_LAST_FIELD
+};
+
+typedef struct {
+    const pb_field_t *fields;
+    void *source;
+    size_t size;
+} PackedCase;
+
+static Int32Array int32_source;
+static Uint32Array uint32_source;
+static Int32Array decoded;
+static uint8_t buffer[MAX_ELEMENTS * 10 + 16];
+
+/* Values of 1 to 5 bytes, mostly short ones as in typical sensor data */
+static void fill_values(pb_size_t count)
+{
+    pb_size_t i;
+    uint32_t seed = 12345;
+
+    for (i = 0; i < count; i++)
+    {
+        uint32_t value;
+        seed = seed * 1103515245u + 12345u;
+        value = seed >> (8 + (seed >> 28) % 24);
+        uint32_source.values[i] = value;
+        int32_source.values[i] = (seed & 1) ? (int32_t)value : -(int32_t)(value >> 1);
+    }
+
+    uint32_source.values_count = count;
+    int32_source.values_count = count;
+}
+
+static bool encode_case(void *context)
+{
+    PackedCase *c = (PackedCase*)context;
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+    if (!pb_encode(&stream, c->fields, c->source))
+        return false;
+
+    c->size = stream.bytes_written;
+    return true;
+}
+
+static bool decode_case(void *context)
+{
+    PackedCase *c = (PackedCase*)context;
+    pb_istream_t stream = pb_istream_from_buffer(buffer, c->size);
+    return pb_decode(&stream, c->fields, &decoded);
+}
+
+int main(void)
+{
+    static const pb_size_t counts[] = {1, 16, 256, MAX_ELEMENTS};
+    static const char *names[] = {"int32", "uint32", "sint32"};
+    const pb_field_t *fields[3];
+    void *sources[3];
+    size_t i, j;
+
+    fields[0] = Int32_fields;
+    fields[1] = Uint32_fields;
+    fields[2] = Sint32_fields;
+    sources[0] = &int32_source;
+    sources[1] = &uint32_source;
+    sources[2] = &int32_source;
+
+    printf("%-7s %9s %10s %14s %14s\n", "type", "elements", "bytes",
+           "encode Melem/s", "decode Melem/s");
+
+    for (i = 0; i < 3; i++)
+    {
+        for (j = 0; j < sizeof(counts) / sizeof(counts[0]); j++)
+        {
+            PackedCase c;
+            double encode_time, decode_time;
+
+            fill_values(counts[j]);
+            c.fields = fields[i];
+            c.source = sources[i];
+
+            encode_time = benchmark_run(names[i], encode_case, &c);
+            decode_time = benchmark_run(names[i], decode_case, &c);
+
+            /* Both source types have the same layout */
+            if (decoded.values_count != counts[j] ||
+                memcmp(decoded.values, ((const Int32Array*)c.source)->values,
+                       counts[j] * sizeof(int32_t)) != 0)
+            {
+                fprintf(stderr, "%s: decoded values differ\n", names[i]);
+                return 1;
+            }
+
+            printf("%-7s %9u %10u %14.1f %14.1f\n", names[i], (unsigned)counts[j],
+                   (unsigned)c.size, counts[j] / encode_time / 1e6,
+                   counts[j] / decode_time / 1e6);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,128 @@
+/* Decoding time of a stream of length-delimited messages with
+ * pb_decode_delimited() on one thread, and with decode_delimited_batch()
+ * on 1 to N threads. The frame scan that precedes the parallel decoding
+ * runs on one thread, and is also timed separately. The number of messages
+ * can be given on the command line, the default is one million.
+ *
+ * Build and run from the repository root:
+ *    cc -O2 -c pb_common.c pb_encode.c pb_decode.c
+ *    c++ -std=c++11 -O2 -pthread -I. -Itests tests/parallel_benchmark.cpp \
+ *       pb_common.o pb_encode.o pb_decode.o
+ *    ./a.out 2000000
+ */
+
+#include "benchmark.h"
+#include <string.h>
+#include <vector>
+
+/* Normally provided by the application */
+struct UInt8Array {
+  uint32_t length;
+  uint8_t *data;
+};
+
+#include <pb_parallel.h>
+
+typedef struct {
+  uint32_t id;
+  int64_t timestamp;
+  char label[16];
+  pb_size_t channels_count;
+  int32_t channels[8];
+} Sample;
+
+static const pb_field_t Sample_fields[5] = {
+  PB_FIELD(1, UINT32, REQUIRED, STATIC, FIRST, Sample, id, id, 0),
+  PB_FIELD(2, INT64, REQUIRED, STATIC, OTHER, Sample, timestamp, id, 0),
+  PB_FIELD(3, STRING, REQUIRED, STATIC, OTHER, Sample, label, timestamp, 0),
+  PB_FIELD(4, SINT32, REPEATED, STATIC, OTHER, Sample, channels, label, 0),
+  PB_LAST_FIELD
+};
+
+struct BatchCase {
+  UInt8Array input;
+  std::vector<Sample> output;
+  std::vector<nanopb::DelimitedFrame> frames;
+  unsigned thread_count;
+};
+
+static bool write_log(std::vector<uint8_t> &log, size_t count) {
+  Sample sample;
+  uint8_t buffer[128];
+
+  memset(&sample, 0, sizeof(sample));
+  for (size_t i = 0; i < count; i++) {
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+    sample.id = (uint32_t)i;
+    sample.timestamp = (int64_t)1500000000000 + (int64_t)i * 250;
+    sprintf(sample.label, "ch %u", (unsigned)(i % 64));
+    sample.channels_count = (pb_size_t)(i % 9);
+    for (pb_size_t j = 0; j < sample.channels_count; j++) {
+      sample.channels[j] = (int32_t)((i * 7919 + j * 104729) % 60000) - 30000;
+    }
+    if (!pb_encode_delimited(&stream, Sample_fields, &sample)) { return false; }
+    log.insert(log.end(), buffer, buffer + stream.bytes_written);
+  }
+  return true;
+}
+
+static bool decode_serial(void *context) {
+  BatchCase *c = (BatchCase *)context;
+  pb_istream_t stream = pb_istream_from_buffer(c->input.data, c->input.length);
+  for (size_t i = 0; i < c->output.size(); i++) {
+    if (!pb_decode_delimited(&stream, Sample_fields, &c->output[i])) {
+      return false;
+    }
+  }
+  return stream.bytes_left == 0;
+}
+
+static bool scan_frames(void *context) {
+  BatchCase *c = (BatchCase *)context;
+  return nanopb::scan_delimited_frames(c->input, c->frames) &&
+         c->frames.size() == c->output.size();
+}
+
+static bool decode_batch(void *context) {
+  BatchCase *c = (BatchCase *)context;
+  size_t count = c->output.size();
+  return nanopb::decode_delimited_batch(c->input, Sample_fields,
+                                        &c->output[0], count,
+                                        c->thread_count) &&
+         count == c->output.size();
+}
+
+int main(int argc, char **argv) {
+  size_t count = (argc > 1) ? (size_t)strtoul(argv[1], NULL, 10) : 1000000;
+  unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<uint8_t> log;
+  BatchCase c;
+
+  if (count == 0 || !write_log(log, count)) { return 1; }
+
+  c.input.data = &log[0];
+  c.input.length = (uint32_t)log.size();
+  c.output.resize(count);
+
+  printf("%u messages, %u bytes, %u cores\n\n", (unsigned)count,
+         (unsigned)log.size(), cores);
+  printf("%-22s %10s %10s %9s\n", "decode", "ms", "Mmsg/s", "speedup");
+
+  double serial_time = benchmark_run("serial", decode_serial, &c);
+  printf("%-22s %10.1f %10.2f %8.2fx\n", "pb_decode_delimited",
+         serial_time * 1e3, count / serial_time / 1e6, 1.0);
+
+  double scan_time = benchmark_run("scan", scan_frames, &c);
+  printf("%-22s %10.1f\n", "scan_delimited_frames", scan_time * 1e3);
+
+  for (unsigned threads = 1; threads <= 2 * cores; threads *= 2) {
+    char label[32];
+    c.thread_count = threads;
+    double time = benchmark_run("batch", decode_batch, &c);
+    sprintf(label, "batch, %u threads", threads);
+    printf("%-22s %10.1f %10.2f %8.2fx\n", label, time * 1e3,
+           count / time / 1e6, serial_time / time);
+  }
+
+  return 0;
+}
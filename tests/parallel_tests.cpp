@@ -0,0 +1,216 @@
+/* Tests for the multi-threaded decoding helpers in pb_parallel.h.
+ *
+ * Build and run from the repository root:
+ *    cc -DPB_FIELD_16BIT -fsanitize=thread -g -c pb_common.c pb_encode.c pb_decode.c
+ *    c++ -std=c++11 -DPB_FIELD_16BIT -fsanitize=thread -g -pthread -I. -Itests \
+ *       tests/parallel_tests.cpp pb_common.o pb_encode.o pb_decode.o
+ *    ./a.out
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/* Normally provided by the application */
+struct UInt8Array {
+  uint32_t length;
+  uint8_t *data;
+};
+
+#include <pb_parallel.h>
+#include "unittests.h"
+
+typedef struct {
+  int32_t x;
+  bool has_y;
+  int32_t y;
+} Point;
+
+typedef struct {
+  uint32_t id;
+  pb_size_t points_count;
+  Point points[1000];
+  bool has_checksum;
+  uint32_t checksum;
+} Frame;
+
+static const pb_field_t Point_fields[3] = {
+  PB_FIELD(1, SINT32, REQUIRED, STATIC, FIRST, Point, x, x, 0),
+  PB_FIELD(2, INT32, OPTIONAL, STATIC, OTHER, Point, y, x, 0),
+  PB_LAST_FIELD
+};
+
+static const pb_field_t Frame_fields[4] = {
+  PB_FIELD(1, UINT32, REQUIRED, STATIC, FIRST, Frame, id, id, 0),
+  PB_FIELD(2, MESSAGE, REPEATED, STATIC, OTHER, Frame, points, id, &Point_fields),
+  PB_FIELD(3, FIXED32, OPTIONAL, STATIC, OTHER, Frame, checksum, points, 0),
+  PB_LAST_FIELD
+};
+
+static void fill_frame(Frame &frame, uint32_t id, pb_size_t points) {
+  memset(&frame, 0, sizeof(frame));
+  frame.id = id;
+  frame.points_count = points;
+  for (pb_size_t i = 0; i < points; i++) {
+    frame.points[i].x = (int32_t)(id * 31 + i) - 500;
+    frame.points[i].has_y = (i % 3 != 0);
+    frame.points[i].y = frame.points[i].has_y ? (int32_t)(i * i) : 0;
+  }
+  frame.has_checksum = (id % 2 == 0);
+  frame.checksum = frame.has_checksum ? id * 2654435761u : 0;
+}
+
+static bool same_frame(const Frame &a, const Frame &b) {
+  if (a.id != b.id || a.points_count != b.points_count ||
+      a.has_checksum != b.has_checksum || a.checksum != b.checksum) {
+    return false;
+  }
+  for (pb_size_t i = 0; i < a.points_count; i++) {
+    if (a.points[i].x != b.points[i].x || a.points[i].has_y != b.points[i].has_y ||
+        a.points[i].y != b.points[i].y) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Frames with 0 to 9 points, written with pb_encode_delimited() */
+static bool write_log(std::vector<uint8_t> &log, std::vector<size_t> &starts,
+                      size_t count) {
+  static Frame frame;
+  uint8_t buffer[256];
+  for (size_t i = 0; i < count; i++) {
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+    fill_frame(frame, (uint32_t)i, (pb_size_t)(i % 10));
+    if (!pb_encode_delimited(&stream, Frame_fields, &frame)) { return false; }
+    starts.push_back(log.size());
+    log.insert(log.end(), buffer, buffer + stream.bytes_written);
+  }
+  return true;
+}
+
+static bool check_batch(const std::vector<Frame> &output, size_t count) {
+  static Frame expected;
+  for (size_t i = 0; i < count; i++) {
+    fill_frame(expected, (uint32_t)i, (pb_size_t)(i % 10));
+    if (!same_frame(output[i], expected)) { return false; }
+  }
+  return true;
+}
+
+int main() {
+  int status = 0;
+  const size_t frame_count = 500;
+  std::vector<uint8_t> log;
+  std::vector<size_t> starts;
+  std::vector<Frame> output(frame_count);
+  UInt8Array input;
+
+  COMMENT("Writing the test messages")
+  TEST(write_log(log, starts, frame_count))
+  input.data = &log[0];
+  input.length = (uint32_t)log.size();
+
+  {
+    std::vector<nanopb::DelimitedFrame> frames;
+    COMMENT("Scanning frame boundaries")
+    TEST(nanopb::scan_delimited_frames(input, frames))
+    TEST(frames.size() == frame_count)
+    TEST(frames[7].offset == starts[7] + 1 &&
+         frames[7].length == starts[8] - starts[7] - 1)
+  }
+
+  {
+    static const unsigned thread_counts[] = {1, 2, 3, 8};
+    bool all_ok = true;
+
+    COMMENT("Batch decoding on 1 to 8 threads")
+    for (size_t i = 0; i < 4; i++) {
+      size_t count = output.size();
+      memset(&output[0], 0, output.size() * sizeof(Frame));
+      if (!nanopb::decode_delimited_batch(input, Frame_fields, &output[0], count,
+                                          thread_counts[i]) ||
+          count != frame_count || !check_batch(output, count)) {
+        all_ok = false;
+      }
+    }
+    TEST(all_ok)
+  }
+
+  {
+    size_t count = 100;
+    COMMENT("Output capacity smaller than the input")
+    TEST(!nanopb::decode_delimited_batch(input, Frame_fields, &output[0], count, 4))
+    TEST(count == 100 && check_batch(output, count))
+  }
+
+  {
+    UInt8Array truncated = input;
+    size_t count = output.size();
+    truncated.length = (uint32_t)(starts[300] + 3);
+
+    COMMENT("Truncated last message")
+    TEST(!nanopb::decode_delimited_batch(truncated, Frame_fields, &output[0], count, 4))
+    TEST(count == 300 && check_batch(output, count))
+  }
+
+  {
+    std::vector<uint8_t> broken(log);
+    UInt8Array broken_input;
+    size_t count = output.size();
+
+    /* Replace the first tag of message 250 with an unknown field that has
+     * an invalid wire type */
+    broken[starts[250] + 1] = 0x7F;
+    broken_input.data = &broken[0];
+    broken_input.length = (uint32_t)broken.size();
+
+    COMMENT("Invalid message in the middle")
+    TEST(!nanopb::decode_delimited_batch(broken_input, Frame_fields, &output[0], count, 4))
+    TEST(count == 250 && check_batch(output, count))
+  }
+
+  {
+    static Frame frame, serial, parallel;
+    uint8_t buffer[16384];
+    static const pb_size_t point_counts[] = {0, 10, 300, 1000};
+    bool all_ok = true;
+
+    COMMENT("Parallel repeated submessages, above and below the threshold")
+    for (size_t i = 0; i < 4; i++) {
+      pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+      UInt8Array encoded;
+
+      fill_frame(frame, 77, point_counts[i]);
+      if (!pb_encode(&stream, Frame_fields, &frame)) {
+        all_ok = false;
+        continue;
+      }
+      encoded.data = buffer;
+      encoded.length = (uint32_t)stream.bytes_written;
+
+      memset(&parallel, 0xAA, sizeof(parallel));
+      if (!nanopb::decode_from_array(encoded, Frame_fields, serial, true) ||
+          !nanopb::decode_parallel_repeated(encoded, Frame_fields, parallel, 2, 4, 100) ||
+          !same_frame(serial, frame) || !same_frame(parallel, frame)) {
+        all_ok = false;
+      }
+    }
+    TEST(all_ok)
+  }
+
+  {
+    std::vector<int> calls(10000, 0);
+    COMMENT("parallel_for calls every index once")
+    TEST(nanopb::parallel_for(calls.size(), [&](size_t i) {
+      calls[i]++;
+      return true;
+    }, 4, 7))
+    TEST(std::count(calls.begin(), calls.end(), 1) == (long)calls.size())
+  }
+
+  if (status != 0)
+    fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+  return status;
+}
@@ -0,0 +1,188 @@
+/* Decoding time of repeated pointer fields with 10000 entries, packed and
+ * unpacked, and with two fields interleaved. With PB_ENABLE_ARENA, also
+ * the arena space used, which includes the allocations left behind when
+ * an array is grown.
+ *
+ * Build and run from the repository root:
+ *    cc -O2 -DPB_FIELD_16BIT -DPB_ENABLE_MALLOC -DPB_ENABLE_ARENA -I. -Itests \
+ *       tests/pointer_array_benchmark.c pb_common.c pb_encode.c pb_decode.c
+ *    ./a.out
+ */
+
+#include "benchmark.h"
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+
+#define ENTRIES 10000
+
+typedef struct {
+    pb_size_t varints_count;
+    int32_t *varints;
+    pb_size_t fixeds_count;
+    uint32_t *fixeds;
+} Arrays;
+
+static const pb_field_t Arrays_fields[3] = {
+    PB_FIELD(1, INT32, REPEATED, POINTER, FIRST, Arrays, varints, varints, 0),
+    PB_FIELD(2, FIXED32, REPEATED, POINTER, OTHER, Arrays, fixeds, varints, 0),
+    PB_LAST_FIELD
+};
+
+typedef struct {
+    const char *name;
+    uint8_t *input;
+    size_t size;
+#ifdef PB_ENABLE_ARENA
+    pb_arena_t *arena;
+    size_t arena_used;
+#endif
+} ArrayCase;
+
+static int32_t varints[ENTRIES];
+static uint32_t fixeds[ENTRIES];
+
+static void fill_values(void)
+{
+    uint32_t seed = 1;
+    size_t i;
+
+    for (i = 0; i < ENTRIES; i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        varints[i] = (int32_t)(seed >> (8 + (seed >> 28) % 20));
+        fixeds[i] = seed;
+    }
+}
+
+/* Both fields packed, one after the other */
+static size_t write_packed(uint8_t *buffer, size_t size)
+{
+    Arrays arrays;
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, size);
+
+    arrays.varints_count = ENTRIES;
+    arrays.varints = varints;
+    arrays.fixeds_count = ENTRIES;
+    arrays.fixeds = fixeds;
+
+    if (!pb_encode(&stream, Arrays_fields, &arrays))
+        return 0;
+
+    return stream.bytes_written;
+}
+
+/* One field per entry. If interleaved, the two fields alternate. */
+static size_t write_unpacked(uint8_t *buffer, size_t size, bool interleaved)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, size);
+    size_t i;
+
+    for (i = 0; i < 2 * ENTRIES; i++)
+    {
+        size_t entry = interleaved ? i / 2 : i % ENTRIES;
+        bool varint = interleaved ? (i % 2 == 0) : (i < ENTRIES);
+
+        if (varint)
+        {
+            if (!pb_encode_tag(&stream, PB_WT_VARINT, 1) ||
+                !pb_encode_varint(&stream, (uint64_t)(int64_t)varints[entry]))
+                return 0;
+        }
+        else
+        {
+            if (!pb_encode_tag(&stream, PB_WT_32BIT, 2) ||
+                !pb_encode_fixed32(&stream, &fixeds[entry]))
+                return 0;
+        }
+    }
+
+    return stream.bytes_written;
+}
+
+static bool check_arrays(const Arrays *arrays)
+{
+    return arrays->varints_count == ENTRIES && arrays->fixeds_count == ENTRIES &&
+           memcmp(arrays->varints, varints, sizeof(varints)) == 0 &&
+           memcmp(arrays->fixeds, fixeds, sizeof(fixeds)) == 0;
+}
+
+static bool decode_malloc(void *context)
+{
+    ArrayCase *c = (ArrayCase*)context;
+    Arrays arrays;
+    pb_istream_t stream = pb_istream_from_buffer(c->input, c->size);
+    bool status = pb_decode(&stream, Arrays_fields, &arrays) && check_arrays(&arrays);
+    pb_release(Arrays_fields, &arrays);
+    return status;
+}
+
+#ifdef PB_ENABLE_ARENA
+static bool decode_arena(void *context)
+{
+    ArrayCase *c = (ArrayCase*)context;
+    Arrays arrays;
+    pb_istream_t stream = pb_istream_from_buffer(c->input, c->size);
+    bool status;
+
+    stream.arena = c->arena;
+    status = pb_decode(&stream, Arrays_fields, &arrays) && check_arrays(&arrays);
+    c->arena_used = (size_t)(c->arena->next - c->arena->buffer);
+    pb_arena_reset(c->arena);
+    return status;
+}
+#endif
+
+int main(void)
+{
+    static uint8_t inputs[3][ENTRIES * 16];
+    ArrayCase cases[3];
+    size_t i;
+#ifdef PB_ENABLE_ARENA
+    static union {
+        double align;
+        uint8_t bytes[ENTRIES * 64];
+    } arena_buffer;
+    pb_arena_t arena;
+    pb_arena_init(&arena, arena_buffer.bytes, sizeof(arena_buffer), 0);
+#endif
+
+    fill_values();
+
+    cases[0].name = "packed";
+    cases[0].size = write_packed(inputs[0], sizeof(inputs[0]));
+    cases[1].name = "unpacked";
+    cases[1].size = write_unpacked(inputs[1], sizeof(inputs[1]), false);
+    cases[2].name = "interleaved";
+    cases[2].size = write_unpacked(inputs[2], sizeof(inputs[2]), true);
+
+    printf("%-12s %12s %12s %16s\n", "fields", "malloc us", "arena us", "arena bytes used");
+    printf("%-12s %12s %12s %16u\n", "(minimum)", "", "",
+           (unsigned)(sizeof(varints) + sizeof(fixeds)));
+
+    for (i = 0; i < 3; i++)
+    {
+        ArrayCase *c = &cases[i];
+        double malloc_time;
+
+        c->input = inputs[i];
+        if (c->size == 0)
+            return 1;
+
+        malloc_time = benchmark_run(c->name, decode_malloc, c);
+
+#ifdef PB_ENABLE_ARENA
+        {
+            double arena_time;
+            c->arena = &arena;
+            arena_time = benchmark_run(c->name, decode_arena, c);
+            printf("%-12s %12.1f %12.1f %16u\n", c->name, malloc_time * 1e6,
+                   arena_time * 1e6, (unsigned)c->arena_used);
+        }
+#else
+        printf("%-12s %12.1f %12s %16s\n", c->name, malloc_time * 1e6, "-", "-");
+#endif
+    }
+
+    return 0;
+}
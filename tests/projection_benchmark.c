@@ -0,0 +1,295 @@
+/* Decoding time of a message with 50 fields, fully and with
+ * pb_decode_projected() selecting a few of them.
+ *
+ * Build and run from the repository root:
+ *    cc -O2 -I. -Itests tests/projection_benchmark.c \
+ *       pb_common.c pb_encode.c pb_decode.c
+ *    ./a.out
+ */
+
+#include "benchmark.h"
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <pb_common.h>
+
+typedef struct {
+    int32_t x;
+    int32_t y;
+} Point;
+
+static const pb_field_t Point_fields[3] = {
+    PB_FIELD(1, INT32, REQUIRED, STATIC, FIRST, Point, x, x, 0),
+    PB_FIELD(2, INT32, REQUIRED, STATIC, OTHER, Point, y, x, 0),
+    PB_LAST_FIELD
+};
+
+/* Every fifth field is an int32, string, fixed32, double or submessage */
+typedef struct {
+    bool has_f1;
+    int32_t f1;
+    bool has_f2;
+    char f2[24];
+    bool has_f3;
+    uint32_t f3;
+    bool has_f4;
+    double f4;
+    bool has_f5;
+    Point f5;
+    bool has_f6;
+    int32_t f6;
+    bool has_f7;
+    char f7[24];
+    bool has_f8;
+    uint32_t f8;
+    bool has_f9;
+    double f9;
+    bool has_f10;
+    Point f10;
+    bool has_f11;
+    int32_t f11;
+    bool has_f12;
+    char f12[24];
+    bool has_f13;
+    uint32_t f13;
+    bool has_f14;
+    double f14;
+    bool has_f15;
+    Point f15;
+    bool has_f16;
+    int32_t f16;
+    bool has_f17;
+    char f17[24];
+    bool has_f18;
+    uint32_t f18;
+    bool has_f19;
+    double f19;
+    bool has_f20;
+    Point f20;
+    bool has_f21;
+    int32_t f21;
+    bool has_f22;
+    char f22[24];
+    bool has_f23;
+    uint32_t f23;
+    bool has_f24;
+    double f24;
+    bool has_f25;
+    Point f25;
+    bool has_f26;
+    int32_t f26;
+    bool has_f27;
+    char f27[24];
+    bool has_f28;
+    uint32_t f28;
+    bool has_f29;
+    double f29;
+    bool has_f30;
+    Point f30;
+    bool has_f31;
+    int32_t f31;
+    bool has_f32;
+    char f32[24];
+    bool has_f33;
+    uint32_t f33;
+    bool has_f34;
+    double f34;
+    bool has_f35;
+    Point f35;
+    bool has_f36;
+    int32_t f36;
+    bool has_f37;
+    char f37[24];
+    bool has_f38;
+    uint32_t f38;
+    bool has_f39;
+    double f39;
+    bool has_f40;
+    Point f40;
+    bool has_f41;
+    int32_t f41;
+    bool has_f42;
+    char f42[24];
+    bool has_f43;
+    uint32_t f43;
+    bool has_f44;
+    double f44;
+    bool has_f45;
+    Point f45;
+    bool has_f46;
+    int32_t f46;
+    bool has_f47;
+    char f47[24];
+    bool has_f48;
+    uint32_t f48;
+    bool has_f49;
+    double f49;
+    bool has_f50;
+    Point f50;
+} Wide;
+
+static const pb_field_t Wide_fields[51] = {
+    PB_FIELD( 1, INT32, OPTIONAL, STATIC, FIRST, Wide, f1, f1, 0),
+    PB_FIELD( 2, STRING, OPTIONAL, STATIC, OTHER, Wide, f2, f1, 0),
+    PB_FIELD( 3, FIXED32, OPTIONAL, STATIC, OTHER, Wide, f3, f2, 0),
+    PB_FIELD( 4, DOUBLE, OPTIONAL, STATIC, OTHER, Wide, f4, f3, 0),
+    PB_FIELD( 5, MESSAGE, OPTIONAL, STATIC, OTHER, Wide, f5, f4, &Point_fields),
+    PB_FIELD( 6, INT32, OPTIONAL, STATIC, OTHER, Wide, f6, f5, 0),
+    PB_FIELD( 7, STRING, OPTIONAL, STATIC, OTHER, Wide, f7, f6, 0),
+    PB_FIELD( 8, FIXED32, OPTIONAL, STATIC, OTHER, Wide, f8, f7, 0),
+    PB_FIELD( 9, DOUBLE, OPTIONAL, STATIC, OTHER, Wide, f9, f8, 0),
+    PB_FIELD(10, MESSAGE, OPTIONAL, STATIC, OTHER, Wide, f10, f9, &Point_fields),
+    PB_FIELD(11, INT32, OPTIONAL, STATIC, OTHER, Wide, f11, f10, 0),
+    PB_FIELD(12, STRING, OPTIONAL, STATIC, OTHER, Wide, f12, f11, 0),
+    PB_FIELD(13, FIXED32, OPTIONAL, STATIC, OTHER, Wide, f13, f12, 0),
+    PB_FIELD(14, DOUBLE, OPTIONAL, STATIC, OTHER, Wide, f14, f13, 0),
+    PB_FIELD(15, MESSAGE, OPTIONAL, STATIC, OTHER, Wide, f15, f14, &Point_fields),
+    PB_FIELD(16, INT32, OPTIONAL, STATIC, OTHER, Wide, f16, f15, 0),
+    PB_FIELD(17, STRING, OPTIONAL, STATIC, OTHER, Wide, f17, f16, 0),
+    PB_FIELD(18, FIXED32, OPTIONAL, STATIC, OTHER, Wide, f18, f17, 0),
+    PB_FIELD(19, DOUBLE, OPTIONAL, STATIC, OTHER, Wide, f19, f18, 0),
+    PB_FIELD(20, MESSAGE, OPTIONAL, STATIC, OTHER, Wide, f20, f19, &Point_fields),
+    PB_FIELD(21, INT32, OPTIONAL, STATIC, OTHER, Wide, f21, f20, 0),
+    PB_FIELD(22, STRING, OPTIONAL, STATIC, OTHER, Wide, f22, f21, 0),
+    PB_FIELD(23, FIXED32, OPTIONAL, STATIC, OTHER, Wide, f23, f22, 0),
+    PB_FIELD(24, DOUBLE, OPTIONAL, STATIC, OTHER, Wide, f24, f23, 0),
+    PB_FIELD(25, MESSAGE, OPTIONAL, STATIC, OTHER, Wide, f25, f24, &Point_fields),
+    PB_FIELD(26, INT32, OPTIONAL, STATIC, OTHER, Wide, f26, f25, 0),
+    PB_FIELD(27, STRING, OPTIONAL, STATIC, OTHER, Wide, f27, f26, 0),
+    PB_FIELD(28, FIXED32, OPTIONAL, STATIC, OTHER, Wide, f28, f27, 0),
+    PB_FIELD(29, DOUBLE, OPTIONAL, STATIC, OTHER, Wide, f29, f28, 0),
+    PB_FIELD(30, MESSAGE, OPTIONAL, STATIC, OTHER, Wide, f30, f29, &Point_fields),
+    PB_FIELD(31, INT32, OPTIONAL, STATIC, OTHER, Wide, f31, f30, 0),
+    PB_FIELD(32, STRING, OPTIONAL, STATIC, OTHER, Wide, f32, f31, 0),
+    PB_FIELD(33, FIXED32, OPTIONAL, STATIC, OTHER, Wide, f33, f32, 0),
+    PB_FIELD(34, DOUBLE, OPTIONAL, STATIC, OTHER, Wide, f34, f33, 0),
+    PB_FIELD(35, MESSAGE, OPTIONAL, STATIC, OTHER, Wide, f35, f34, &Point_fields),
+    PB_FIELD(36, INT32, OPTIONAL, STATIC, OTHER, Wide, f36, f35, 0),
+    PB_FIELD(37, STRING, OPTIONAL, STATIC, OTHER, Wide, f37, f36, 0),
+    PB_FIELD(38, FIXED32, OPTIONAL, STATIC, OTHER, Wide, f38, f37, 0),
+    PB_FIELD(39, DOUBLE, OPTIONAL, STATIC, OTHER, Wide, f39, f38, 0),
+    PB_FIELD(40, MESSAGE, OPTIONAL, STATIC, OTHER, Wide, f40, f39, &Point_fields),
+    PB_FIELD(41, INT32, OPTIONAL, STATIC, OTHER, Wide, f41, f40, 0),
+    PB_FIELD(42, STRING, OPTIONAL, STATIC, OTHER, Wide, f42, f41, 0),
+    PB_FIELD(43, FIXED32, OPTIONAL, STATIC, OTHER, Wide, f43, f42, 0),
+    PB_FIELD(44, DOUBLE, OPTIONAL, STATIC, OTHER, Wide, f44, f43, 0),
+    PB_FIELD(45, MESSAGE, OPTIONAL, STATIC, OTHER, Wide, f45, f44, &Point_fields),
+    PB_FIELD(46, INT32, OPTIONAL, STATIC, OTHER, Wide, f46, f45, 0),
+    PB_FIELD(47, STRING, OPTIONAL, STATIC, OTHER, Wide, f47, f46, 0),
+    PB_FIELD(48, FIXED32, OPTIONAL, STATIC, OTHER, Wide, f48, f47, 0),
+    PB_FIELD(49, DOUBLE, OPTIONAL, STATIC, OTHER, Wide, f49, f48, 0),
+    PB_FIELD(50, MESSAGE, OPTIONAL, STATIC, OTHER, Wide, f50, f49, &Point_fields),
+    PB_LAST_FIELD
+};
+
+typedef struct {
+    const char *name;
+    const pb_field_mask_t *mask;
+} ProjectionCase;
+
+static uint8_t input[2048];
+static size_t input_size;
+static Wide decoded;
+
+/* Fill all 50 fields */
+static bool write_input(void)
+{
+    Wide wide;
+    pb_ostream_t stream = pb_ostream_from_buffer(input, sizeof(input));
+    pb_field_iter_t iter;
+
+    memset(&wide, 0, sizeof(wide));
+    if (!pb_field_iter_begin(&iter, Wide_fields, &wide))
+        return false;
+
+    do
+    {
+        int32_t value = (int32_t)iter.pos->tag * 1000 - 7;
+
+        *(bool*)iter.pSize = true;
+
+        switch (PB_LTYPE(iter.pos->type))
+        {
+            case PB_LTYPE_VARINT:
+            case PB_LTYPE_FIXED32:
+                memcpy(iter.pData, &value, sizeof(value));
+                break;
+
+            case PB_LTYPE_FIXED64:
+                *(double*)iter.pData = value / 3.0;
+                break;
+
+            case PB_LTYPE_STRING:
+                sprintf((char*)iter.pData, "field %u", (unsigned)iter.pos->tag);
+                break;
+
+            default:
+                ((Point*)iter.pData)->x = value;
+                ((Point*)iter.pData)->y = -value;
+                break;
+        }
+    } while (pb_field_iter_next(&iter));
+
+    if (!pb_encode(&stream, Wide_fields, &wide))
+        return false;
+
+    input_size = stream.bytes_written;
+    return true;
+}
+
+static bool decode_full(void *context)
+{
+    pb_istream_t stream = pb_istream_from_buffer(input, input_size);
+    PB_UNUSED(context);
+    return pb_decode_noinit(&stream, Wide_fields, &decoded);
+}
+
+static bool decode_projected(void *context)
+{
+    ProjectionCase *c = (ProjectionCase*)context;
+    pb_istream_t stream = pb_istream_from_buffer(input, input_size);
+    return pb_decode_projected(&stream, Wide_fields, &decoded, c->mask);
+}
+
+int main(void)
+{
+    static const uint32_t first_tags[] = {1, 2, 3};
+    static const pb_field_mask_t first = {first_tags, 3, NULL};
+
+    static const uint32_t last_tags[] = {48, 49, 50};
+    static const pb_field_mask_t last = {last_tags, 3, NULL};
+
+    static const uint32_t x_tags[] = {1};
+    static const pb_field_mask_t x_only = {x_tags, 1, NULL};
+    static const uint32_t spread_tags[] = {7, 25, 44};
+    static const pb_field_mask_t *const spread_submasks[] = {NULL, &x_only, NULL};
+    static const pb_field_mask_t spread = {spread_tags, 3, spread_submasks};
+
+    static const uint32_t messages_tags[] = {5, 10, 15, 20, 25, 30, 35, 40, 45, 50};
+    static const pb_field_mask_t messages = {messages_tags, 10, NULL};
+
+    static ProjectionCase cases[] = {
+        {"fields 1-3", &first},
+        {"fields 48-50", &last},
+        {"7, 25.x, 44", &spread},
+        {"submessages", &messages},
+    };
+    double full_time;
+    size_t i;
+
+    if (!write_input())
+        return 1;
+
+    full_time = benchmark_run("full", decode_full, NULL);
+    printf("%u bytes of input\n\n", (unsigned)input_size);
+    printf("%-14s %10s %9s\n", "decode", "ns", "speedup");
+    printf("%-14s %10.1f %8.2fx\n", "all 50 fields", full_time * 1e9, 1.0);
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        double time = benchmark_run(cases[i].name, decode_projected, &cases[i]);
+        printf("%-14s %10.1f %8.2fx\n", cases[i].name, time * 1e9, full_time / time);
+    }
+
+    return 0;
+}
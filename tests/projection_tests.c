@@ -0,0 +1,193 @@
+/* Tests for decoding selected fields with pb_decode_projected().
+ *
+ * Build and run from the repository root:
+ *    cc -fsanitize=address,undefined -I. -Itests tests/projection_tests.c \
+ *       pb_common.c pb_encode.c pb_decode.c
+ *    ./a.out
+ */
+
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "unittests.h"
+
+typedef struct {
+    int32_t version;
+    bool has_flags;
+    uint32_t flags;
+} Header;
+
+typedef struct {
+    uint32_t id;
+    bool has_name;
+    char name[16];
+    Header header;
+    pb_size_t values_count;
+    int32_t values[8];
+    bool has_scale;
+    double scale;
+    pb_size_t history_count;
+    Header history[3];
+} Record;
+
+static const pb_field_t Header_fields[3] = {
+    PB_FIELD(1, INT32, REQUIRED, STATIC, FIRST, Header, version, version, 0),
+    PB_FIELD(2, FIXED32, OPTIONAL, STATIC, OTHER, Header, flags, version, 0),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t Record_fields[7] = {
+    PB_FIELD(1, UINT32, REQUIRED, STATIC, FIRST, Record, id, id, 0),
+    PB_FIELD(2, STRING, OPTIONAL, STATIC, OTHER, Record, name, id, 0),
+    PB_FIELD(3, MESSAGE, REQUIRED, STATIC, OTHER, Record, header, name, &Header_fields),
+    PB_FIELD(4, INT32, REPEATED, STATIC, OTHER, Record, values, header, 0),
+    PB_FIELD(5, DOUBLE, OPTIONAL, STATIC, OTHER, Record, scale, values, 0),
+    PB_FIELD(6, MESSAGE, REPEATED, STATIC, OTHER, Record, history, scale, &Header_fields),
+    PB_LAST_FIELD
+};
+
+static size_t encode_record(uint8_t *buffer, size_t size, Record *record)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, size);
+
+    memset(record, 0, sizeof(*record));
+    record->id = 4242;
+    record->has_name = true;
+    strcpy(record->name, "projected");
+    record->header.version = 3;
+    record->header.has_flags = true;
+    record->header.flags = 0x80000001;
+    record->values_count = 5;
+    record->values[0] = -1;
+    record->values[1] = 1;
+    record->values[2] = 1000;
+    record->values[3] = -100000;
+    record->values[4] = 7;
+    record->has_scale = true;
+    record->scale = 2.5;
+    record->history_count = 2;
+    record->history[0].version = 1;
+    record->history[1].version = 2;
+    record->history[1].has_flags = true;
+    record->history[1].flags = 16;
+
+    if (!pb_encode(&stream, Record_fields, record))
+        return 0;
+
+    return stream.bytes_written;
+}
+
+/* Decode into a structure filled with a pattern, so that fields that were
+ * not written can be detected. Repeated fields are appended to, as with
+ * pb_decode_noinit(), so their counts start at zero. */
+static bool decode_over_pattern(const uint8_t *input, size_t size, Record *record,
+                                const pb_field_mask_t *mask)
+{
+    uint8_t copy[256];
+    pb_istream_t stream;
+
+    memcpy(copy, input, size);
+    stream = pb_istream_from_buffer(copy, size);
+    memset(record, 0xAA, sizeof(*record));
+    record->values_count = 0;
+    record->history_count = 0;
+    return pb_decode_projected(&stream, Record_fields, record, mask);
+}
+
+int main(void)
+{
+    int status = 0;
+    uint8_t input[256];
+    Record expected;
+    Record pattern;
+    Record record;
+    size_t size = encode_record(input, sizeof(input), &expected);
+
+    memset(&pattern, 0xAA, sizeof(pattern));
+    pattern.values_count = 0;
+    pattern.history_count = 0;
+
+    COMMENT("Encoding the test message")
+    TEST(size > 0)
+
+    {
+        static const uint32_t tags[] = {4, 1};
+        static const pb_field_mask_t mask = {tags, 2, NULL};
+
+        COMMENT("Selected fields only, in any order")
+        TEST(decode_over_pattern(input, size, &record, &mask))
+        TEST(record.id == expected.id)
+        TEST(record.values_count == 5 &&
+             memcmp(record.values, expected.values, 5 * sizeof(int32_t)) == 0)
+        TEST(memcmp(record.name, pattern.name, sizeof(record.name)) == 0)
+        TEST(memcmp(&record.header, &pattern.header, sizeof(record.header)) == 0)
+        TEST(memcmp(&record.scale, &pattern.scale, sizeof(record.scale)) == 0)
+        TEST(record.history_count == 0)
+    }
+
+    {
+        static const uint32_t header_tags[] = {2};
+        static const pb_field_mask_t header_mask = {header_tags, 1, NULL};
+        static const uint32_t tags[] = {3, 6};
+        static const pb_field_mask_t *const submasks[] = {&header_mask, NULL};
+        static const pb_field_mask_t mask = {tags, 2, submasks};
+
+        COMMENT("Submask for one submessage, whole repeated submessages")
+        TEST(decode_over_pattern(input, size, &record, &mask))
+        TEST(record.header.has_flags && record.header.flags == expected.header.flags)
+        TEST(record.header.version == pattern.header.version)
+        TEST(record.history_count == 2)
+        TEST(record.history[0].version == 1 && !record.history[0].has_flags)
+        TEST(record.history[1].version == 2 && record.history[1].has_flags &&
+             record.history[1].flags == 16)
+        TEST(record.id == pattern.id)
+    }
+
+    {
+        static const uint32_t tags[] = {1, 2, 3, 4, 5, 6};
+        static const pb_field_mask_t mask = {tags, 6, NULL};
+
+        COMMENT("Selecting every field gives the same result as pb_decode_noinit()")
+        memset(&record, 0, sizeof(record));
+        {
+            pb_istream_t stream = pb_istream_from_buffer(input, size);
+            TEST(pb_decode_projected(&stream, Record_fields, &record, &mask))
+        }
+        TEST(memcmp(&record, &expected, sizeof(record)) == 0)
+    }
+
+    {
+        /* Only field 2, the string */
+        uint8_t partial[32];
+        pb_ostream_t ostream = pb_ostream_from_buffer(partial, sizeof(partial));
+        static const uint32_t name_tags[] = {2};
+        static const pb_field_mask_t name_mask = {name_tags, 1, NULL};
+        static const uint32_t id_tags[] = {1, 2};
+        static const pb_field_mask_t id_mask = {id_tags, 2, NULL};
+        pb_istream_t stream;
+
+        TEST(pb_encode_tag(&ostream, PB_WT_STRING, 2) &&
+             pb_encode_string(&ostream, (const uint8_t*)"abc", 3))
+
+        COMMENT("Required fields are checked only when selected")
+        TEST(decode_over_pattern(partial, ostream.bytes_written, &record, &name_mask))
+        TEST(strcmp(record.name, "abc") == 0)
+
+        stream = pb_istream_from_buffer(partial, ostream.bytes_written);
+        TEST(!pb_decode_projected(&stream, Record_fields, &record, &id_mask))
+        TEST(strcmp(PB_GET_ERROR(&stream), "missing required field") == 0)
+    }
+
+    {
+        static const uint32_t tags[] = {5};
+        static const pb_field_mask_t mask = {tags, 1, NULL};
+
+        COMMENT("Truncated input is an error even in skipped fields")
+        TEST(!decode_over_pattern(input, size - 1, &record, &mask))
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
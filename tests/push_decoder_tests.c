@@ -0,0 +1,218 @@
+/* Tests for decoding partial input with pb_push_decode().
+ *
+ * Build and run from the repository root:
+ *    cc -fsanitize=address,undefined -I. -Itests tests/push_decoder_tests.c \
+ *       pb_common.c pb_encode.c pb_decode.c
+ *    ./a.out
+ */
+
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "unittests.h"
+
+typedef struct {
+    int32_t x;
+    bool has_y;
+    int32_t y;
+} Point;
+
+typedef struct {
+    int32_t id;
+    char name[16];
+    Point position;
+    pb_size_t samples_count;
+    int32_t samples[16];
+    pb_size_t points_count;
+    Point points[4];
+    bool has_checksum;
+    uint32_t checksum;
+    double scale;
+} Frame;
+
+static const int32_t Point_y_default = 7;
+
+static const pb_field_t Point_fields[3] = {
+    PB_FIELD(1, INT32, REQUIRED, STATIC, FIRST, Point, x, x, 0),
+    PB_FIELD(2, INT32, OPTIONAL, STATIC, OTHER, Point, y, x, &Point_y_default),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t Frame_fields[8] = {
+    PB_FIELD(1, INT32, REQUIRED, STATIC, FIRST, Frame, id, id, 0),
+    PB_FIELD(2, STRING, REQUIRED, STATIC, OTHER, Frame, name, id, 0),
+    PB_FIELD(3, MESSAGE, REQUIRED, STATIC, OTHER, Frame, position, name, &Point_fields),
+    PB_FIELD(4, SINT32, REPEATED, STATIC, OTHER, Frame, samples, position, 0),
+    PB_FIELD(5, MESSAGE, REPEATED, STATIC, OTHER, Frame, points, samples, &Point_fields),
+    PB_FIELD(6, FIXED32, OPTIONAL, STATIC, OTHER, Frame, checksum, points, 0),
+    PB_FIELD(7, DOUBLE, REQUIRED, STATIC, OTHER, Frame, scale, checksum, 0),
+    PB_LAST_FIELD
+};
+
+static uint8_t scratch[64];
+
+/* Input positions where the message may validly end: after the known
+ * fields, and after the first unknown field. */
+static size_t known_end;
+static size_t unknown_end;
+
+static size_t encode_frame(uint8_t *buffer, size_t size)
+{
+    Frame frame;
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, size);
+    pb_size_t i;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.id = -300;
+    strcpy(frame.name, "push frame");
+    frame.position.x = 1000000;
+    frame.position.has_y = true;
+    frame.position.y = -1;
+    frame.samples_count = 16;
+    for (i = 0; i < 16; i++)
+        frame.samples[i] = (int32_t)(i * i * i) - 1000;
+    frame.points_count = 3;
+    frame.points[0].x = 1;
+    frame.points[1].x = 2;
+    frame.points[1].has_y = true;
+    frame.points[1].y = 200;
+    frame.points[2].x = -3;
+    frame.has_checksum = true;
+    frame.checksum = 0xDEADBEEF;
+    frame.scale = 0.125;
+
+    if (!pb_encode(&stream, Frame_fields, &frame))
+        return 0;
+    known_end = stream.bytes_written;
+
+    /* Unknown fields, which are skipped */
+    if (!pb_encode_tag(&stream, PB_WT_VARINT, 20) ||
+        !pb_encode_varint(&stream, 123456789))
+    {
+        return 0;
+    }
+    unknown_end = stream.bytes_written;
+
+    if (!pb_encode_tag(&stream, PB_WT_STRING, 21) ||
+        !pb_encode_string(&stream, (const uint8_t*)"unknown string field", 20))
+    {
+        return 0;
+    }
+
+    return stream.bytes_written;
+}
+
+/* Feed the input in pieces of chunk bytes, and finish the message if its
+ * size was not given. */
+static pb_push_status_t push_in_chunks(pb_push_decoder_t *decoder, Frame *frame,
+                                       const uint8_t *input, size_t size,
+                                       size_t message_size, size_t chunk)
+{
+    pb_push_status_t status = PB_PUSH_NEED_MORE;
+    size_t offset = 0;
+
+    memset(frame, 0, sizeof(*frame));
+    pb_push_decoder_init(decoder, Frame_fields, frame, message_size, scratch, sizeof(scratch));
+
+    while (status == PB_PUSH_NEED_MORE && offset < size)
+    {
+        size_t count = (size - offset < chunk) ? size - offset : chunk;
+        status = pb_push_decode(decoder, input + offset, count);
+        offset += count;
+    }
+
+    if (status == PB_PUSH_NEED_MORE && message_size == (size_t)-1)
+        status = pb_push_decode_finish(decoder);
+
+    return status;
+}
+
+int main(void)
+{
+    int status = 0;
+    uint8_t input[256];
+    size_t size = encode_frame(input, sizeof(input));
+    Frame expected;
+    Frame frame;
+    pb_push_decoder_t decoder;
+
+    COMMENT("Decoding the whole message with pb_decode()")
+    TEST(size > 0)
+    {
+        pb_istream_t stream = pb_istream_from_buffer(input, size);
+        memset(&expected, 0, sizeof(expected));
+        TEST(pb_decode(&stream, Frame_fields, &expected))
+        TEST(expected.points[0].y == 7 && expected.points[1].y == 200)
+    }
+
+    COMMENT("Every chunk size, with known message size")
+    {
+        size_t chunk;
+        bool all_ok = true;
+        for (chunk = 1; chunk <= size; chunk++)
+        {
+            if (push_in_chunks(&decoder, &frame, input, size, size, chunk) != PB_PUSH_DONE ||
+                decoder.position != size ||
+                memcmp(&frame, &expected, sizeof(frame)) != 0)
+            {
+                all_ok = false;
+            }
+        }
+        TEST(all_ok)
+    }
+
+    COMMENT("Every chunk size, ending with pb_push_decode_finish()")
+    {
+        size_t chunk;
+        bool all_ok = true;
+        for (chunk = 1; chunk <= size; chunk++)
+        {
+            if (push_in_chunks(&decoder, &frame, input, size, (size_t)-1, chunk) != PB_PUSH_DONE ||
+                memcmp(&frame, &expected, sizeof(frame)) != 0)
+            {
+                all_ok = false;
+            }
+        }
+        TEST(all_ok)
+    }
+
+    COMMENT("Data after the end of the message")
+    {
+        uint8_t twice[512];
+        memcpy(twice, input, size);
+        memcpy(twice + size, input, size);
+        TEST(push_in_chunks(&decoder, &frame, twice, 2 * size, size, 100) == PB_PUSH_DONE)
+        TEST(decoder.position == size)
+        TEST(memcmp(&frame, &expected, sizeof(frame)) == 0)
+    }
+
+    COMMENT("Truncated input")
+    {
+        size_t length;
+        bool only_at_boundaries = true;
+        for (length = 0; length < size; length++)
+        {
+            /* Succeeds only when cut at a field boundary after the required
+             * fields, and not e.g. in the middle of a tag. */
+            pb_push_status_t result = push_in_chunks(&decoder, &frame, input, length, (size_t)-1, 7);
+            bool valid_end = (length == known_end || length == unknown_end);
+
+            if ((result == PB_PUSH_DONE) != valid_end)
+                only_at_boundaries = false;
+        }
+        TEST(only_at_boundaries)
+
+        TEST(push_in_chunks(&decoder, &frame, input, size - 1, size, 7) == PB_PUSH_NEED_MORE)
+    }
+
+    COMMENT("Scratch buffer too small for a string")
+    {
+        pb_push_decoder_init(&decoder, Frame_fields, &frame, size, scratch, 8);
+        TEST(pb_push_decode(&decoder, input, size) == PB_PUSH_ERROR)
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -0,0 +1,165 @@
+/* Encoding time of nested messages with pb_encode() and pb_encode_reverse()
+ * at nesting depths of 1 to 6. Each level has two submessages of the level
+ * below it, so the deepest message has 63 submessages in total.
+ *
+ * Build and run from the repository root:
+ *    cc -O2 -DPB_FIELD_16BIT -I. -Itests tests/reverse_encode_benchmark.c \
+ *       pb_common.c pb_encode.c
+ *    ./a.out
+ */
+
+#include "benchmark.h"
+#include <string.h>
+#include <pb_encode.h>
+
+typedef struct {
+    uint32_t id;
+    char name[12];
+    pb_size_t samples_count;
+    uint32_t samples[4];
+} Level1;
+
+static const pb_field_t Level1_fields[4] = {
+    PB_FIELD(1, UINT32, REQUIRED, STATIC, FIRST, Level1, id, id, 0),
+    PB_FIELD(2, STRING, REQUIRED, STATIC, OTHER, Level1, name, id, 0),
+    PB_FIELD(3, FIXED32, REPEATED, STATIC, OTHER, Level1, samples, name, 0),
+    PB_LAST_FIELD
+};
+
+static void fill_Level1(Level1 *level, uint32_t id)
+{
+    pb_size_t i;
+
+    level->id = id;
+    sprintf(level->name, "node %u", (unsigned)id);
+    level->samples_count = 4;
+    for (i = 0; i < 4; i++)
+        level->samples[i] = id * 2654435761u + i;
+}
+
+/* A level with the same fields as Level1, and two submessages of the level
+ * below it. The fields shared with Level1 are filled in through a Level1
+ * pointer, as the structures start with the same members. */
+#define DEFINE_LEVEL(name, child) \
+    typedef struct { \
+        uint32_t id; \
+        char name[12]; \
+        pb_size_t samples_count; \
+        uint32_t samples[4]; \
+        pb_size_t children_count; \
+        child children[2]; \
+    } name; \
+    \
+    static const pb_field_t name ## _fields[5] = { \
+        PB_FIELD(1, UINT32, REQUIRED, STATIC, FIRST, name, id, id, 0), \
+        PB_FIELD(2, STRING, REQUIRED, STATIC, OTHER, name, name, id, 0), \
+        PB_FIELD(3, FIXED32, REPEATED, STATIC, OTHER, name, samples, name, 0), \
+        PB_FIELD(4, MESSAGE, REPEATED, STATIC, OTHER, name, children, samples, &child ## _fields), \
+        PB_LAST_FIELD \
+    }; \
+    \
+    static void fill_ ## name(name *level, uint32_t id) \
+    { \
+        fill_Level1((Level1*)level, id); \
+        level->children_count = 2; \
+        fill_ ## child(&level->children[0], id * 2); \
+        fill_ ## child(&level->children[1], id * 2 + 1); \
+    }
+
+DEFINE_LEVEL(Level2, Level1)
+DEFINE_LEVEL(Level3, Level2)
+DEFINE_LEVEL(Level4, Level3)
+DEFINE_LEVEL(Level5, Level4)
+DEFINE_LEVEL(Level6, Level5)
+
+typedef struct {
+    const pb_field_t *fields;
+    const void *source;
+    size_t size;
+} NestedCase;
+
+static uint8_t buffer[8192];
+static uint8_t reference[8192];
+
+static bool encode_forward(void *context)
+{
+    NestedCase *c = (NestedCase*)context;
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+    if (!pb_encode(&stream, c->fields, c->source))
+        return false;
+
+    c->size = stream.bytes_written;
+    return true;
+}
+
+static bool encode_reverse(void *context)
+{
+    NestedCase *c = (NestedCase*)context;
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+    if (!pb_encode_reverse(&stream, c->fields, c->source))
+        return false;
+
+    c->size = stream.bytes_written;
+    return true;
+}
+
+int main(void)
+{
+    static Level1 level1;
+    static Level2 level2;
+    static Level3 level3;
+    static Level4 level4;
+    static Level5 level5;
+    static Level6 level6;
+    NestedCase cases[6];
+    size_t i;
+
+    fill_Level1(&level1, 1);
+    fill_Level2(&level2, 1);
+    fill_Level3(&level3, 1);
+    fill_Level4(&level4, 1);
+    fill_Level5(&level5, 1);
+    fill_Level6(&level6, 1);
+
+    cases[0].fields = Level1_fields;
+    cases[0].source = &level1;
+    cases[1].fields = Level2_fields;
+    cases[1].source = &level2;
+    cases[2].fields = Level3_fields;
+    cases[2].source = &level3;
+    cases[3].fields = Level4_fields;
+    cases[3].source = &level4;
+    cases[4].fields = Level5_fields;
+    cases[4].source = &level5;
+    cases[5].fields = Level6_fields;
+    cases[5].source = &level6;
+
+    printf("%-6s %10s %12s %12s %9s\n", "depth", "bytes", "forward us",
+           "reverse us", "speedup");
+
+    for (i = 0; i < 6; i++)
+    {
+        NestedCase *c = &cases[i];
+        double forward_time, reverse_time;
+        size_t forward_size;
+
+        forward_time = benchmark_run("forward", encode_forward, c);
+        forward_size = c->size;
+        memcpy(reference, buffer, forward_size);
+
+        reverse_time = benchmark_run("reverse", encode_reverse, c);
+        if (c->size != forward_size || memcmp(reference, buffer, forward_size) != 0)
+        {
+            fprintf(stderr, "depth %u: outputs differ\n", (unsigned)(i + 1));
+            return 1;
+        }
+
+        printf("%-6u %10u %12.2f %12.2f %8.2fx\n", (unsigned)(i + 1),
+               (unsigned)forward_size, forward_time * 1e6, reverse_time * 1e6,
+               forward_time / reverse_time);
+    }
+
+    return 0;
+}
@@ -0,0 +1,209 @@
+/* Tests for pb_encode_reverse(), which must give the same output as
+ * pb_encode().
+ *
+ * Build and run from the repository root:
+ *    cc -fsanitize=address,undefined -I. -Itests tests/reverse_encode_tests.c \
+ *       pb_common.c pb_encode.c
+ *    ./a.out
+ */
+
+#include <string.h>
+#include <pb_encode.h>
+#include "unittests.h"
+
+typedef struct {
+    int32_t value;
+    bool has_stamp;
+    uint64_t stamp;
+} Inner;
+
+typedef PB_BYTES_ARRAY_T(16) Outer_blob_t;
+
+typedef struct {
+    uint32_t id;
+    bool has_name;
+    char name[16];
+    Outer_blob_t blob;
+    pb_size_t samples_count;
+    uint32_t samples[6];
+    pb_size_t stamps_count;
+    uint64_t stamps[3];
+    pb_size_t deltas_count;
+    int32_t deltas[5];
+    pb_size_t inners_count;
+    Inner inners[3];
+    bool has_extra;
+    Inner extra;
+    pb_callback_t note;
+    bool has_ratio;
+    double ratio;
+} Outer;
+
+static const pb_field_t Inner_fields[3] = {
+    PB_FIELD(1, SINT32, REQUIRED, STATIC, FIRST, Inner, value, value, 0),
+    PB_FIELD(2, FIXED64, OPTIONAL, STATIC, OTHER, Inner, stamp, value, 0),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t Outer_fields[11] = {
+    PB_FIELD(1, UINT32, REQUIRED, STATIC, FIRST, Outer, id, id, 0),
+    PB_FIELD(2, STRING, OPTIONAL, STATIC, OTHER, Outer, name, id, 0),
+    PB_FIELD(3, BYTES, REQUIRED, STATIC, OTHER, Outer, blob, name, 0),
+    PB_FIELD(4, FIXED32, REPEATED, STATIC, OTHER, Outer, samples, blob, 0),
+    PB_FIELD(5, FIXED64, REPEATED, STATIC, OTHER, Outer, stamps, samples, 0),
+    PB_FIELD(6, SINT32, REPEATED, STATIC, OTHER, Outer, deltas, stamps, 0),
+    PB_FIELD(7, MESSAGE, REPEATED, STATIC, OTHER, Outer, inners, deltas, &Inner_fields),
+    PB_FIELD(8, MESSAGE, OPTIONAL, STATIC, OTHER, Outer, extra, inners, &Inner_fields),
+    PB_FIELD(9, STRING, OPTIONAL, CALLBACK, OTHER, Outer, note, extra, 0),
+    PB_FIELD(10, DOUBLE, OPTIONAL, STATIC, OTHER, Outer, ratio, note, 0),
+    PB_LAST_FIELD
+};
+
+static bool write_note(pb_ostream_t *stream, const pb_field_t *field, void * const *arg)
+{
+    const char *note = (const char*)*arg;
+    return pb_encode_tag_for_field(stream, field) &&
+           pb_encode_string(stream, (const uint8_t*)note, strlen(note));
+}
+
+static void fill_outer(Outer *outer)
+{
+    pb_size_t i;
+
+    memset(outer, 0, sizeof(*outer));
+    outer->id = 300;
+    outer->has_name = true;
+    strcpy(outer->name, "reverse");
+    outer->blob.size = 3;
+    memcpy(outer->blob.bytes, "\x00\x01\xFF", 3);
+    outer->samples_count = 6;
+    for (i = 0; i < 6; i++)
+        outer->samples[i] = 0x01020304u * (i + 1);
+    outer->stamps_count = 3;
+    outer->stamps[0] = 1;
+    outer->stamps[1] = (uint64_t)-1;
+    outer->stamps[2] = ((uint64_t)0x12345678 << 4) | 9;
+    outer->deltas_count = 5;
+    outer->deltas[0] = -1;
+    outer->deltas[1] = 64;
+    outer->deltas[2] = -100000;
+    outer->deltas[3] = 0;
+    outer->deltas[4] = 2147483647;
+    outer->inners_count = 2;
+    outer->inners[0].value = -7;
+    outer->inners[1].value = 7;
+    outer->inners[1].has_stamp = true;
+    outer->inners[1].stamp = 99;
+    outer->has_extra = true;
+    outer->extra.value = 1000;
+    outer->note.funcs.encode = &write_note;
+    outer->note.arg = (void*)"from a callback";
+    outer->has_ratio = true;
+    outer->ratio = -0.125;
+}
+
+/* Encode with both functions into buffers of the given size, and check
+ * that they agree on the result. */
+static bool same_as_forward(const Outer *outer, size_t size)
+{
+    uint8_t forward[256];
+    uint8_t reverse[256];
+    pb_ostream_t fstream = pb_ostream_from_buffer(forward, size);
+    pb_ostream_t rstream = pb_ostream_from_buffer(reverse, size);
+    bool fstatus = pb_encode(&fstream, Outer_fields, outer);
+    bool rstatus = pb_encode_reverse(&rstream, Outer_fields, outer);
+
+    if (fstatus != rstatus)
+        return false;
+
+    return !fstatus || (fstream.bytes_written == rstream.bytes_written &&
+                        memcmp(forward, reverse, fstream.bytes_written) == 0);
+}
+
+int main(void)
+{
+    int status = 0;
+    Outer outer;
+    size_t size;
+
+    fill_outer(&outer);
+
+    {
+        pb_ostream_t sizing = PB_OSTREAM_SIZING;
+        TEST(pb_encode(&sizing, Outer_fields, &outer))
+        size = sizing.bytes_written;
+    }
+
+    COMMENT("Same output as pb_encode()")
+    TEST(same_as_forward(&outer, 256))
+
+    {
+        Outer empty;
+        memset(&empty, 0, sizeof(empty));
+        COMMENT("Empty optional and repeated fields")
+        TEST(same_as_forward(&empty, 256))
+    }
+
+    {
+        uint8_t buffer[256];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, size);
+
+        COMMENT("Exactly enough space, and one byte too little")
+        TEST(pb_encode_reverse(&stream, Outer_fields, &outer))
+        TEST(stream.bytes_written == size)
+
+        stream = pb_ostream_from_buffer(buffer, size - 1);
+        TEST(!pb_encode_reverse(&stream, Outer_fields, &outer))
+        TEST(strcmp(PB_GET_ERROR(&stream), "stream full") == 0)
+    }
+
+    {
+        bool all_ok = true;
+        size_t limit;
+
+        COMMENT("Every buffer size fails or succeeds as with pb_encode()")
+        for (limit = 0; limit <= size; limit++)
+        {
+            if (!same_as_forward(&outer, limit))
+                all_ok = false;
+        }
+        TEST(all_ok)
+    }
+
+    {
+        uint8_t buffer[256];
+        uint8_t expected[256];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        pb_ostream_t reference = pb_ostream_from_buffer(expected, sizeof(expected));
+
+        COMMENT("Appending after earlier data in the stream")
+        TEST(pb_write(&stream, (const uint8_t*)"abc", 3))
+        TEST(pb_encode_reverse(&stream, Outer_fields, &outer))
+        TEST(pb_encode(&reference, Outer_fields, &outer))
+        TEST(stream.bytes_written == 3 + reference.bytes_written)
+        TEST(memcmp(buffer, "abc", 3) == 0 &&
+             memcmp(buffer + 3, expected, reference.bytes_written) == 0)
+    }
+
+    {
+        pb_ostream_t sizing = PB_OSTREAM_SIZING;
+        COMMENT("Other streams are encoded forwards")
+        TEST(pb_encode_reverse(&sizing, Outer_fields, &outer))
+        TEST(sizing.bytes_written == size)
+    }
+
+    {
+        uint8_t buffer[256];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+        outer.samples_count = 7;
+        COMMENT("Too many array entries")
+        TEST(!pb_encode_reverse(&stream, Outer_fields, &outer))
+        TEST(strcmp(PB_GET_ERROR(&stream), "array max size exceeded") == 0)
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -0,0 +1,218 @@
+/* Tests for the submessage size cache of the encoder.
+ *
+ * Build and run from the repository root:
+ *    cc -DPB_ENABLE_SIZE_CACHE -DPB_FIELD_16BIT -fsanitize=address,undefined \
+ *       -I. -Itests tests/size_cache_tests.c pb_common.c pb_encode.c
+ *    ./a.out
+ */
+
+#include <string.h>
+#include <pb_encode.h>
+#include "unittests.h"
+
+typedef struct {
+    int32_t value;
+    bool has_text;
+    char text[160];
+    pb_callback_t note;
+} Leaf;
+
+typedef struct {
+    Leaf first;
+    Leaf second;
+} Branch;
+
+typedef struct {
+    uint32_t id;
+    Branch branch;
+    Leaf other;
+} Root;
+
+static const pb_field_t Leaf_fields[4] = {
+    PB_FIELD(1, INT32, REQUIRED, STATIC, FIRST, Leaf, value, value, 0),
+    PB_FIELD(2, STRING, OPTIONAL, STATIC, OTHER, Leaf, text, value, 0),
+    PB_FIELD(3, STRING, OPTIONAL, CALLBACK, OTHER, Leaf, note, text, 0),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t Branch_fields[3] = {
+    PB_FIELD(1, MESSAGE, REQUIRED, STATIC, FIRST, Branch, first, first, &Leaf_fields),
+    PB_FIELD(2, MESSAGE, REQUIRED, STATIC, OTHER, Branch, second, first, &Leaf_fields),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t Root_fields[4] = {
+    PB_FIELD(1, UINT32, REQUIRED, STATIC, FIRST, Root, id, id, 0),
+    PB_FIELD(2, MESSAGE, REQUIRED, STATIC, OTHER, Root, branch, id, &Branch_fields),
+    PB_FIELD(3, MESSAGE, REQUIRED, STATIC, OTHER, Root, other, branch, &Leaf_fields),
+    PB_LAST_FIELD
+};
+
+/* Number of times a note has been encoded, in sizing and writing passes */
+static unsigned note_calls;
+
+static bool write_note(pb_ostream_t *stream, const pb_field_t *field, void * const *arg)
+{
+    PB_UNUSED(arg);
+    note_calls++;
+    return pb_encode_tag_for_field(stream, field) &&
+           pb_encode_string(stream, (const uint8_t*)"note", 4);
+}
+
+static void fill_leaf(Leaf *leaf, int32_t value)
+{
+    leaf->value = value;
+    leaf->note.funcs.encode = &write_note;
+    leaf->note.arg = NULL;
+}
+
+static void fill_root(Root *root)
+{
+    memset(root, 0, sizeof(*root));
+    root->id = 7;
+    fill_leaf(&root->branch.first, 1);
+    fill_leaf(&root->branch.second, -2);
+    fill_leaf(&root->other, 3);
+
+    /* Longer than 127 bytes, so its length prefix takes 2 bytes */
+    root->branch.second.has_text = true;
+    memset(root->branch.second.text, 'x', 150);
+}
+
+/* Memory stream that is not recognized as a buffer stream, so that
+ * submessages are sized before they are written */
+static bool memory_write(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+{
+    uint8_t **dest = (uint8_t**)stream->state;
+    memcpy(*dest, buf, count);
+    *dest += count;
+    return true;
+}
+
+static bool encode_two_pass(const Root *root, pb_size_cache_t *cache,
+                            uint8_t *buffer, size_t *size)
+{
+    uint8_t *dest = buffer;
+    pb_ostream_t stream;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.callback = &memory_write;
+    stream.state = &dest;
+    stream.max_size = 512;
+    stream.size_cache = cache;
+
+    if (!pb_encode(&stream, Root_fields, root))
+        return false;
+
+    *size = stream.bytes_written;
+    return true;
+}
+
+static bool encode_buffer(const Root *root, pb_size_cache_t *cache,
+                          uint8_t *buffer, size_t *size)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, 512);
+    stream.size_cache = cache;
+
+    if (!pb_encode(&stream, Root_fields, root))
+        return false;
+
+    *size = stream.bytes_written;
+    return true;
+}
+
+int main(void)
+{
+    int status = 0;
+    Root root;
+    pb_size_cache_entry_t entries[8];
+    pb_size_cache_t cache;
+    uint8_t expected[512];
+    uint8_t buffer[512];
+    size_t expected_size;
+    size_t size;
+
+    fill_root(&root);
+    pb_size_cache_init(&cache, entries, 8);
+
+    COMMENT("Reference encoding without a cache")
+    TEST(encode_buffer(&root, NULL, expected, &expected_size))
+
+    {
+        size_t cached_size;
+
+        COMMENT("Sizes are stored for the message and its submessages")
+        note_calls = 0;
+        TEST(pb_get_encoded_size_cached(&cached_size, Root_fields, &root, &cache))
+        TEST(cached_size == expected_size)
+        TEST(cache.count == 5)
+        TEST(note_calls == 3)
+
+        COMMENT("A known size is returned without encoding")
+        note_calls = 0;
+        TEST(pb_get_encoded_size_cached(&cached_size, Root_fields, &root, &cache))
+        TEST(cached_size == expected_size && note_calls == 0)
+    }
+
+    {
+        COMMENT("Two-pass streams skip the sizing pass of known submessages")
+        note_calls = 0;
+        TEST(encode_two_pass(&root, &cache, buffer, &size))
+        TEST(size == expected_size && memcmp(buffer, expected, size) == 0)
+        TEST(note_calls == 3)
+
+        /* Without the cache, the leaves in the branch are also sized once
+         * more when the branch itself is sized */
+        note_calls = 0;
+        TEST(encode_two_pass(&root, NULL, buffer, &size))
+        TEST(note_calls == 8)
+    }
+
+    {
+        COMMENT("Buffer streams give the same output with known sizes")
+        TEST(encode_buffer(&root, &cache, buffer, &size))
+        TEST(size == expected_size && memcmp(buffer, expected, size) == 0)
+    }
+
+    {
+        COMMENT("Invalidating a field forgets the submessages around it")
+        root.branch.first.value = 100000;
+        pb_size_cache_invalidate(&cache, &root.branch.first.value);
+        TEST(cache.count == 2)
+
+        TEST(encode_buffer(&root, NULL, expected, &expected_size))
+        TEST(encode_two_pass(&root, &cache, buffer, &size))
+        TEST(size == expected_size && memcmp(buffer, expected, size) == 0)
+
+        /* pb_encode() stores the submessages, but not the message itself */
+        TEST(cache.count == 4)
+    }
+
+    {
+        COMMENT("A stale size is detected when the data is written")
+        root.other.value = -100000;
+        TEST(!encode_buffer(&root, &cache, buffer, &size))
+        TEST(!encode_two_pass(&root, &cache, buffer, &size))
+
+        pb_size_cache_clear(&cache);
+        TEST(cache.count == 0)
+        TEST(encode_buffer(&root, &cache, buffer, &size))
+        TEST(encode_buffer(&root, NULL, expected, &expected_size))
+        TEST(size == expected_size && memcmp(buffer, expected, size) == 0)
+    }
+
+    {
+        pb_size_cache_t small;
+
+        COMMENT("Sizes that do not fit in the cache are not stored")
+        pb_size_cache_init(&small, entries, 2);
+        TEST(encode_two_pass(&root, &small, buffer, &size))
+        TEST(size == expected_size && memcmp(buffer, expected, size) == 0)
+        TEST(small.count == 2)
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -0,0 +1,233 @@
+/* Tests for keeping unknown fields with pb_decode_keep_unknown() and
+ * writing them back with pb_encode_keep_unknown().
+ *
+ * Build and run from the repository root:
+ *    cc -fsanitize=address,undefined -I. -Itests tests/unknown_fields_tests.c \
+ *       pb_common.c pb_encode.c pb_decode.c
+ *    ./a.out
+ */
+
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "unittests.h"
+
+typedef struct {
+    int32_t value;
+} Inner;
+
+/* Newer version of the message */
+typedef struct {
+    uint32_t id;
+    bool has_label;
+    char label[16];
+    int32_t count;
+    bool has_inner;
+    Inner inner;
+    pb_size_t samples_count;
+    uint32_t samples[4];
+    bool has_ratio;
+    double ratio;
+} Version2;
+
+/* Older version, without fields 2, 4, 5 and 6 */
+typedef struct {
+    uint32_t id;
+    int32_t count;
+} Version1;
+
+static const pb_field_t Inner_fields[2] = {
+    PB_FIELD(1, INT32, REQUIRED, STATIC, FIRST, Inner, value, value, 0),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t Version2_fields[7] = {
+    PB_FIELD(1, UINT32, REQUIRED, STATIC, FIRST, Version2, id, id, 0),
+    PB_FIELD(2, STRING, OPTIONAL, STATIC, OTHER, Version2, label, id, 0),
+    PB_FIELD(3, INT32, REQUIRED, STATIC, OTHER, Version2, count, label, 0),
+    PB_FIELD(4, MESSAGE, OPTIONAL, STATIC, OTHER, Version2, inner, count, &Inner_fields),
+    PB_FIELD(5, FIXED32, REPEATED, STATIC, OTHER, Version2, samples, inner, 0),
+    PB_FIELD(6, DOUBLE, OPTIONAL, STATIC, OTHER, Version2, ratio, samples, 0),
+    PB_LAST_FIELD
+};
+
+static const pb_field_t Version1_fields[3] = {
+    PB_FIELD(1, UINT32, REQUIRED, STATIC, FIRST, Version1, id, id, 0),
+    PB_FIELD(3, INT32, REQUIRED, STATIC, OTHER, Version1, count, id, 0),
+    PB_LAST_FIELD
+};
+
+static Version2 original;
+
+static size_t encode_version2(uint8_t *buffer, size_t size)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, size);
+
+    memset(&original, 0, sizeof(original));
+    original.id = 99;
+    original.has_label = true;
+    strcpy(original.label, "forwarded");
+    original.count = -5;
+    original.has_inner = true;
+    original.inner.value = 123456;
+    original.samples_count = 3;
+    original.samples[0] = 1;
+    original.samples[1] = 0xFFFFFFFF;
+    original.samples[2] = 77;
+    original.has_ratio = true;
+    original.ratio = 0.75;
+
+    if (!pb_encode(&stream, Version2_fields, &original))
+        return 0;
+
+    return stream.bytes_written;
+}
+
+/* Memory stream that the decoder does not recognize as a buffer */
+static bool memory_read(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    uint8_t *source = (uint8_t*)stream->state;
+    memcpy(buf, source, count);
+    stream->state = source + count;
+    return true;
+}
+
+/* Re-encode through the old version with one field changed, then decode
+ * with the new version. */
+static bool forward(pb_istream_t *stream, pb_unknown_fields_t *unknown, Version2 *result)
+{
+    Version1 old;
+    uint8_t output[256];
+    pb_ostream_t ostream = pb_ostream_from_buffer(output, sizeof(output));
+    pb_istream_t istream;
+
+    if (!pb_decode_keep_unknown(stream, Version1_fields, &old, unknown))
+        return false;
+
+    old.count++;
+    if (!pb_encode_keep_unknown(&ostream, Version1_fields, &old, unknown))
+        return false;
+
+    istream = pb_istream_from_buffer(output, ostream.bytes_written);
+    memset(result, 0, sizeof(*result));
+    return pb_decode(&istream, Version2_fields, result);
+}
+
+static bool same_except_count(const Version2 *a, const Version2 *b)
+{
+    return a->id == b->id && a->count + 1 == b->count &&
+           a->has_label == b->has_label && strcmp(a->label, b->label) == 0 &&
+           a->has_inner == b->has_inner && a->inner.value == b->inner.value &&
+           a->samples_count == b->samples_count &&
+           memcmp(a->samples, b->samples, sizeof(a->samples)) == 0 &&
+           a->has_ratio == b->has_ratio && a->ratio == b->ratio;
+}
+
+static void init_unknown(pb_unknown_fields_t *unknown, pb_unknown_span_t *spans,
+                         size_t max_spans, uint8_t *copies, size_t copies_size)
+{
+    memset(unknown, 0, sizeof(*unknown));
+    unknown->spans = spans;
+    unknown->max_spans = max_spans;
+    unknown->copy_buffer = copies;
+    unknown->copy_buffer_size = copies_size;
+}
+
+static bool inside(const void *ptr, const void *area, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)ptr;
+    return p >= (const uint8_t*)area && p < (const uint8_t*)area + size;
+}
+
+int main(void)
+{
+    int status = 0;
+    uint8_t input[256];
+    size_t size = encode_version2(input, sizeof(input));
+    Version2 result;
+
+    COMMENT("Encoding the new version")
+    TEST(size > 0)
+
+    {
+        pb_unknown_span_t spans[4];
+        pb_unknown_fields_t unknown;
+        pb_istream_t stream = pb_istream_from_buffer(input, size);
+
+        init_unknown(&unknown, spans, 4, NULL, 0);
+        COMMENT("Buffer stream: spans refer to the input")
+        TEST(forward(&stream, &unknown, &result))
+        TEST(same_except_count(&original, &result))
+        TEST(unknown.span_count == 2)
+        TEST(inside(spans[0].data, input, size) && inside(spans[1].data, input, size))
+
+        /* Fields 4, 5 and 6 are next to each other in the input */
+        TEST(spans[1].data + spans[1].size == input + size)
+    }
+
+    {
+        uint8_t copies[128];
+        pb_unknown_span_t spans[8];
+        pb_unknown_fields_t unknown;
+        pb_istream_t stream;
+
+        init_unknown(&unknown, spans, 8, copies, sizeof(copies));
+        memset(&stream, 0, sizeof(stream));
+        stream.callback = &memory_read;
+        stream.state = input;
+        stream.bytes_left = size;
+
+        COMMENT("Callback stream: fields are copied")
+        TEST(forward(&stream, &unknown, &result))
+        TEST(same_except_count(&original, &result))
+        TEST(unknown.span_count > 0 && inside(spans[0].data, copies, sizeof(copies)))
+        TEST(unknown.copy_buffer_used < size)
+    }
+
+    {
+        uint8_t copies[8];
+        pb_unknown_span_t spans[8];
+        pb_unknown_fields_t unknown;
+        Version1 old;
+        pb_istream_t stream;
+
+        init_unknown(&unknown, spans, 8, copies, sizeof(copies));
+        memset(&stream, 0, sizeof(stream));
+        stream.callback = &memory_read;
+        stream.state = input;
+        stream.bytes_left = size;
+
+        COMMENT("Copy buffer too small")
+        TEST(!pb_decode_keep_unknown(&stream, Version1_fields, &old, &unknown))
+        TEST(strcmp(PB_GET_ERROR(&stream), "unknown fields overflow") == 0)
+    }
+
+    {
+        pb_unknown_span_t spans[1];
+        pb_unknown_fields_t unknown;
+        Version1 old;
+        pb_istream_t stream = pb_istream_from_buffer(input, size);
+
+        init_unknown(&unknown, spans, 1, NULL, 0);
+        COMMENT("Too few spans")
+        TEST(!pb_decode_keep_unknown(&stream, Version1_fields, &old, &unknown))
+        TEST(strcmp(PB_GET_ERROR(&stream), "unknown fields overflow") == 0)
+    }
+
+    {
+        pb_unknown_span_t spans[4];
+        pb_unknown_fields_t unknown;
+        pb_istream_t stream = pb_istream_from_buffer(input, size);
+        Version2 decoded;
+
+        init_unknown(&unknown, spans, 4, NULL, 0);
+        COMMENT("No unknown fields when the versions match")
+        TEST(pb_decode_keep_unknown(&stream, Version2_fields, &decoded, &unknown))
+        TEST(unknown.span_count == 0)
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}